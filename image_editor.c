@@ -1,8 +1,29 @@
 // Copyright Ungureanu Vlad-Marin 315CAa 2023-2024
 
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 // Maximum pixel value in the image
 #define MAX_VALUE 255
@@ -13,15 +34,152 @@
 // Maximum length of an input line
 #define MAX_INPUT_LINE_LENGTH 1000
 
-// Maximum number of digits in a numerical parameter
-#define MAX_NUMBER_SIZE 5
+// Maximum length of a command or parameter (a number, a keyword such as
+// "BILINEAR" or a file name)
+#define MAX_PARAMETER_LENGTH (FILE_NAME_LENGTH - 1)
+
+// Maximum number of parameters of a command
+#define MAX_PARAMETERS 5
+
+// Size of the buffer the commands are read into
+#define READ_BUFFER_SIZE 65536
+
+// Size of the hash table of the commands (a power of two)
+#define DISPATCH_TABLE_SIZE 64
+
+// Maximum number of freed blocks kept by the pool to be reused
+#define POOL_BLOCKS 32
+
+// Maximum memory of the freed blocks kept by the pool (MiB)
+#define POOL_MEMORY_LIMIT 256
+
+// Size of the header in front of each block of the pool, which keeps the
+// data aligned to a cache line
+#define BLOCK_HEADER_SIZE 64
+
+// Size of a huge page; the blocks at least this big are mapped directly
+#define HUGE_PAGE_SIZE 2097152
+
+// Size of the blocks of lines read from a file while the previous block is
+// decoded
+#define DECODE_BLOCK_SIZE 1048576
+
+// Size of the buffer each thread formats the lines of an ASCII file into
+#define ENCODE_BUFFER_SIZE 1048576
+
+// Magic string of the native container format
+#define NATIVE_MAGIC "IMGTILE"
+
+// Format number of the native container (the PNM formats use their magic
+// number)
+#define NATIVE_FORMAT 0
+
+// Number of lines of each tile of the native container format
+#define NATIVE_TILE_LINES 16
+
+// Magic string of the index of the lines of an ASCII file
+#define INDEX_MAGIC "PNMIDX1"
+
+// Maximum number of images that can be loaded at the same time
+#define MAX_SLOTS 16
+
+// Maximum radius of the BLUR and GAUSSIAN_BLUR filters
+#define MAX_BLUR_RADIUS 255
+
+// Weights of the red, green and blue channels in the luma of BT.601 and
+// BT.709, in 1/65536ths (they add up to 65536)
+#define BT601_RED 19595
+#define BT601_GREEN 38470
+#define BT601_BLUE 7471
+#define BT709_RED 13933
+#define BT709_GREEN 46871
+#define BT709_BLUE 4732
+
+// Largest width or height of the structuring elements of MORPH
+#define MAX_ELEMENT_SIZE 511
+
+// Number of coarse bins of the histograms of the rank filters, each one
+// counting MAX_VALUE + 1 / COARSE_BINS consecutive values
+#define COARSE_BINS 16
+
+// Maximum number of threads used by the parallel commands
+#define MAX_THREADS 64
+
+// Number of lines of the bands of the histogram of an image, each band being
+// counted again as a whole when some of its pixels change
+#define HISTOGRAM_BAND_LINES 32
+
+// Side of the square tiles saved by the history of an image
+#define HISTORY_TILE_SIZE 64
+
+// Default memory limit of the history of each image (MiB)
+#define HISTORY_MEMORY_LIMIT 64
+
+// Maximum number of images kept in the cache of the daemon mode
+#define MAX_CACHED_IMAGES 32
+
+// Default memory budget of the images processed at once in batch mode (MiB)
+#define BATCH_MEMORY_LIMIT 1024
+
+// Minimum number of lines worth giving to a separate thread
+#define MIN_LINES_PER_THREAD 64
+
+// Side of the square tiles processed at once by the arbitrary rotation
+#define ROTATION_TILE_SIZE 64
+
+// Number of fractional bits of the fixed-point coordinates
+#define FIXED_POINT_BITS 16
+
+// Number of fractional bits of the fixed-point resampling weights
+#define WEIGHT_BITS 14
+
+// Shift of the multiplications replacing the divisions of the filters
+#define DIVIDER_SHIFT 56
+
+// Largest sum of weights whose divisions are replaced by multiplications
+// (the dividends being below 2^32, every quotient is then exact)
+#define MAX_DIVIDER 8388608ULL
+
+// Number of values of the blocks taken at once by the morphological
+// operations (the bytes of a vector register)
+#define MAX_BLOCK_VALUES 16
 
-// Maximum length of a command (e.g., "LOAD", "SAVE")
-#define MAX_COMMAND_LENGTH 11
+// Maximum number of levels of an image pyramid (including the image)
+#define MAX_PYRAMID_LEVELS 17
+
+// Minimum number of pixels of the pyramid level used by approximations
+#define MIN_APPROXIMATE_PIXELS 65536
+
+// Largest number of pixels whose channel values add up to less than 2^32,
+// summed from the narrow table of the integral image (see integral_t)
+#define MAX_NARROW_PIXELS (UINT_MAX / MAX_VALUE)
 
 // Custom boolean type for improved readability
 typedef enum { false, true } bool;
 
+// How the filters treat the pixels near the edges of the image: kept as
+// they are, or filtered with the pixels outside of the image taken from the
+// nearest edge, mirrored from inside the image, or from the opposite edge
+typedef enum { BORDER_KEEP, BORDER_CLAMP, BORDER_MIRROR, BORDER_WRAP } border_t;
+
+// Structure representing the header of a block of memory of the pool
+typedef struct block_t {
+	size_t size; // Size of the block, without the header
+	size_t mapped; // Size of the mapping of the block (0 if from malloc)
+	bool fresh; // Whether the pages of the block were never touched
+	unsigned int shared; // Number of other images sharing the picture of the
+						 // block (see share_picture())
+} block_t;
+
+// Structure representing the pool of freed blocks, reused by the next
+// allocations of (about) the same size instead of going back to malloc
+typedef struct pool_t {
+	pthread_mutex_t lock; // Lock protecting the blocks
+	block_t *blocks[POOL_BLOCKS]; // The freed blocks
+	unsigned short count; // Number of freed blocks
+	unsigned long long memory; // Memory of the freed blocks
+} pool_t;
+
 // Structure representing a pixel in an image
 typedef struct pixel_t {
 	unsigned short red; // Red channel intensity (0 to 255)
@@ -29,13 +187,83 @@ typedef struct pixel_t {
 	unsigned short blue; // Blue channel intensity (0 to 255)
 } pixel_t;
 
-// Structure representing an image
-typedef struct image_t {
-	pixel_t **picture; // 2D array representing the image pixels
-	bool color; // Flag indicating whether the image is color or grayscale
-	unsigned short height; // Height of the image in pixels
-	unsigned short width; // Width of the image in pixels
-} image_t;
+// Structure representing the per-channel sum of a window of pixels
+typedef struct sum_t {
+	unsigned long long red; // Sum of the red channel intensities
+	unsigned long long green; // Sum of the green channel intensities
+	unsigned long long blue; // Sum of the blue channel intensities
+} sum_t;
+
+// Structure representing a per-channel sum kept modulo 2^32: the difference
+// of two of them is exact when the pixels in between add up to less than that
+// (see MAX_NARROW_PIXELS)
+typedef struct narrow_sum_t {
+	unsigned int red; // Sum of the red channel intensities
+	unsigned int green; // Sum of the green channel intensities
+	unsigned int blue; // Sum of the blue channel intensities
+} narrow_sum_t;
+
+// Structure representing a multi-resolution pyramid of an image, where each
+// level halves the dimensions of the previous one by averaging 2x2 pixels
+typedef struct pyramid_t {
+	unsigned short levels; // Number of levels, the first one being the image
+	pixel_t **pictures[MAX_PYRAMID_LEVELS]; // Pixels of each level (but the
+											// first, which is not copied)
+	unsigned short heights[MAX_PYRAMID_LEVELS]; // Height of each level
+	unsigned short widths[MAX_PYRAMID_LEVELS]; // Width of each level
+} pyramid_t;
+
+// Structure representing the integral image (summed-area table) of an image:
+// each element holds the sum of the pixels above and to the left of it, so
+// the sum over any area takes four lookups. The channel values are summed
+// modulo 2^32, which halves their table, so only the areas of at most
+// MAX_NARROW_PIXELS pixels are added up from it
+typedef struct integral_t {
+	narrow_sum_t *sums; // (height + 1) x (width + 1) sums of the channel
+						// values
+	sum_t *squares; // (height + 1) x (width + 1) sums of their squares
+	unsigned short height; // Height of the image it was built for
+	unsigned short width; // Width of the image it was built for
+	unsigned short dirty_line; // First line modified since it was up to
+							   // date (the height if none)
+	unsigned short dirty_column; // First column modified since it was up to
+								 // date (the width if none)
+} integral_t;
+
+// Structure representing the number of pixels of each value of each channel
+// of an image, also kept for each band of HISTOGRAM_BAND_LINES lines so that
+// only the modified bands are counted again
+typedef struct histogram_t {
+	unsigned short height; // Height of the image it was built for
+	unsigned short width; // Width of the image it was built for
+	unsigned short bands; // Number of bands
+	unsigned long counts[3][MAX_VALUE + 1]; // Counts of the whole image
+	unsigned int (*band_counts)[3][MAX_VALUE + 1]; // Counts of each band
+	bool *stale; // Whether each band must be counted again
+} histogram_t;
+
+// Structure representing the binary file an image was last saved to, with
+// the pixels modified since, which SAVE rewrites in place
+typedef struct target_t {
+	char name[FILE_NAME_LENGTH]; // The name of the file
+	unsigned short magic_number; // Format of the file (5 or 6)
+	unsigned short height; // Height of the image saved
+	unsigned short width; // Width of the image saved
+	off_t offset; // Position of the first pixel in the file
+	struct stat status; // Status of the file once written
+	unsigned short *starts; // First modified column of each line
+	unsigned short *ends; // Column after the last modified one of each line
+						  // (the first one if none)
+} target_t;
+
+// Structure describing a rounded division of the sums of a filter by the
+// sum of its weights, done with a multiplication and a shift where they give
+// the exact result
+typedef struct divider_t {
+	unsigned long long divisor; // The sum of the weights
+	unsigned long long multiplier; // 2^DIVIDER_SHIFT / (2 * divisor),
+								   // rounded up (0 to divide instead)
+} divider_t;
 
 // Structure representing an area within an image
 typedef struct area_t {
@@ -48,6 +276,335 @@ typedef struct area_t {
 	    line_end; // Ending line index (exclusive) of the selected area
 } area_t;
 
+// Structure representing the file an image was loaded from, for the lines
+// that were not decoded yet
+typedef struct source_t {
+	int file; // File descriptor of the file (a duplicate, owned)
+	unsigned short magic_number; // Format of the file (2, 3, 5, 6 or
+								 // NATIVE_FORMAT)
+	unsigned short max_value; // Maximum pixel value specified in the file
+	unsigned char scale[MAX_VALUE + 1]; // Each value up to MAX_VALUE,
+										// scaled to the range of the pixels
+	unsigned short tile_lines; // Lines of each tile, the lines being decoded
+							   // by whole tiles (1 for the PNM formats)
+	off_t *offsets; // Offset of each tile in the file, and of the end
+	bool *decoded; // Whether each line was decoded
+	unsigned short remaining; // Number of lines not decoded yet
+} source_t;
+
+// Structure representing one step of the history of an image: the pixels of
+// the tiles a command was about to change, or the whole picture it replaced,
+// and the image before it
+typedef struct step_t {
+	struct step_t *next; // The step before it (after it, for the REDO steps)
+	unsigned short height; // Height of the image before the step
+	unsigned short width; // Width of the image before the step
+	bool color; // Whether the image was a color image before the step
+	area_t area; // The saved area, made of whole tiles
+	pixel_t *pixels; // The saved pixels, line after line (or NULL)
+	pixel_t **picture; // The replaced picture (NULL if tiles were saved)
+	source_t *source; // The lines of that picture not decoded yet (or NULL)
+} step_t;
+
+// Structure representing the history of an image, used by UNDO and REDO
+typedef struct history_t {
+	step_t *undo; // The steps to be undone, the most recent first
+	step_t *redo; // The steps to be redone, the most recent first
+	unsigned long long memory; // Memory used by the steps
+	unsigned long long limit; // Maximum memory used by the steps
+} history_t;
+
+// Structure representing an image
+typedef struct image_t {
+	pixel_t **picture; // 2D array representing the image pixels
+	source_t *source; // The lines not decoded yet (NULL once all are)
+	pyramid_t *pyramid; // Optional pyramid of the image (NULL if not built)
+	integral_t *integral; // Integral image, built when needed (or NULL)
+	histogram_t *histogram; // Counts of the values, built when needed (or
+							// NULL)
+	target_t *target; // The binary file it was last saved to (or NULL)
+	history_t *history; // History of the changes of the image (or NULL)
+	bool color; // Flag indicating whether the image is color or grayscale
+	unsigned short height; // Height of the image in pixels
+	unsigned short width; // Width of the image in pixels
+} image_t;
+
+// Structure representing a named image slot, holding an image and its own
+// selection
+typedef struct slot_t {
+	char name[FILE_NAME_LENGTH]; // Name of the slot (empty for the default)
+	image_t image; // The image of the slot (NULL picture if not loaded)
+	area_t selection; // The selected area of the image
+} slot_t;
+
+// Structure representing a session of commands working on several images
+typedef struct session_t {
+	slot_t slots[MAX_SLOTS]; // The image slots, the first being the default
+	unsigned short count; // Number of slots in use
+	unsigned short current; // Index of the slot the commands work on
+	bool pyramid; // Whether the pyramid of each loaded image is built
+	unsigned long long history_limit; // Memory limit of each history
+	struct save_t *saves; // SAVE commands still writing in the background
+} session_t;
+
+// Structure representing a command line split into words, which point into
+// the line itself
+typedef struct command_t {
+	char *name; // The command (empty for an empty or invalid line)
+	char *parameters[MAX_PARAMETERS]; // The parameters (empty if missing)
+} command_t;
+
+// Structure representing a buffered reader of command lines
+typedef struct reader_t {
+	int file; // The file descriptor the lines are read from
+	char buffer[READ_BUFFER_SIZE]; // The bytes read so far
+	size_t start; // Index of the first byte not returned yet
+	size_t end; // Index after the last byte read
+	bool skipping; // Whether the rest of a line too long is being dropped
+} reader_t;
+
+// Structure representing an entry of the hash table of the commands
+typedef struct dispatch_t {
+	const char *name; // The command (NULL for an empty entry)
+	void (*handle)(session_t *, command_t *); // Function executing it
+	bool lazy; // Whether it decodes the lines it needs itself (otherwise the
+			   // whole current image is decoded before it runs)
+} dispatch_t;
+
+// Structure describing the lines of an area processed by one thread
+typedef struct job_t {
+	void (*work)(void *data, unsigned short start, unsigned short end);
+	void *data; // Data shared by all of the threads
+	unsigned short start; // First line processed by the thread
+	unsigned short end; // Line after the last one processed by the thread
+} job_t;
+
+// Structure describing a picture copied by several threads
+typedef struct copying_t {
+	pixel_t **source; // The picture to be copied
+	pixel_t **copy; // The copy
+	unsigned short width; // The width of the pictures
+} copying_t;
+
+// Structure describing how the pixels of one axis are resampled: each output
+// pixel is the weighted sum of the same number of source pixels (taps)
+typedef struct resampling_t {
+	unsigned long taps; // Number of source pixels for each output pixel
+	unsigned short *indexes; // Source pixels, taps for each output pixel
+	signed int *weights; // Weights, taps for each output pixel
+	divider_t divider; // Division of the weighted sums by the sum of the
+					   // weights
+} resampling_t;
+
+// Structure holding the data needed by one pass of the RESIZE command
+typedef struct resize_t {
+	pixel_t **source; // The lines of the source picture
+	unsigned short column_start; // First source column to be read
+	pixel_t **destination; // The lines of the resulting picture
+	unsigned short width; // Number of columns of the resulting picture
+	resampling_t resampling; // The resampling of the processed axis
+} resize_t;
+
+// Structure holding the data needed to compute an area of a pyramid level
+typedef struct shrink_t {
+	pixel_t **source; // The pixels of the previous level
+	unsigned short source_height; // The height of the previous level
+	unsigned short source_width; // The width of the previous level
+	pixel_t **destination; // The pixels of the level being computed
+	unsigned short line_start; // First line of the level to be computed
+	unsigned short column_start; // First column of the level to be computed
+	unsigned short column_end; // Column after the last one to be computed
+} shrink_t;
+
+// Structure holding the data needed to convert the lines of an image to
+// their luma
+typedef struct luma_t {
+	pixel_t **picture; // The pixels of the image (replaced)
+	unsigned short width; // The width of the image
+	unsigned int red; // Weight of the red channel (the three add up to 65536)
+	unsigned int green; // Weight of the green channel
+	unsigned int blue; // Weight of the blue channel
+} luma_t;
+
+// Structure holding the data needed to rotate an area by any angle
+typedef struct rotation_t {
+	image_t *image; // The image to be rotated
+	area_t selection; // The area to be rotated
+	pixel_t **source; // Copy of the area before the rotation
+	long long cosine; // Cosine of the angle, in fixed point
+	long long sine; // Sine of the angle, in fixed point
+	bool bilinear; // Whether to interpolate between the source pixels
+} rotation_t;
+
+// Structure describing a run of lines of an image decoded in parallel
+typedef struct decoding_t {
+	image_t *image; // The image being decoded
+	unsigned short start; // First line of the run
+} decoding_t;
+
+// Structure describing an image being written to a file in ASCII format
+typedef struct encoding_t {
+	image_t image; // The image being written
+	int file; // File descriptor of the file
+	off_t start; // Offset of the pixels in the file
+	size_t line_length; // Length of each line of pixels in the file
+	char *buffer; // The whole pixels, if the file has no offsets (or NULL)
+	pthread_mutex_t lock; // Lock protecting the result
+	bool failed; // Whether some lines could not be written
+} encoding_t;
+
+// Structure describing a rank filter (such as the median) applied to an
+// area of an image by several threads
+typedef struct ranking_t {
+	image_t image; // The image to be filtered
+	area_t area; // The area to be filtered
+	unsigned short radius; // The radius of the filter
+	unsigned long rank; // Rank of the value kept, among the sorted values
+						// of the window
+	pixel_t **filtered; // The filtered pixels of the area
+	pthread_mutex_t lock; // Lock protecting the result
+	bool failed; // Whether memory could not be allocated for some lines
+} ranking_t;
+
+// Structure describing the blocks of tiles of a file read by a separate
+// thread while the previous block is decoded
+typedef struct reading_t {
+	source_t *source; // The file being read
+	unsigned short start; // First tile to be read
+	unsigned short end; // Tile after the last one to be read
+	unsigned char *blocks[2]; // The blocks read and not decoded yet (NULL
+							  // if memory could not be allocated)
+	unsigned int read; // Number of blocks read
+	unsigned int decoded; // Number of blocks decoded
+	pthread_mutex_t lock; // Lock protecting the blocks and the counts
+	pthread_cond_t changed; // Signaled when one of the counts changes
+} reading_t;
+
+// Structure representing the header of a file in the native container
+// format, followed by the offsets of the tiles (as in source_t) and the
+// tiles, each compressed on its own
+typedef struct native_t {
+	char magic[sizeof(NATIVE_MAGIC)]; // NATIVE_MAGIC
+	unsigned short height; // Height of the image
+	unsigned short width; // Width of the image
+	unsigned short color; // Whether the image is a color image
+	unsigned short tile_lines; // Lines of each tile
+} native_t;
+
+// Structure describing an image being compressed in parallel, as the tiles
+// of a native file
+typedef struct packing_t {
+	image_t image; // The image being compressed
+	unsigned char **tiles; // The compressed bytes of each tile (or NULL)
+	size_t *lengths; // The number of compressed bytes of each tile
+} packing_t;
+
+// Structure representing the header of the index of the lines of an ASCII
+// file, kept next to it (in <file_name>.idx) and followed by the offsets
+typedef struct index_t {
+	char magic[sizeof(INDEX_MAGIC)]; // INDEX_MAGIC
+	off_t size; // Size of the file when it was indexed
+	time_t modified; // Modification time of the file when it was indexed
+	unsigned short magic_number; // Format of the file
+	unsigned short height; // Height of the image
+	unsigned short width; // Width of the image
+} index_t;
+
+// Structure describing the programs that compress the files with a suffix,
+// which read from STDIN and write to STDOUT
+typedef struct codec_t {
+	char *suffix; // The suffix of the files (e.g. ".gz")
+	char *programs[2]; // The programs, by order of preference (or NULL)
+	char *decompress[3]; // Options to decompress (NULL-terminated)
+	char *compress[3]; // Options to compress (NULL-terminated)
+} codec_t;
+
+// Structure representing an image kept in the cache of the daemon mode
+typedef struct cache_entry_t {
+	char file_name[FILE_NAME_LENGTH]; // Name of the file of the image
+	time_t modified; // Modification time of the file when it was loaded
+	off_t size; // Size of the file when it was loaded
+	image_t image; // The image, sharing its picture, never modified
+} cache_entry_t;
+
+// Structure representing the images loaded by all the clients of the daemon,
+// shared between them for reading
+typedef struct cache_t {
+	pthread_rwlock_t lock; // Lock protecting the entries
+	cache_entry_t entries[MAX_CACHED_IMAGES]; // The cached images
+	unsigned short count; // Number of entries in use
+	unsigned short next; // Entry to be replaced next when the cache is full
+} cache_t;
+
+// Structure describing the thread a command runs on: where its messages go,
+// how many threads it may start and which images it may share
+typedef struct context_t {
+	FILE *output; // Stream receiving the messages of the commands
+	unsigned short threads; // Threads per command (0 for the default)
+	cache_t *cache; // Cache of the loaded images (NULL if not shared)
+} context_t;
+
+// Structure describing a SAVE command writing the pixels of an image in the
+// background (thread entry point argument)
+typedef struct save_t {
+	pthread_t thread; // The thread writing the file
+	char file_name[FILE_NAME_LENGTH]; // The name of the file
+	FILE *file; // The file, its header already written
+	pid_t compressor; // The program compressing the file (0 if none)
+	image_t image; // A copy of the image (owned)
+	unsigned short magic_number; // Format of the file
+	unsigned short threads; // Threads used to write the file
+	bool written; // Whether the file was written (set by the thread)
+	struct save_t *next; // The SAVE command started after it
+} save_t;
+
+// Structure describing a client of the daemon (thread entry point argument)
+typedef struct client_t {
+	int socket; // The connected socket of the client
+	cache_t *cache; // The cache shared by all the clients
+} client_t;
+
+// Structure representing the files left to one batch worker, as a range of
+// indices that the worker takes from the front and others steal from the back
+typedef struct queue_t {
+	pthread_mutex_t lock; // Lock protecting the range
+	unsigned int start; // Index of the next file to be processed
+	unsigned int end; // Index after the last file of the queue
+} queue_t;
+
+// Structure holding the data shared by the workers of a batch
+typedef struct batch_t {
+	char **files; // Names of the input files
+	char **script; // Lines of the script run on each file
+	unsigned int lines; // Number of lines of the script
+	char *directory; // Directory the results are saved to
+	queue_t queues[MAX_THREADS]; // The queue of each worker
+	unsigned short workers; // Number of workers
+	pthread_mutex_t lock; // Lock protecting the memory and the output
+	pthread_cond_t released; // Signaled when memory is given back
+	unsigned long long memory; // Estimated memory of the images in flight
+	unsigned long long memory_limit; // Maximum memory in flight
+} batch_t;
+
+// Structure describing one batch worker (thread entry point argument)
+typedef struct worker_t {
+	batch_t *batch; // The batch the worker belongs to
+	unsigned short index; // Index of the queue of the worker
+} worker_t;
+
+// The pool shared by all the threads
+pool_t pool = { PTHREAD_MUTEX_INITIALIZER, { NULL }, 0, 0 };
+
+// The hash table of the commands, built once
+dispatch_t dispatch_table[DISPATCH_TABLE_SIZE];
+pthread_once_t dispatch_once = PTHREAD_ONCE_INIT;
+
+// Key of the thread specific context_t of the commands
+pthread_key_t context_key;
+
+// Makes sure the key is created exactly once
+pthread_once_t context_once = PTHREAD_ONCE_INIT;
+
 // Function to round a double to a signed short
 //
 // Parameters:
@@ -83,1533 +640,7500 @@ unsigned short clamp(signed short number)
 	return number;
 }
 
-// Function to free memory allocated for an image
+// Function to get a channel of a pixel
 //
 // Parameters:
-//	 - image: Pointer to the array of pointers to rows
-//	 - number_of_lines: Number of rows in the image
-void free_picture(pixel_t ***image, unsigned short number_of_lines)
+//	 - pixel: The pixel
+//	 - channel: The channel (0 for red, 1 for green, 2 for blue)
+//
+// Returns:
+//	 - The value of the channel
+unsigned short pixel_channel(pixel_t pixel, unsigned short channel)
 {
-	unsigned short line;
-
-	// Free memory for each row of pixels
-	for (line = 0; line < number_of_lines; line++)
-		free((*image)[line]);
+	if (!channel)
+		return pixel.red;
 
-	// Free memory for the array of pointers to rows
-	free(*image);
-
-	// Set the pointer to NULL to avoid using a dangling pointer
-	*image = NULL;
+	return channel == 1 ? pixel.green : pixel.blue;
 }
 
-// Function to create an empty picture
+// Function to scale a value of a file to the range of the pixels, with the
+// result of clamp(round_double(value * MAX_VALUE * 1. / max_value)), in
+// integers
 //
 // Parameters:
-//	 - height: Height of the picture (number of rows)
-//	 - width: Width of the picture (number of columns)
+//	 - value: The value read from the file
+//	 - max_value: Maximum pixel value specified in the file
 //
 // Returns:
-//	 - Pointer to the newly created picture or NULL if allocation fails
-pixel_t **create_picture(unsigned short height, unsigned short width)
+//	 - The scaled value between 0 and 255
+unsigned short scale_value(unsigned short value, unsigned short max_value)
 {
-	// Allocate memory for the array of pointers to rows
-	pixel_t **new_picture = (pixel_t **)malloc(height * sizeof(pixel_t *));
-
-	// Check if memory allocation was successful
-	if (!new_picture)
-		return NULL;
-
-	unsigned short line = 0;
+	// A file without a maximum value has only black pixels
+	if (!max_value)
+		return 0;
 
-	// Allocate memory for each row (array of pixels)
-	for (line = 0; line < height; line++) {
-		new_picture[line] = (pixel_t *)malloc(width * sizeof(pixel_t));
+	// Round half up, then truncate to a signed short as round_double() does
+	unsigned long scaled = (2UL * value * MAX_VALUE + max_value) /
+						   (2UL * max_value);
 
-		// Check if memory allocation for the row was successful
-		if (!new_picture[line]) {
-			// Free memory for previously allocated rows
-			free_picture(&new_picture, line);
-			return NULL;
-		}
-	}
+	return clamp((signed short)scaled);
+}
 
-	// Return the pointer to the newly created picture
-	return new_picture;
+// Function to prepare the rounded divisions by the sum of the weights of a
+// filter
+//
+// Parameters:
+//	 - divisor: The sum of the weights (not 0)
+//
+// Returns:
+//	 - The divider_t structure describing the divisions
+divider_t make_divider(unsigned long long divisor)
+{
+	divider_t divider;
+
+	// The sums are at most 255 times the divisor, so the dividends of
+	// divide_sum() stay below 2^32 and the error of the multiplier below
+	// 2^24: their product stays below 2^DIVIDER_SHIFT
+	divider.divisor = divisor;
+	divider.multiplier = 0;
+	if (divisor <= MAX_DIVIDER)
+		divider.multiplier = ((1ULL << DIVIDER_SHIFT) + 2 * divisor - 1) /
+							 (2 * divisor);
+
+	return divider;
 }
 
-// Function to skip comments in the header of a file
+// Function to divide a sum of a filter by the sum of its weights, rounded
+// half up, as round_double(1. * sum / divisor) would
 //
 // Parameters:
-//   - file: Pointer to the FILE structure representing the open file
-void skip_comments(FILE *file)
+//	 - sum: The sum (at most 255 times the divisor)
+//	 - divider: The divider_t structure describing the divisions
+//
+// Returns:
+//	 - The rounded quotient
+unsigned short divide_sum(unsigned long long sum, divider_t divider)
 {
-	char check, comment[MAX_INPUT_LINE_LENGTH + 1];
+	unsigned long long dividend = 2 * sum + divider.divisor;
 
-	// Read the first character
-	fscanf(file, "%c", &check);
+	if (divider.multiplier)
+		return dividend * divider.multiplier >> DIVIDER_SHIFT;
 
-	// Continue reading comments while the line starts with '#'
-	while (check == '#') {
-		// Read and discard the entire comment line
-		fgets(comment, MAX_INPUT_LINE_LENGTH, file);
+	return dividend / (2 * divider.divisor);
+}
 
-		// Read the next character after the comment
-		fscanf(file, "%c", &check);
-	}
+// Function to add the channels of a pixel, multiplied by a weight, to a sum
+//
+// Parameters:
+//	 - sum: Pointer to the sum to be updated
+//	 - pixel: The pixel to be added
+//	 - weight: The weight of the pixel
+void add_pixel(sum_t *sum, pixel_t pixel, unsigned long long weight)
+{
+	sum->red += weight * pixel.red;
+	sum->green += weight * pixel.green;
+	sum->blue += weight * pixel.blue;
+}
 
-	// Unread the character after the last comment
-	ungetc(check, file);
+// Function to subtract the channels of a pixel from a sum
+//
+// The sums are unsigned, so intermediate results may wrap around, but the
+// final window sums are always exact, since they are small and positive
+//
+// Parameters:
+//	 - sum: Pointer to the sum to be updated
+//	 - pixel: The pixel to be subtracted
+void subtract_pixel(sum_t *sum, pixel_t pixel)
+{
+	sum->red -= pixel.red;
+	sum->green -= pixel.green;
+	sum->blue -= pixel.blue;
 }
 
-// Function to read grayscale pixels from a P2 (ASCII) image file
+// Function to add a sum to another one, multiplied by a weight
 //
 // Parameters:
-//   - file: Pointer to the FILE structure representing the open file
-//   - image: Pointer to the image structure to store the pixel data
-//   - max_value: Maximum pixel value specified in the image file
-void read_P2(FILE *file, image_t *image, unsigned short max_value)
+//	 - sum: Pointer to the sum to be updated
+//	 - other: The sum to be added
+//	 - weight: The weight of the added sum
+void add_sum(sum_t *sum, sum_t other, unsigned long long weight)
 {
-	unsigned short line, column, value;
+	sum->red += weight * other.red;
+	sum->green += weight * other.green;
+	sum->blue += weight * other.blue;
+}
 
-	for (line = 0; line < image->height; line++) {
-		for (column = 0; column < image->width; column++) {
-			// Read pixel value from the file
-			fscanf(file, "%hd", &value);
+// Function to subtract a sum from another one (see subtract_pixel())
+//
+// Parameters:
+//	 - sum: Pointer to the sum to be updated
+//	 - other: The sum to be subtracted
+void subtract_sum(sum_t *sum, sum_t other)
+{
+	sum->red -= other.red;
+	sum->green -= other.green;
+	sum->blue -= other.blue;
+}
 
-			// Calculate and store the red, green, and blue values
-			image->picture[line][column].red =
-				clamp(round_double((value * MAX_VALUE * 1.) / max_value));
-			image->picture[line][column].green =
-			    image->picture[line][column].red;
-			image->picture[line][column].blue =
-			    image->picture[line][column].red;
-		}
-	}
+// Function to create the key of the thread specific contexts (see pthread_once)
+void create_context_key(void)
+{
+	pthread_key_create(&context_key, NULL);
 }
 
-// Function to read color pixels from a P3 (ASCII) image file
+// Function to set the context of the calling thread
 //
 // Parameters:
-//   - file: Pointer to the FILE structure representing the open file
-//   - image: Pointer to the image structure to store the pixel data
-//   - max_value: Maximum pixel value specified in the image file
-void read_P3(FILE *file, image_t *image, unsigned short max_value)
+//	 - context: Pointer to the context, or NULL for the default one
+void set_context(context_t *context)
 {
-	unsigned short line, column, value;
+	pthread_once(&context_once, create_context_key);
+	pthread_setspecific(context_key, context);
+}
 
-	for (line = 0; line < image->height; line++) {
-		for (column = 0; column < image->width; column++) {
-			// Read red, green, and blue values from the file
-			fscanf(file, "%hd", &value);
-			image->picture[line][column].red =
-				clamp(round_double((value * MAX_VALUE * 1.) / max_value));
+// Function to get the context of the calling thread
+//
+// Returns:
+//	 - Pointer to the context, or NULL if the thread uses the default one
+context_t *get_context(void)
+{
+	pthread_once(&context_once, create_context_key);
+	return pthread_getspecific(context_key);
+}
 
-			fscanf(file, "%hd", &value);
-			image->picture[line][column].green =
-				clamp(round_double((value * MAX_VALUE * 1.) / max_value));
+// Function to get the stream the messages of the commands are written to
+//
+// Returns:
+//	 - The output stream of the calling thread (STDOUT by default)
+FILE *output(void)
+{
+	context_t *context = get_context();
+	return context ? context->output : stdout;
+}
 
-			fscanf(file, "%hd", &value);
-			image->picture[line][column].blue =
-				clamp(round_double((value * MAX_VALUE * 1.) / max_value));
-		}
-	}
+// Function to determine how many threads the parallel commands may use
+//
+// The number of online processors is used, unless the IMAGE_EDITOR_THREADS
+// environment variable or the context of the calling thread say otherwise
+//
+// Returns:
+//	 - The number of threads, between 1 and MAX_THREADS
+unsigned short number_of_threads(void)
+{
+	context_t *context = get_context();
+	if (context && context->threads)
+		return context->threads;
+
+	signed long threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	// Let the environment override the number of processors
+	char *variable = getenv("IMAGE_EDITOR_THREADS");
+	if (variable && atoi(variable) > 0)
+		threads = atoi(variable);
+
+	if (threads < 1)
+		return 1;
+	if (threads > MAX_THREADS)
+		return MAX_THREADS;
+	return threads;
 }
 
-// Function to read grayscale pixels from a P5 (binary) image file
+// Function to run a job on the lines it was given (thread entry point)
 //
 // Parameters:
-//   - file: Pointer to the FILE structure representing the open file
-//   - image: Pointer to the image structure to store the pixel data
-//   - max_value: Maximum pixel value specified in the image file
-void read_P5(FILE *file, image_t *image, unsigned short max_value)
+//	 - argument: Pointer to the job_t structure describing the job
+//
+// Returns:
+//	 - NULL
+void *run_job(void *argument)
 {
-	unsigned short line, column, value;
-	unsigned char byte;
+	job_t *job = argument;
+	job->work(job->data, job->start, job->end);
+	return NULL;
+}
 
-	for (line = 0; line < image->height; line++) {
-		for (column = 0; column < image->width; column++) {
-			// Read a byte from the file
-			fread(&byte, 1, 1, file);
+// Function to pin the thread of a band of parallel_lines() to a processor
+//
+// The band of each index runs on the same processor in every parallel
+// command, so the pages of a picture first touched for its lines (see
+// create_picture()) stay on the NUMA node of the thread working on them
+//
+// Parameters:
+//	 - attributes: The attributes of the thread, given the processor
+//	 - allowed: The processors the editor may run on
+//	 - band: The index of the band
+void pin_band(pthread_attr_t *attributes, cpu_set_t *allowed,
+			  unsigned short band)
+{
+	int processor, count = band % CPU_COUNT(allowed);
+	cpu_set_t pinned;
 
-			// Calculate and store the grayscale pixel value
-			value =
-				clamp(round_double((byte * MAX_VALUE * 1.) / max_value));
+	// Take the processors allowed in order
+	for (processor = 0; processor < CPU_SETSIZE; processor++)
+		if (CPU_ISSET(processor, allowed) && !count--)
+			break;
 
-			image->picture[line][column].red = value;
-			image->picture[line][column].green = value;
-			image->picture[line][column].blue = value;
-		}
-	}
+	CPU_ZERO(&pinned);
+	CPU_SET(processor, &pinned);
+	pthread_attr_setaffinity_np(attributes, sizeof(cpu_set_t), &pinned);
 }
 
-// Function to read color pixels from a P6 (binary) image file
+// Function to process a number of lines in parallel
+//
+// The lines are split into contiguous bands, one for each thread, and the
+// calling thread processes the first band itself. The threads of the other
+// bands are pinned to the processors the editor may run on (see pin_band()),
+// unless it may only run on one. If a thread cannot be created, its band is
+// processed by the calling thread instead
 //
 // Parameters:
-//   - file: Pointer to the FILE structure representing the open file
-//   - image: Pointer to the image structure to store the pixel data
-//   - max_value: Maximum pixel value specified in the image file
-void read_P6(FILE *file, image_t *image, unsigned short max_value)
+//	 - work: Function processing the lines from start to end (exclusive)
+//	 - data: Data passed to each call of the function
+//	 - count: The number of lines to be processed
+void parallel_lines(void (*work)(void *, unsigned short, unsigned short),
+					void *data, unsigned short count)
 {
-	unsigned short line, column;
-	unsigned char byte;
+	unsigned short threads = number_of_threads(), index;
 
-	for (line = 0; line < image->height; line++) {
-		for (column = 0; column < image->width; column++) {
-			// Read red, green, and blue values from the file
-			fread(&byte, 1, 1, file);
-			image->picture[line][column].red =
-				clamp(round_double((byte * MAX_VALUE * 1.) / max_value));
+	// Do not bother creating threads for just a few lines
+	if (threads > (count + MIN_LINES_PER_THREAD - 1) / MIN_LINES_PER_THREAD)
+		threads = (count + MIN_LINES_PER_THREAD - 1) / MIN_LINES_PER_THREAD;
 
-			fread(&byte, 1, 1, file);
-			image->picture[line][column].green =
-				clamp(round_double((byte * MAX_VALUE * 1.) / max_value));
+	if (threads <= 1) {
+		work(data, 0, count);
+		return;
+	}
 
-			fread(&byte, 1, 1, file);
-			image->picture[line][column].blue =
-				clamp(round_double((byte * MAX_VALUE * 1.) / max_value));
+	job_t jobs[MAX_THREADS];
+	pthread_t ids[MAX_THREADS];
+	bool started[MAX_THREADS];
+	pthread_attr_t attributes;
+	cpu_set_t allowed;
+	bool pin = !sched_getaffinity(0, sizeof(cpu_set_t), &allowed) &&
+			   CPU_COUNT(&allowed) > 1;
+
+	// Split the lines into bands and start a thread for each one but the first
+	for (index = 0; index < threads; index++) {
+		jobs[index].work = work;
+		jobs[index].data = data;
+		jobs[index].start = (unsigned long)count * index / threads;
+		jobs[index].end = (unsigned long)count * (index + 1) / threads;
+
+		started[index] = false;
+		if (index && !pthread_attr_init(&attributes)) {
+			if (pin)
+				pin_band(&attributes, &allowed, index);
+			started[index] = !pthread_create(&ids[index], &attributes,
+											 run_job, &jobs[index]);
+			pthread_attr_destroy(&attributes);
 		}
 	}
+
+	// Process the bands whose threads were not started
+	for (index = 0; index < threads; index++)
+		if (!started[index])
+			run_job(&jobs[index]);
+
+	// Wait for the other threads to finish
+	for (index = 1; index < threads; index++)
+		if (started[index])
+			pthread_join(ids[index], NULL);
 }
 
-// Function to read the magic number and determine the color type of the image
+// Function to map memory for a big block, backed by huge pages if possible
 //
 // Parameters:
-//   - file: Pointer to the FILE structure representing the open file
-//   - image: Pointer to the image structure to store the image data
+//	 - size: The size of the mapping (a multiple of HUGE_PAGE_SIZE)
 //
 // Returns:
-//   - true if the image is successfully read, false otherwise
-bool read_image(FILE *file, image_t *image)
+//	 - Pointer to the mapped memory or NULL if mapping fails
+void *map_pages(size_t size)
 {
-	unsigned short magic_number, max_value;
-	char residual;
-
-	// Skip comments in the header
-	skip_comments(file);
-
-	// Read the magic number
-	fscanf(file, "P%hd", &magic_number);
+	void *pages = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+	// Use the huge pages reserved by the system if there are any left
+	pages = mmap(NULL, size, PROT_READ | PROT_WRITE,
+				 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+
+	if (pages == MAP_FAILED) {
+		pages = mmap(NULL, size, PROT_READ | PROT_WRITE,
+					 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (pages == MAP_FAILED)
+			return NULL;
 
-	// Set the color type based on the magic number
-	if (magic_number == 2 || magic_number == 5)
-		image->color = false; // Grayscale
-	else if (magic_number == 3 || magic_number == 6)
-		image->color = true; // Color
-	else
-		return false; // Unsupported magic number
+#ifdef MADV_HUGEPAGE
+		// Otherwise ask for transparent huge pages
+		madvise(pages, size, MADV_HUGEPAGE);
+#endif
+	}
 
-	fscanf(file, "%c", &residual);
+	return pages;
+}
 
-	// Skip comments in the header
-	skip_comments(file);
+// Function to allocate a block of memory, reusing a freed block of the pool
+// if one is big enough without wasting more than an eighth of it
+//
+// Parameters:
+//	 - size: The number of bytes needed
+//
+// Returns:
+//	 - Pointer to the block (not initialized) or NULL if allocation fails
+void *allocate_block(size_t size)
+{
+	unsigned short index, best = POOL_BLOCKS;
+
+	// Find the smallest freed block that fits
+	pthread_mutex_lock(&pool.lock);
+	for (index = 0; index < pool.count; index++) {
+		block_t *block = pool.blocks[index];
+		if (block->size >= size && block->size - size <= size / 8 &&
+		    (best == POOL_BLOCKS || block->size < pool.blocks[best]->size))
+			best = index;
+	}
 
-	// Read image dimensions
-	fscanf(file, "%hd %hd", &image->width, &image->height);
+	if (best != POOL_BLOCKS) {
+		// Move the last freed block in its place
+		block_t *reused = pool.blocks[best];
+		pool.blocks[best] = pool.blocks[pool.count - 1];
+		reused->fresh = false;
+		reused->shared = 0;
+		pool.count--;
+		pool.memory -= reused->size;
+		pthread_mutex_unlock(&pool.lock);
+		return (char *)reused + BLOCK_HEADER_SIZE;
+	}
+	pthread_mutex_unlock(&pool.lock);
+
+	// Otherwise allocate a new one, mapping the big ones directly
+	block_t *new_block;
+	size_t mapped = 0;
+	if (BLOCK_HEADER_SIZE + size >= HUGE_PAGE_SIZE) {
+		mapped = (BLOCK_HEADER_SIZE + size + HUGE_PAGE_SIZE - 1) /
+				 HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+		new_block = map_pages(mapped);
+	} else {
+		new_block = malloc(BLOCK_HEADER_SIZE + size);
+	}
 
-	// Skip comments in the header
-	skip_comments(file);
+	if (!new_block)
+		return NULL;
 
-	// Read the maximum pixel value
-	fscanf(file, "%hd", &max_value);
+	new_block->size = size;
+	new_block->mapped = mapped;
+	new_block->fresh = mapped != 0;
+	new_block->shared = 0;
+	return (char *)new_block + BLOCK_HEADER_SIZE;
+}
 
-	fscanf(file, "%c", &residual);
+// Function to give a block back to the pool, which keeps it for the next
+// allocations unless it already holds too much memory
+//
+// Parameters:
+//	 - data: Pointer returned by allocate_block() (or NULL)
+void release_block(void *data)
+{
+	if (!data)
+		return;
 
-	// Allocate memory for the image pixels
-	image->picture = create_picture(image->height, image->width);
-	if (!image->picture)
-		return false; // Memory allocation failed
+	block_t *block = (block_t *)((char *)data - BLOCK_HEADER_SIZE);
 
-	// Read pixels based on the magic number
-	switch (magic_number) {
-	case 2:
-		read_P2(file, image, max_value);
-		return true;
+	pthread_mutex_lock(&pool.lock);
+	if (pool.count < POOL_BLOCKS &&
+	    pool.memory + block->size <=
+	    (unsigned long long)POOL_MEMORY_LIMIT << 20) {
+		pool.blocks[pool.count++] = block;
+		pool.memory += block->size;
+		block = NULL;
+	}
+	pthread_mutex_unlock(&pool.lock);
 
-	case 3:
-		read_P3(file, image, max_value);
-		return true;
+	if (block && block->mapped)
+		munmap(block, block->mapped);
+	else
+		free(block);
+}
 
-	case 5:
-		read_P5(file, image, max_value);
-		return true;
+// Function to share a picture with another image instead of copying it
+//
+// The block of the picture counts the images sharing it, each one freeing
+// it with free_picture(); an image copies a shared picture before modifying
+// it (see image_changing())
+//
+// Parameters:
+//	 - picture: The picture to be shared
+//
+// Returns:
+//	 - The picture
+pixel_t **share_picture(pixel_t **picture)
+{
+	block_t *block = (block_t *)((char *)picture - BLOCK_HEADER_SIZE);
 
-	case 6:
-		read_P6(file, image, max_value);
-		return true;
+	pthread_mutex_lock(&pool.lock);
+	block->shared++;
+	pthread_mutex_unlock(&pool.lock);
 
-	default:
-		return false; // Unsupported magic number
-	}
+	return picture;
 }
 
-// Function to load an image from a file and set the initial selection area
+// Function to check whether a picture is shared with other images
 //
 // Parameters:
-//   - file_name: The name of the file to load
-//   - selection: Pointer to the area structure to be set based on the
-//                loaded image
+//	 - picture: The picture
+//	 - leave: Whether the calling image stops sharing it
 //
 // Returns:
-//   - An image_t structure representing the loaded image or
-//     an empty_image structure if the load fails
-image_t load_image(char file_name[FILE_NAME_LENGTH])
+//	 - true if other images share the picture, false otherwise
+bool picture_shared(pixel_t **picture, bool leave)
 {
-	// Open the file for reading
-	FILE *file = fopen(file_name, "r");
+	block_t *block = (block_t *)((char *)picture - BLOCK_HEADER_SIZE);
 
-	// Create an empty image structure
-	image_t empty_image;
-	empty_image.picture = NULL;
-
-	// Check if the file opened successfully
-	if (!file) {
-		printf("Failed to load %s\n", file_name);
-		return empty_image;
-	}
+	pthread_mutex_lock(&pool.lock);
+	bool shared = block->shared > 0;
+	if (shared && leave)
+		block->shared--;
+	pthread_mutex_unlock(&pool.lock);
 
-	image_t image;
+	return shared;
+}
 
-	// Attempt to read the image from the file
-	if (!read_image(file, &image)) {
-		printf("Failed to load %s\n", file_name);
-		fclose(file);
-		return empty_image;
+// Function to free memory allocated for an image
+//
+// A picture shared with other images (see share_picture()) is only given
+// back by the last one
+//
+// Parameters:
+//	 - image: Pointer to the array of pointers to rows
+void free_picture(pixel_t ***image)
+{
+	if (*image && picture_shared(*image, true)) {
+		*image = NULL;
+		return;
 	}
 
-	// Print a success message
-	printf("Loaded %s\n", file_name);
+	// The rows are part of the same block as the array of pointers
+	release_block(*image);
 
-	// Close the file
-	fclose(file);
+	// Set the pointer to NULL to avoid using a dangling pointer
+	*image = NULL;
+}
+
+// Function to give back the pages of some memory of a mapped block, so that
+// the next access to them touches new (zeroed) pages
+//
+// The pages of a mapping of huge pages can only be given back whole, so the
+// whole huge pages are given back if the small ones cannot be
+//
+// Parameters:
+//	 - start: The start of the memory
+//	 - length: The length of the memory
+void drop_pages(void *start, size_t length)
+{
+	size_t sizes[2] = { sysconf(_SC_PAGESIZE), HUGE_PAGE_SIZE };
+	unsigned short index;
+
+	for (index = 0; index < 2; index++) {
+		// Only the pages fully inside the memory are given back
+		size_t first = ((size_t)start + sizes[index] - 1) / sizes[index] *
+					   sizes[index];
+		size_t last = ((size_t)start + length) / sizes[index] * sizes[index];
+		if (last <= first ||
+		    !madvise((void *)first, last - first, MADV_DONTNEED))
+			return;
+	}
+}
+
+// Function to create a picture, whose pixels are left for the caller to fill
+//
+// The array of pointers to rows and the rows themselves are allocated as one
+// block from the pool, the rows following each other. The pages of a big
+// block are first touched by the caller filling them, the parallel commands
+// from the thread of each band (see parallel_lines()), so that on a NUMA
+// system they are placed on the node of the thread that works on them. The
+// pages of a big block reused from the pool were placed for the lines of
+// another picture, so they are given back to be touched again
+//
+// Parameters:
+//	 - height: Height of the picture (number of rows)
+//	 - width: Width of the picture (number of columns)
+//
+// Returns:
+//	 - Pointer to the newly created picture or NULL if allocation fails
+pixel_t **create_picture(unsigned short height, unsigned short width)
+{
+	// Keep the pixels aligned to a cache line after the pointers to rows
+	size_t pointers = (height * sizeof(pixel_t *) + BLOCK_HEADER_SIZE - 1) /
+					  BLOCK_HEADER_SIZE * BLOCK_HEADER_SIZE;
+	pixel_t **new_picture =
+		allocate_block(pointers + (size_t)height * width * sizeof(pixel_t));
+
+	// Check if memory allocation was successful
+	if (!new_picture)
+		return NULL;
+
+	// Point each row to its place in the block
+	pixel_t *pixels = (pixel_t *)((char *)new_picture + pointers);
+	unsigned short line;
+	for (line = 0; line < height; line++)
+		new_picture[line] = pixels + (size_t)line * width;
+
+	// Let the threads filling a big block touch its pages again
+	block_t *block = (block_t *)((char *)new_picture - BLOCK_HEADER_SIZE);
+	if (block->mapped) {
+		if (!block->fresh)
+			drop_pages(pixels, (size_t)height * width * sizeof(pixel_t));
+		block->fresh = false;
+	}
+
+	// Return the pointer to the newly created picture
+	return new_picture;
+}
+
+// Function to copy some lines of a picture (run by each thread)
+//
+// Parameters:
+//	 - data: Pointer to the copying_t structure describing the pictures
+//	 - start: First line to be copied
+//	 - end: Line after the last one to be copied
+void copy_lines(void *data, unsigned short start, unsigned short end)
+{
+	copying_t *copying = data;
+	unsigned short line;
+
+	for (line = start; line < end; line++)
+		memcpy(copying->copy[line], copying->source[line],
+			   copying->width * sizeof(pixel_t));
+}
+
+// Function to create a copy of the picture of an image
+//
+// The lines are copied in parallel, each thread touching the pages of its
+// own lines first
+//
+// Parameters:
+//	 - image: The image to be copied
+//
+// Returns:
+//	 - Pointer to the copy or NULL if allocation fails
+pixel_t **copy_picture(image_t image)
+{
+	copying_t copying;
+	copying.source = image.picture;
+	copying.copy = create_picture(image.height, image.width);
+	copying.width = image.width;
+	if (!copying.copy)
+		return NULL;
+
+	parallel_lines(copy_lines, &copying, image.height);
+
+	return copying.copy;
+}
+
+// Function to create an area covering the entire image
+//
+// Parameters:
+//	 - image: The image to be covered
+//
+// Returns:
+//	 - The area covering the entire image
+area_t full_area(image_t image)
+{
+	area_t area;
+	area.all = true;
+	area.line_start = 0;
+	area.line_end = image.height;
+	area.column_start = 0;
+	area.column_end = image.width;
+	return area;
+}
+
+// Function to free the file an image is decoded from
+//
+// Parameters:
+//	 - source: Pointer to the source pointer (set to NULL afterwards)
+void free_source(source_t **source)
+{
+	if (!*source)
+		return;
+
+	close((*source)->file);
+	free((*source)->offsets);
+	free((*source)->decoded);
+	free(*source);
+	*source = NULL;
+}
+
+// Function to read the next number of the pixels of an ASCII file
+//
+// Parameters:
+//	 - position: Pointer to the position in the bytes (moved past the number)
+//	 - end: The end of the bytes
+//
+// Returns:
+//	 - The number, or 0 if there is none left
+unsigned short next_number(unsigned char **position, unsigned char *end)
+{
+	unsigned short number = 0;
+
+	// Skip the separators
+	while (*position < end && (**position < '0' || **position > '9'))
+		(*position)++;
+
+	while (*position < end && **position >= '0' && **position <= '9')
+		number = number * 10 + *(*position)++ - '0';
+
+	return number;
+}
+
+// Function to find the end of a block of tiles of a file, which are read at
+// once
+//
+// Parameters:
+//	 - source: Pointer to the file
+//	 - start: First tile of the block
+//	 - end: Tile after the last one that can be part of the block
+//
+// Returns:
+//	 - The tile after the last one of the block (at least one tile)
+unsigned short block_end(source_t *source, unsigned short start,
+						 unsigned short end)
+{
+	unsigned short tile = start + 1;
+	while (tile < end &&
+	       source->offsets[tile + 1] - source->offsets[start] <=
+	       DECODE_BLOCK_SIZE)
+		tile++;
+
+	return tile;
+}
+
+// Function to read the bytes of some tiles of a file
+//
+// The bytes missing from a file that is too short are read as 0
+//
+// Parameters:
+//	 - source: Pointer to the file
+//	 - start: First tile to be read
+//	 - end: Tile after the last one to be read
+//
+// Returns:
+//	 - The bytes, followed by a 0 (to be released with release_block()), or
+//	   NULL if memory could not be allocated
+unsigned char *read_block(source_t *source, unsigned short start,
+						  unsigned short end)
+{
+	size_t length = source->offsets[end] - source->offsets[start];
+	unsigned char *bytes = allocate_block(length + 1);
+	if (!bytes)
+		return NULL;
+
+	ssize_t count = pread(source->file, bytes, length,
+						  source->offsets[start]);
+	if (count < 0)
+		count = 0;
+	memset(bytes + count, 0, length + 1 - count);
+
+	return bytes;
+}
+
+// Function to read the blocks of tiles of a file, at most two ahead of the
+// ones decoded (thread entry point)
+//
+// Parameters:
+//	 - argument: Pointer to the reading_t structure describing the tiles
+//
+// Returns:
+//	 - NULL
+void *read_blocks(void *argument)
+{
+	reading_t *reading = argument;
+	unsigned short start, end;
+	unsigned int index = 0;
+
+	for (start = reading->start; start < reading->end; start = end) {
+		end = block_end(reading->source, start, reading->end);
+
+		// Wait until the block two places before was decoded
+		pthread_mutex_lock(&reading->lock);
+		while (index - reading->decoded >= 2)
+			pthread_cond_wait(&reading->changed, &reading->lock);
+		pthread_mutex_unlock(&reading->lock);
+
+		unsigned char *bytes = read_block(reading->source, start, end);
+
+		pthread_mutex_lock(&reading->lock);
+		reading->blocks[index % 2] = bytes;
+		reading->read = ++index;
+		pthread_cond_signal(&reading->changed);
+		pthread_mutex_unlock(&reading->lock);
+	}
+
+	return NULL;
+}
+
+// Function to decode a tile of a native file, compressed with run-length
+// encoding (see pack_tile())
+//
+// The pixels missing from a tile that is too short are decoded as 0
+//
+// Parameters:
+//	 - image: Pointer to the image
+//	 - bytes: The compressed bytes of the tile
+//	 - last: The end of the bytes
+//	 - start: First line of the tile
+//	 - end: Line after the last one of the tile
+void decode_tile(image_t *image, unsigned char *bytes, unsigned char *last,
+				 unsigned short start, unsigned short end)
+{
+	unsigned short channels = image->color ? 3 : 1, count;
+	size_t pixel = 0, pixels = (size_t)(end - start) * image->width;
+	bool repeat;
+
+	// The lines of a picture follow each other in its block
+	pixel_t *line = image->picture[start];
+
+	while (pixel < pixels && bytes < last) {
+		// A control byte below 128 is followed by that many pixels plus one,
+		// otherwise by one pixel repeated that many times minus 126
+		repeat = *bytes >= 128;
+		count = repeat ? *bytes - 126 : *bytes + 1;
+		bytes++;
+
+		for (; count && pixel < pixels && bytes + channels <= last; count--) {
+			line[pixel].red = bytes[0];
+			line[pixel].green = bytes[channels / 2];
+			line[pixel].blue = bytes[channels - 1];
+			pixel++;
+			if (!repeat || count == 1)
+				bytes += channels;
+		}
+	}
+
+	memset(line + pixel, 0, (pixels - pixel) * sizeof(pixel_t));
+}
+
+// Function to decode the bytes of some tiles of an image
+//
+// Parameters:
+//	 - image: Pointer to the image
+//	 - bytes: The bytes of the tiles, followed by a 0
+//	 - start: First tile to be decoded
+//	 - end: Tile after the last one to be decoded
+void decode_block(image_t *image, unsigned char *bytes, unsigned short start,
+				  unsigned short end)
+{
+	source_t *source = image->source;
+	unsigned char *position = bytes;
+	unsigned char *last = bytes + (source->offsets[end] -
+								   source->offsets[start]);
+	bool ascii = source->magic_number == 2 || source->magic_number == 3;
+	unsigned short line, column, channel, channels = image->color ? 3 : 1;
+	unsigned short value[3];
+
+	if (source->magic_number == NATIVE_FORMAT) {
+		unsigned short tile;
+		unsigned long tile_end;
+		for (tile = start; tile < end; tile++) {
+			tile_end = (tile + 1UL) * source->tile_lines;
+			if (tile_end > image->height)
+				tile_end = image->height;
+			decode_tile(image, bytes + (source->offsets[tile] -
+										source->offsets[start]),
+						bytes + (source->offsets[tile + 1] -
+								 source->offsets[start]),
+						tile * source->tile_lines, tile_end);
+		}
+		return;
+	}
+
+	// Each tile of a PNM file is a line
+	for (line = start; line < end; line++) {
+		for (column = 0; column < image->width; column++) {
+			// Read the value of each channel and scale it
+			for (channel = 0; channel < channels; channel++) {
+				if (ascii)
+					value[channel] = next_number(&position, last);
+				else
+					value[channel] = *position++;
+				value[channel] = value[channel] <= MAX_VALUE ?
+								 source->scale[value[channel]] :
+								 scale_value(value[channel],
+											 source->max_value);
+			}
+
+			image->picture[line][column].red = value[0];
+			image->picture[line][column].green = value[channels / 2];
+			image->picture[line][column].blue = value[channels - 1];
+		}
+	}
+}
+
+// Function to decode some lines of an image from its file
+//
+// The lines are decoded by whole tiles. Tiles spanning several blocks are
+// decoded as a pipeline: a separate thread reads the next block while the
+// current one is decoded
+//
+// Parameters:
+//	 - image: Pointer to the image
+//	 - start: First line to be decoded (the first line of a tile)
+//	 - end: Line after the last one to be decoded (the line after a tile)
+//
+// Returns:
+//	 - true if the lines were decoded, false if memory could not be allocated
+bool decode_lines(image_t *image, unsigned short start, unsigned short end)
+{
+	source_t *source = image->source;
+	reading_t reading;
+	pthread_t reader;
+
+	reading.source = source;
+	reading.start = start / source->tile_lines;
+	reading.end = (end + source->tile_lines - 1) / source->tile_lines;
+	reading.read = 0;
+	reading.decoded = 0;
+	pthread_mutex_init(&reading.lock, NULL);
+	pthread_cond_init(&reading.changed, NULL);
+
+	// Read the tiles at once if they fit in a block (or if the reader thread
+	// cannot be created)
+	if (block_end(source, reading.start, reading.end) == reading.end ||
+	    pthread_create(&reader, NULL, read_blocks, &reading)) {
+		pthread_mutex_destroy(&reading.lock);
+		pthread_cond_destroy(&reading.changed);
+
+		unsigned char *bytes = read_block(source, reading.start, reading.end);
+		if (!bytes)
+			return false;
+
+		decode_block(image, bytes, reading.start, reading.end);
+		release_block(bytes);
+		return true;
+	}
+
+	bool decoded = true;
+	unsigned short tile, last;
+	unsigned int index = 0;
+	for (tile = reading.start; tile < reading.end; tile = last) {
+		last = block_end(source, tile, reading.end);
+
+		// Wait for the block to be read
+		pthread_mutex_lock(&reading.lock);
+		while (reading.read <= index)
+			pthread_cond_wait(&reading.changed, &reading.lock);
+		unsigned char *bytes = reading.blocks[index % 2];
+		pthread_mutex_unlock(&reading.lock);
+
+		if (bytes)
+			decode_block(image, bytes, tile, last);
+		else
+			decoded = false;
+		release_block(bytes);
+
+		// Let the reader use the buffer again
+		pthread_mutex_lock(&reading.lock);
+		reading.decoded = ++index;
+		pthread_cond_signal(&reading.changed);
+		pthread_mutex_unlock(&reading.lock);
+	}
+
+	pthread_join(reader, NULL);
+	pthread_mutex_destroy(&reading.lock);
+	pthread_cond_destroy(&reading.changed);
+
+	return decoded;
+}
+
+// Function to round a line of an image up to the first line of a tile
+//
+// Parameters:
+//	 - image: The image
+//	 - line: The line
+//
+// Returns:
+//	 - The first line of the tile, or the height of the image
+unsigned short tile_start(image_t image, unsigned short line)
+{
+	unsigned long tile_lines = image.source->tile_lines;
+	unsigned long start = (line + tile_lines - 1) / tile_lines * tile_lines;
+
+	return start < image.height ? start : image.height;
+}
+
+// Function to decode some lines of a run (run by each thread)
+//
+// Each thread decodes the tiles starting in its lines
+//
+// Parameters:
+//	 - data: Pointer to the decoding_t structure describing the run
+//	 - start: First line to be decoded, relative to the run
+//	 - end: Line after the last one to be decoded, relative to the run
+void decode_run(void *data, unsigned short start, unsigned short end)
+{
+	decoding_t *decoding = data;
+	unsigned short line;
+
+	start = tile_start(*decoding->image, decoding->start + start);
+	end = tile_start(*decoding->image, decoding->start + end);
+	if (start == end || !decode_lines(decoding->image, start, end))
+		return;
+
+	for (line = start; line < end; line++)
+		decoding->image->source->decoded[line] = true;
+}
+
+// Function to make sure the lines of an area of an image are decoded
+//
+// The lines are decoded from the file the first time they are needed, by
+// whole tiles, each run of missing lines being split between the threads
+// (the offsets of the tiles tell each one where its part starts); the file
+// is closed once they all are. Every command reading or writing pixels calls
+// it first (see execute_command())
+//
+// Parameters:
+//	 - image: Pointer to the image
+//	 - area: The area whose lines are needed
+//
+// Returns:
+//	 - true if the lines are decoded, false if memory could not be allocated
+//	   for some of them (the command needing them must not run)
+bool image_require(image_t *image, area_t area)
+{
+	source_t *source = image->source;
+	if (!source)
+		return true;
+
+	// Extend the area to whole tiles
+	unsigned short line = area.line_start / source->tile_lines *
+						  source->tile_lines, end;
+	area.line_end = tile_start(*image, area.line_end);
+
+	while (line < area.line_end) {
+		if (source->decoded[line]) {
+			line++;
+			continue;
+		}
+
+		// Decode the lines missing in a row at once
+		for (end = line; end < area.line_end && !source->decoded[end]; end++)
+			;
+		decoding_t decoding;
+		decoding.image = image;
+		decoding.start = line;
+		parallel_lines(decode_run, &decoding, end - line);
+
+		// Stop if memory could not be allocated for some of the lines
+		for (; line < end; line++) {
+			if (!source->decoded[line])
+				return false;
+			source->remaining--;
+		}
+	}
+
+	// The file is no longer needed
+	if (!source->remaining)
+		free_source(&image->source);
+
+	return true;
+}
+
+// Function to free the memory allocated for an image pyramid
+//
+// Parameters:
+//	 - pyramid: Pointer to the pyramid pointer (set to NULL afterwards)
+void free_pyramid(pyramid_t **pyramid)
+{
+	if (!*pyramid)
+		return;
+
+	unsigned short level;
+	for (level = 1; level < (*pyramid)->levels; level++)
+		free_picture(&(*pyramid)->pictures[level]);
+
+	free(*pyramid);
+	*pyramid = NULL;
+}
+
+// Function to free the memory allocated for an integral image
+//
+// Parameters:
+//	 - integral: Pointer to the integral image pointer (set to NULL
+//				 afterwards)
+void free_integral(integral_t **integral)
+{
+	if (!*integral)
+		return;
+
+	release_block((*integral)->sums);
+	release_block((*integral)->squares);
+	free(*integral);
+	*integral = NULL;
+}
+
+// Function to free the memory allocated for the histogram of an image
+//
+// Parameters:
+//	 - histogram: Pointer to the histogram pointer (set to NULL afterwards)
+void free_histogram(histogram_t **histogram)
+{
+	if (!*histogram)
+		return;
+
+	free((*histogram)->band_counts);
+	free((*histogram)->stale);
+	free(*histogram);
+	*histogram = NULL;
+}
+
+// Function to free the memory allocated for the file an image was saved to
+//
+// Parameters:
+//	 - target: Pointer to the file pointer (set to NULL afterwards)
+void free_target(target_t **target)
+{
+	if (!*target)
+		return;
+
+	free((*target)->starts);
+	free((*target)->ends);
+	free(*target);
+	*target = NULL;
+}
+
+// Function to compute the sums of an integral image from a corner on: the
+// sums of the lines above it and of the columns to its left are kept
+//
+// Parameters:
+//	 - image: The image the integral image belongs to
+//	 - integral: Pointer to the integral image
+//	 - line_start: First line of the image whose sums are computed
+//	 - column_start: First column of the image whose sums are computed
+void integrate_area(image_t image, integral_t *integral,
+					unsigned short line_start, unsigned short column_start)
+{
+	unsigned long stride = image.width + 1;
+	unsigned short line, column;
+
+	for (line = line_start; line < image.height; line++) {
+		narrow_sum_t *sums = integral->sums + (line + 1) * stride;
+		sum_t *squares = integral->squares + (line + 1) * stride;
+
+		// The line so far is the difference of the sums left of the corner
+		narrow_sum_t sum = sums[column_start];
+		sum.red -= sums[column_start - stride].red;
+		sum.green -= sums[column_start - stride].green;
+		sum.blue -= sums[column_start - stride].blue;
+		sum_t square = squares[column_start];
+		subtract_sum(&square, squares[column_start - stride]);
+
+		for (column = column_start; column < image.width; column++) {
+			pixel_t pixel = image.picture[line][column];
+
+			// Add up the line so far, then the lines above it (the narrow
+			// sums wrap around modulo 2^32)
+			sum.red += pixel.red;
+			sum.green += pixel.green;
+			sum.blue += pixel.blue;
+			square.red += pixel.red * pixel.red;
+			square.green += pixel.green * pixel.green;
+			square.blue += pixel.blue * pixel.blue;
+
+			sums[column + 1].red = sum.red + sums[column + 1 - stride].red;
+			sums[column + 1].green =
+				sum.green + sums[column + 1 - stride].green;
+			sums[column + 1].blue = sum.blue + sums[column + 1 - stride].blue;
+			squares[column + 1] = square;
+			add_sum(&squares[column + 1], squares[column + 1 - stride], 1);
+		}
+	}
+}
+
+// Function to build the integral image of an image, replacing the old one
+//
+// Parameters:
+//	 - image: Pointer to the image whose integral image should be built
+void build_integral(image_t *image)
+{
+	free_integral(&image->integral);
+
+	unsigned long stride = image->width + 1;
+	integral_t *integral = malloc(sizeof(integral_t));
+	if (!integral)
+		return;
+
+	integral->sums = allocate_block((image->height + 1) * stride *
+									sizeof(narrow_sum_t));
+	integral->squares = allocate_block((image->height + 1) * stride *
+									   sizeof(sum_t));
+	if (!integral->sums || !integral->squares) {
+		free_integral(&integral);
+		return;
+	}
+
+	// The first line and column are zero, so no area needs special handling
+	memset(integral->sums, 0, stride * sizeof(narrow_sum_t));
+	memset(integral->squares, 0, stride * sizeof(sum_t));
+	unsigned short line;
+	for (line = 1; line <= image->height; line++) {
+		memset(integral->sums + line * stride, 0, sizeof(narrow_sum_t));
+		memset(integral->squares + line * stride, 0, sizeof(sum_t));
+	}
+
+	integrate_area(*image, integral, 0, 0);
+	integral->height = image->height;
+	integral->width = image->width;
+	integral->dirty_line = image->height;
+	integral->dirty_column = image->width;
+	image->integral = integral;
+}
+
+// Function to bring the integral image of an image up to date, building it
+// if needed
+//
+// Only the sums below and to the right of the first line and column modified
+// since it was up to date are computed again (see image_modified())
+//
+// Parameters:
+//	 - image: Pointer to the image
+void update_integral(image_t *image)
+{
+	integral_t *integral = image->integral;
+	if (!integral) {
+		build_integral(image);
+		return;
+	}
+
+	if (integral->dirty_line == image->height ||
+	    integral->dirty_column == image->width)
+		return;
+
+	integrate_area(*image, integral, integral->dirty_line,
+				   integral->dirty_column);
+	integral->dirty_line = image->height;
+	integral->dirty_column = image->width;
+}
+
+// Function to compute the sum of the channel values of the integral image
+// over an area
+//
+// Parameters:
+//	 - image: The image the integral image belongs to
+//	 - area: The area to be added up, of at most MAX_NARROW_PIXELS pixels
+//
+// Returns:
+//	 - The per-channel sum over the area
+sum_t narrow_integral_sum(image_t image, area_t area)
+{
+	unsigned long stride = image.width + 1;
+	narrow_sum_t *table = image.integral->sums;
+	narrow_sum_t end = table[area.line_end * stride + area.column_end];
+	narrow_sum_t above = table[area.line_start * stride + area.column_end];
+	narrow_sum_t left = table[area.line_end * stride + area.column_start];
+	narrow_sum_t corner = table[area.line_start * stride + area.column_start];
+
+	// The differences are taken modulo 2^32 too, which the sum fits in
+	sum_t sum;
+	sum.red = (unsigned int)(end.red - above.red - left.red + corner.red);
+	sum.green = (unsigned int)(end.green - above.green - left.green +
+							   corner.green);
+	sum.blue = (unsigned int)(end.blue - above.blue - left.blue + corner.blue);
+
+	return sum;
+}
+
+// Function to compute the sum of the squared channel values of the integral
+// image over an area
+//
+// Parameters:
+//	 - image: The image the integral image belongs to
+//	 - table: The squares table of the integral image
+//	 - area: The area to be added up
+//
+// Returns:
+//	 - The per-channel sum over the area
+sum_t integral_sum(image_t image, sum_t *table, area_t area)
+{
+	unsigned long stride = image.width + 1;
+	sum_t sum = table[area.line_end * stride + area.column_end];
+
+	subtract_sum(&sum, table[area.line_start * stride + area.column_end]);
+	subtract_sum(&sum, table[area.line_end * stride + area.column_start]);
+	add_sum(&sum, table[area.line_start * stride + area.column_start], 1);
+
+	return sum;
+}
+
+// Function to compute the memory used by a step of the history
+//
+// Parameters:
+//	 - step: Pointer to the step
+//
+// Returns:
+//	 - The number of bytes used by the step and its pixels
+unsigned long long step_memory(step_t *step)
+{
+	return sizeof(step_t) + sizeof(pixel_t) *
+		   (step->area.line_end - step->area.line_start) *
+		   (step->area.column_end - step->area.column_start);
+}
+
+// Function to free a list of steps of a history
+//
+// Parameters:
+//	 - history: Pointer to the history the steps belong to
+//	 - steps: Pointer to the first step of the list (set to NULL)
+void free_steps(history_t *history, step_t **steps)
+{
+	while (*steps) {
+		step_t *step = *steps;
+		*steps = step->next;
+		history->memory -= step_memory(step);
+		release_block(step->pixels);
+		free_picture(&step->picture);
+		free_source(&step->source);
+		free(step);
+	}
+}
+
+// Function to free the memory allocated for the history of an image
+//
+// Parameters:
+//	 - history: Pointer to the history to be freed (set to NULL)
+void free_history(history_t **history)
+{
+	if (!*history)
+		return;
+
+	free_steps(*history, &(*history)->undo);
+	free_steps(*history, &(*history)->redo);
+	free(*history);
+	*history = NULL;
+}
+
+// Function to free the memory allocated for an image and the data derived
+// from it
+//
+// Parameters:
+//	 - image: Pointer to the image to be freed
+void free_image(image_t *image)
+{
+	free_picture(&image->picture);
+	free_source(&image->source);
+	free_pyramid(&image->pyramid);
+	free_integral(&image->integral);
+	free_histogram(&image->histogram);
+	free_target(&image->target);
+	free_history(&image->history);
+}
+
+// Function to compute some lines of a pyramid level (run by each thread)
+//
+// Each pixel is the rounded average of the (up to) 2x2 pixels it covers in
+// the previous level
+//
+// Parameters:
+//	 - data: Pointer to the shrink_t structure describing the area
+//	 - start: First line to be computed, relative to the area
+//	 - end: Line after the last one to be computed, relative to the area
+void shrink_lines(void *data, unsigned short start, unsigned short end)
+{
+	shrink_t *shrink = data;
+	unsigned short line, column;
+
+	for (line = shrink->line_start + start;
+	     line < shrink->line_start + end; line++) {
+		pixel_t *top = shrink->source[2 * line];
+		pixel_t *bottom = 2 * line + 1 < shrink->source_height ?
+						  shrink->source[2 * line + 1] : NULL;
+
+		for (column = shrink->column_start; column < shrink->column_end;
+		     column++) {
+			unsigned short left = 2 * column;
+			unsigned short right = left + 1 < shrink->source_width ?
+								   left + 1 : left;
+			unsigned int red, green, blue, count;
+
+			// Add the pixels of the upper line
+			red = top[left].red + top[right].red;
+			green = top[left].green + top[right].green;
+			blue = top[left].blue + top[right].blue;
+			count = 2;
+
+			// Add the pixels of the lower line, if it exists
+			if (bottom) {
+				red += bottom[left].red + bottom[right].red;
+				green += bottom[left].green + bottom[right].green;
+				blue += bottom[left].blue + bottom[right].blue;
+				count += 2;
+			}
+
+			shrink->destination[line][column].red =
+				(red + count / 2) / count;
+			shrink->destination[line][column].green =
+				(green + count / 2) / count;
+			shrink->destination[line][column].blue =
+				(blue + count / 2) / count;
+		}
+	}
+}
+
+// Function to recompute an area of the image in all of the pyramid levels
+//
+// Parameters:
+//	 - image: The image whose pyramid should be updated
+//	 - area: The area of the image that was modified
+void update_levels(image_t image, area_t area)
+{
+	pyramid_t *pyramid = image.pyramid;
+	unsigned short level;
+
+	for (level = 1; level < pyramid->levels; level++) {
+		// Determine the area covered by the modified pixels in this level
+		area.line_start /= 2;
+		area.column_start /= 2;
+		area.line_end = (area.line_end + 1) / 2;
+		area.column_end = (area.column_end + 1) / 2;
+
+		shrink_t shrink;
+		shrink.source = level == 1 ? image.picture :
+						pyramid->pictures[level - 1];
+		shrink.source_height = pyramid->heights[level - 1];
+		shrink.source_width = pyramid->widths[level - 1];
+		shrink.destination = pyramid->pictures[level];
+		shrink.line_start = area.line_start;
+		shrink.column_start = area.column_start;
+		shrink.column_end = area.column_end;
+
+		parallel_lines(shrink_lines, &shrink,
+					   area.line_end - area.line_start);
+	}
+}
+
+// Function to build the pyramid of an image, replacing the old one
+//
+// Parameters:
+//	 - image: Pointer to the image whose pyramid should be built
+void build_pyramid(image_t *image)
+{
+	free_pyramid(&image->pyramid);
+	if (!image_require(image, full_area(*image)))
+		return;
+
+	pyramid_t *pyramid = malloc(sizeof(pyramid_t));
+	if (!pyramid)
+		return;
+
+	// The first level is the image itself
+	pyramid->levels = 1;
+	pyramid->pictures[0] = NULL;
+	pyramid->heights[0] = image->height;
+	pyramid->widths[0] = image->width;
+
+	// Halve the dimensions until a single pixel is left
+	while (pyramid->levels < MAX_PYRAMID_LEVELS &&
+	       (pyramid->heights[pyramid->levels - 1] > 1 ||
+			pyramid->widths[pyramid->levels - 1] > 1)) {
+		unsigned short level = pyramid->levels;
+
+		pyramid->heights[level] = (pyramid->heights[level - 1] + 1) / 2;
+		pyramid->widths[level] = (pyramid->widths[level - 1] + 1) / 2;
+		pyramid->pictures[level] =
+			create_picture(pyramid->heights[level], pyramid->widths[level]);
+
+		// Check if memory allocation was successful
+		if (!pyramid->pictures[level]) {
+			free_pyramid(&pyramid);
+			return;
+		}
+
+		pyramid->levels++;
+	}
+
+	image->pyramid = pyramid;
+	update_levels(*image, full_area(*image));
+}
+
+// Function to record the area modified in an image in the data derived from
+// it, which is brought up to date from it the next time it is needed
+//
+// The integral image keeps the first line and column modified, the histogram
+// the bands of lines and the file the image was saved to the columns of each
+// line; all of them are thrown away if the dimensions of the image changed
+//
+// Parameters:
+//	 - image: Pointer to the modified image
+//	 - area: The area of the image that was modified
+void mark_modified(image_t *image, area_t area)
+{
+	unsigned long line;
+
+	// The data built for other dimensions is thrown away
+	if (image->integral && (image->integral->height != image->height ||
+							image->integral->width != image->width))
+		free_integral(&image->integral);
+	if (image->histogram && (image->histogram->height != image->height ||
+							 image->histogram->width != image->width))
+		free_histogram(&image->histogram);
+	if (image->target && (image->target->height != image->height ||
+						  image->target->width != image->width))
+		free_target(&image->target);
+
+	if (area.line_start >= area.line_end ||
+	    area.column_start >= area.column_end)
+		return;
+
+	integral_t *integral = image->integral;
+	if (integral) {
+		if (integral->dirty_line > area.line_start)
+			integral->dirty_line = area.line_start;
+		if (integral->dirty_column > area.column_start)
+			integral->dirty_column = area.column_start;
+	}
+
+	histogram_t *histogram = image->histogram;
+	for (line = area.line_start; histogram && line < area.line_end;
+		 line += HISTOGRAM_BAND_LINES - line % HISTOGRAM_BAND_LINES)
+		histogram->stale[line / HISTOGRAM_BAND_LINES] = true;
+
+	target_t *target = image->target;
+	for (line = area.line_start; target && line < area.line_end; line++) {
+		if (target->starts[line] == target->ends[line] ||
+		    target->starts[line] > area.column_start)
+			target->starts[line] = area.column_start;
+		if (target->ends[line] < area.column_end)
+			target->ends[line] = area.column_end;
+	}
+}
+
+// Function to update the data derived from an image after it was modified
+//
+// Parameters:
+//	 - image: Pointer to the modified image
+//	 - area: The area of the image that was modified (if the dimensions of the
+//			 image changed, everything is rebuilt)
+void image_modified(image_t *image, area_t area)
+{
+	// The integral image, the histogram and the saved file are updated from
+	// the modified area the next time they are needed
+	mark_modified(image, area);
+
+	if (!image->pyramid)
+		return;
+
+	// Rebuild the pyramid if the dimensions changed, otherwise only update
+	// the modified area
+	if (image->pyramid->heights[0] != image->height ||
+	    image->pyramid->widths[0] != image->width) {
+		build_pyramid(image);
+	} else if (image_require(image, area)) {
+		update_levels(*image, area);
+	} else {
+		free_pyramid(&image->pyramid);
+	}
+}
+
+// Function to save the tiles of an image covering an area
+//
+// Parameters:
+//	 - image: The image
+//	 - area: The area to be saved
+//
+// Returns:
+//	 - Pointer to a new step holding the tiles or NULL if allocation fails
+step_t *save_step(image_t image, area_t area)
+{
+	step_t *step = malloc(sizeof(step_t));
+	if (!step)
+		return NULL;
+
+	// Extend the area to whole tiles
+	step->area = area;
+	step->area.line_start -= area.line_start % HISTORY_TILE_SIZE;
+	step->area.column_start -= area.column_start % HISTORY_TILE_SIZE;
+	step->area.line_end +=
+		(HISTORY_TILE_SIZE - area.line_end % HISTORY_TILE_SIZE) %
+		HISTORY_TILE_SIZE;
+	step->area.column_end +=
+		(HISTORY_TILE_SIZE - area.column_end % HISTORY_TILE_SIZE) %
+		HISTORY_TILE_SIZE;
+	if (step->area.line_end > image.height)
+		step->area.line_end = image.height;
+	if (step->area.column_end > image.width)
+		step->area.column_end = image.width;
+
+	step->height = image.height;
+	step->width = image.width;
+	step->color = image.color;
+	step->picture = NULL;
+	step->source = NULL;
+
+	unsigned short height = step->area.line_end - step->area.line_start;
+	unsigned short width = step->area.column_end - step->area.column_start;
+	step->pixels = allocate_block((size_t)height * width * sizeof(pixel_t));
+	if (!step->pixels) {
+		free(step);
+		return NULL;
+	}
+
+	unsigned short line;
+	for (line = 0; line < height; line++)
+		memcpy(step->pixels + (size_t)line * width,
+			   image.picture[line + step->area.line_start] +
+			   step->area.column_start,
+			   width * sizeof(pixel_t));
+
+	return step;
+}
+
+// Function to drop the oldest steps of a history until it fits in its limit
+//
+// The steps to be undone are dropped first, the most recent REDO steps last
+//
+// Parameters:
+//	 - history: Pointer to the history
+void trim_history(history_t *history)
+{
+	while (history->memory > history->limit && history->undo) {
+		// Find the oldest step to be undone
+		step_t **oldest = &history->undo;
+		while ((*oldest)->next)
+			oldest = &(*oldest)->next;
+
+		free_steps(history, oldest);
+	}
+
+	if (history->memory > history->limit)
+		free_steps(history, &history->redo);
+}
+
+// Function to add a step to a history, as the first one to be undone
+//
+// Parameters:
+//	 - history: Pointer to the history
+//	 - step: Pointer to the step
+void push_step(history_t *history, step_t *step)
+{
+	step->next = history->undo;
+	history->undo = step;
+	history->memory += step_memory(step);
+	trim_history(history);
+}
+
+// Function to make sure an image has a history and set its memory limit
+//
+// Parameters:
+//	 - image: Pointer to the image
+//	 - limit: The maximum memory used by the history (0 disables it)
+void limit_history(image_t *image, unsigned long long limit)
+{
+	if (!image->picture)
+		return;
+
+	if (!image->history) {
+		image->history = malloc(sizeof(history_t));
+		if (!image->history)
+			return;
+
+		image->history->undo = NULL;
+		image->history->redo = NULL;
+		image->history->memory = 0;
+	}
+
+	image->history->limit = limit;
+	trim_history(image->history);
+}
+
+// Function to record an area of an image that is about to be modified, so
+// that the change can be undone
+//
+// Only the tiles covering the area are saved. A command replacing the whole
+// picture calls retire_picture() instead. A picture shared with other images
+// (see share_picture()) is copied first, the image then modifying its own
+//
+// Parameters:
+//	 - image: Pointer to the image about to be modified
+//	 - area: The area of the image about to be modified
+//
+// Returns:
+//	 - true if the image can be modified, false if its shared picture could
+//	   not be copied (the command must not run)
+bool image_changing(image_t *image, area_t area)
+{
+	// Only the pixels of a non-empty area change
+	if (area.line_start < area.line_end &&
+	    area.column_start < area.column_end &&
+	    picture_shared(image->picture, false)) {
+		pixel_t **copy = copy_picture(*image);
+		if (!copy)
+			return false;
+		free_picture(&image->picture);
+		image->picture = copy;
+	}
+
+	history_t *history = image->history;
+	if (!history || !history->limit)
+		return true;
+
+	// A new change cannot be followed by the steps that were undone
+	free_steps(history, &history->redo);
+
+	// If the change cannot be saved, the older steps cannot be undone either
+	step_t *step = save_step(*image, area);
+	if (!step) {
+		free_steps(history, &history->undo);
+		return true;
+	}
+
+	push_step(history, step);
+	return true;
+}
+
+// Function to take away the picture of an image that a command is replacing
+// with a new one, keeping it in the history so that the change can be undone
+//
+// The picture is moved to the history rather than copied, with the lines
+// that were not decoded yet
+//
+// Parameters:
+//	 - image: Pointer to the image (its picture is set to NULL)
+void retire_picture(image_t *image)
+{
+	history_t *history = image->history;
+	step_t *step = NULL;
+
+	if (history && history->limit) {
+		// A new change cannot be followed by the steps that were undone
+		free_steps(history, &history->redo);
+
+		// If the step cannot be allocated, the older steps cannot be undone
+		step = malloc(sizeof(step_t));
+		if (!step)
+			free_steps(history, &history->undo);
+	}
+
+	if (!step) {
+		free_picture(&image->picture);
+		free_source(&image->source);
+		return;
+	}
+
+	step->height = image->height;
+	step->width = image->width;
+	step->color = image->color;
+	step->area = full_area(*image);
+	step->pixels = NULL;
+	step->picture = image->picture;
+	step->source = image->source;
+	image->picture = NULL;
+	image->source = NULL;
+
+	push_step(history, step);
+}
+
+// Function to put back the tiles (or the picture) saved by a step of the
+// history
+//
+// Parameters:
+//	 - image: Pointer to the image
+//	 - step: Pointer to the step to be restored (its picture, if any, is
+//			 moved back to the image)
+//
+// Returns:
+//	 - Pointer to a new step holding what was replaced (to go back the other
+//	   way) or NULL if allocation fails
+step_t *restore_step(image_t *image, step_t *step)
+{
+	step_t *swap;
+
+	if (step->picture) {
+		// Swap the pictures, the current one going to the new step
+		swap = malloc(sizeof(step_t));
+		if (!swap)
+			return NULL;
+
+		swap->height = image->height;
+		swap->width = image->width;
+		swap->color = image->color;
+		swap->area = full_area(*image);
+		swap->pixels = NULL;
+		swap->picture = image->picture;
+		swap->source = image->source;
+
+		image->picture = step->picture;
+		image->source = step->source;
+		image->height = step->height;
+		image->width = step->width;
+		step->picture = NULL;
+		step->source = NULL;
+	} else {
+		// Save the tiles about to be replaced
+		if (!image_require(image, step->area))
+			return NULL;
+		swap = save_step(*image, step->area);
+		if (!swap)
+			return NULL;
+
+		unsigned short height = step->area.line_end - step->area.line_start;
+		unsigned short width =
+			step->area.column_end - step->area.column_start;
+		unsigned short line;
+		for (line = 0; line < height; line++)
+			memcpy(image->picture[line + step->area.line_start] +
+				   step->area.column_start,
+				   step->pixels + (size_t)line * width,
+				   width * sizeof(pixel_t));
+	}
+	image->color = step->color;
+
+	// Update the data derived from the image
+	image_modified(image, step->area);
+
+	return swap;
+}
+
+// Function to handle the "UNDO" and "REDO" commands
+//
+// Parameters:
+//	 - image: Pointer to the image
+//	 - selection: Pointer to the selected area (the whole image if the
+//				  dimensions change)
+//	 - redo: Whether to redo the last undone step instead of undoing one
+void undo_command(image_t *image, area_t *selection, bool redo)
+{
+	if (!image->picture) {
+		fprintf(output(), "No image loaded\n");
+		return;
+	}
+
+	history_t *history = image->history;
+	if (!history || !(redo ? history->redo : history->undo)) {
+		fprintf(output(), redo ? "Nothing to redo\n" : "Nothing to undo\n");
+		return;
+	}
+
+	step_t **from = redo ? &history->redo : &history->undo;
+	step_t **to = redo ? &history->undo : &history->redo;
+	step_t *step = *from;
+	bool resized = step->height != image->height ||
+				   step->width != image->width;
+
+	step_t *swap = restore_step(image, step);
+	if (!swap) {
+		fprintf(output(), "Not enough memory\n");
+		return;
+	}
+
+	// Move the step to the other list, as the tiles it replaced
+	*from = step->next;
+	history->memory -= step_memory(step);
+	release_block(step->pixels);
+	free(step);
+
+	swap->next = *to;
+	*to = swap;
+	history->memory += step_memory(swap);
+	trim_history(history);
+
+	// Select the whole image if its dimensions changed
+	if (resized)
+		*selection = full_area(*image);
+
+	fprintf(output(), redo ? "Redone\n" : "Undone\n");
+}
+
+// Function to handle the "HISTORY" command, setting the memory limit of the
+// history of every image
+//
+// Parameters:
+//	 - session: Pointer to the session
+//	 - parameter_1: The limit in MiB (0 disables the history)
+void history_command(session_t *session,
+					 char parameter_1[MAX_INPUT_LINE_LENGTH])
+{
+	char *end;
+	unsigned short index;
+	long limit = strtol(parameter_1, &end, 10);
+
+	if (!strlen(parameter_1) || *end || limit < 0) {
+		fprintf(output(), "Invalid command\n");
+		return;
+	}
+
+	session->history_limit = (unsigned long long)limit << 20;
+	for (index = 0; index < session->count; index++)
+		limit_history(&session->slots[index].image, session->history_limit);
+
+	fprintf(output(), "History limit %ld\n", limit);
+}
+
+// Function to skip comments in the header of a file
+//
+// Parameters:
+//   - file: Pointer to the FILE structure representing the open file
+void skip_comments(FILE *file)
+{
+	char check, comment[MAX_INPUT_LINE_LENGTH + 1];
+
+	// Read the first character
+	fscanf(file, "%c", &check);
+
+	// Continue reading comments while the line starts with '#'
+	while (check == '#') {
+		// Read and discard the entire comment line
+		fgets(comment, MAX_INPUT_LINE_LENGTH, file);
+
+		// Read the next character after the comment
+		fscanf(file, "%c", &check);
+	}
+
+	// Unread the character after the last comment
+	ungetc(check, file);
+}
+
+// Function to build the name of the index of the lines of a file
+//
+// Parameters:
+//	 - file_name: The name of the file
+//	 - path: Buffer to store the name of the index
+void index_path(char file_name[FILE_NAME_LENGTH],
+				char path[FILE_NAME_LENGTH + sizeof(".idx")])
+{
+	snprintf(path, FILE_NAME_LENGTH + sizeof(".idx"), "%s.idx", file_name);
+}
+
+// Function to read the offsets of the lines of an ASCII file from its index
+//
+// Parameters:
+//	 - file_name: The name of the file
+//	 - status: The status of the file
+//	 - image: Pointer to the image, whose source gets the offsets
+//
+// Returns:
+//	 - true if an up to date index was read, false otherwise
+bool read_index(char file_name[FILE_NAME_LENGTH], struct stat *status,
+				image_t *image)
+{
+	char path[FILE_NAME_LENGTH + sizeof(".idx")];
+	index_path(file_name, path);
+
+	FILE *file = fopen(path, "rbe");
+	if (!file)
+		return false;
+
+	// The index is only used if it describes the file as it is now
+	source_t *source = image->source;
+	index_t index;
+	bool valid = fread(&index, sizeof(index_t), 1, file) == 1 &&
+				 !memcmp(index.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) &&
+				 index.size == status->st_size &&
+				 index.modified == status->st_mtime &&
+				 index.magic_number == source->magic_number &&
+				 index.height == image->height &&
+				 index.width == image->width &&
+				 fread(source->offsets, sizeof(off_t), image->height + 1,
+					   file) == image->height + 1U;
+
+	fclose(file);
+	return valid;
+}
+
+// Function to write the offsets of the lines of an ASCII file to its index
+//
+// Parameters:
+//	 - file_name: The name of the file
+//	 - status: The status of the file
+//	 - image: The image, whose source holds the offsets
+void write_index(char file_name[FILE_NAME_LENGTH], struct stat *status,
+				 image_t image)
+{
+	char path[FILE_NAME_LENGTH + sizeof(".idx")];
+	index_path(file_name, path);
+
+	FILE *file = fopen(path, "wbe");
+	if (!file)
+		return;
+
+	index_t index;
+	memset(&index, 0, sizeof(index_t));
+	memcpy(index.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+	index.size = status->st_size;
+	index.modified = status->st_mtime;
+	index.magic_number = image.source->magic_number;
+	index.height = image.height;
+	index.width = image.width;
+
+	// Do not leave an index that cannot be read back
+	if (fwrite(&index, sizeof(index_t), 1, file) != 1 ||
+	    fwrite(image.source->offsets, sizeof(off_t), image.height + 1,
+			   file) != image.height + 1U) {
+		fclose(file);
+		remove(path);
+		return;
+	}
+
+	fclose(file);
+}
+
+// Programs compressing the files, used through pipes: the multithreaded
+// ones are preferred where the format allows
+codec_t codecs[] = {
+	{ ".gz", { "pigz", "gzip" }, { "-dc", NULL }, { "-c", NULL } },
+	{ ".zst", { "zstd", NULL }, { "-dcq", NULL }, { "-cq", "-T0", NULL } },
+	{ ".xz", { "xz", NULL }, { "-dc", "-T0", NULL }, { "-c", "-T0", NULL } },
+};
+
+// Function to find the programs compressing a file, from its suffix
+//
+// Parameters:
+//	 - file_name: The name of the file
+//
+// Returns:
+//	 - Pointer to the codec of the file, or NULL if it is not compressed
+codec_t *find_codec(char *file_name)
+{
+	size_t length = strlen(file_name), index;
+
+	for (index = 0; index < sizeof(codecs) / sizeof(codec_t); index++) {
+		size_t suffix = strlen(codecs[index].suffix);
+		if (length > suffix &&
+		    !strcmp(file_name + length - suffix, codecs[index].suffix))
+			return &codecs[index];
+	}
+
+	return NULL;
+}
+
+// Function to start a program of a codec reading from a file descriptor and
+// writing to another one
+//
+// The first program of the codec that can be run is used
+//
+// Parameters:
+//	 - codec: Pointer to the codec
+//	 - options: The options of the program (NULL-terminated)
+//	 - input: File descriptor the program reads from
+//	 - output: File descriptor the program writes to
+//
+// Returns:
+//	 - The process of the program, or -1 if it could not be started
+pid_t start_codec(codec_t *codec, char **options, int input, int output)
+{
+	pid_t process = fork();
+	if (process)
+		return process;
+
+	// Every other descriptor of the editor is opened with close-on-exec, so
+	// the program only inherits its input and output (and standard error)
+	if (dup2(input, STDIN_FILENO) < 0 || dup2(output, STDOUT_FILENO) < 0)
+		_exit(127);
+
+	char *arguments[4] = { NULL, options[0], options[1], NULL };
+	unsigned short index;
+	for (index = 0; index < 2 && codec->programs[index]; index++) {
+		arguments[0] = codec->programs[index];
+		execvp(arguments[0], arguments);
+	}
+
+	_exit(127);
+}
+
+// Function to wait for a program of a codec to finish
+//
+// Parameters:
+//	 - process: The process of the program
+//
+// Returns:
+//	 - true if the program succeeded, false otherwise
+bool finish_codec(pid_t process)
+{
+	int status;
+
+	while (waitpid(process, &status, 0) < 0)
+		if (errno != EINTR)
+			return false;
+
+	return WIFEXITED(status) && !WEXITSTATUS(status);
+}
+
+// Function to decompress a file as it is read
+//
+// The program of the codec writes the decompressed bytes into a pipe, which
+// the image is read from directly (see stream_lines())
+//
+// Parameters:
+//	 - file: Pointer to the FILE structure of the compressed file (closed)
+//	 - codec: Pointer to the codec of the file
+//	 - process: Pointer to store the process of the program, to be waited
+//				for with finish_codec() once the pipe is closed
+//
+// Returns:
+//	 - Pointer to the FILE structure of the pipe, or NULL if the program
+//	   could not be started
+FILE *decompress_file(FILE *file, codec_t *codec, pid_t *process)
+{
+	int pipes[2];
+
+	if (pipe2(pipes, O_CLOEXEC)) {
+		fclose(file);
+		return NULL;
+	}
+
+	*process = start_codec(codec, codec->decompress, fileno(file), pipes[1]);
+	close(pipes[1]);
+	fclose(file);
+
+	FILE *decompressed = *process > 0 ? fdopen(pipes[0], "re") : NULL;
+	if (!decompressed) {
+		close(pipes[0]);
+		if (*process > 0)
+			finish_codec(*process);
+		return NULL;
+	}
+
+	return decompressed;
+}
+
+// Function to wait for the program decompressing a file, after reading what
+// is left of its bytes
+//
+// Parameters:
+//	 - file: Pointer to the FILE structure of the pipe (closed)
+//	 - process: The process of the program
+//
+// Returns:
+//	 - true if the program succeeded, false otherwise
+bool finish_decompress(FILE *file, pid_t process)
+{
+	char *bytes = allocate_block(READ_BUFFER_SIZE);
+
+	// The program would fail writing to a closed pipe
+	while (bytes && fread(bytes, 1, READ_BUFFER_SIZE, file))
+		;
+	release_block(bytes);
+	fclose(file);
+
+	return finish_codec(process) && bytes;
+}
+
+// Function to find where each line of the pixels of an image starts in its
+// file
+//
+// The lines of a binary file all have the same size; the lines of an ASCII
+// file are found by counting the numbers once, without decoding them. If the
+// IMAGE_EDITOR_INDEX environment variable is set, the offsets of the lines
+// of an ASCII file are kept in an index next to it, which is used instead of
+// counting again as long as the file does not change
+//
+// Parameters:
+//	 - file: Pointer to the FILE structure representing the open file,
+//			 positioned at the pixels
+//	 - file_name: The name of the file
+//	 - image: Pointer to the image, whose source gets the offsets
+//
+// Returns:
+//	 - true if the lines were indexed, false if memory could not be allocated
+bool index_lines(FILE *file, char file_name[FILE_NAME_LENGTH], image_t *image)
+{
+	source_t *source = image->source;
+	off_t position = ftello(file);
+	unsigned long long values = image->width * (image->color ? 3ULL : 1ULL);
+	unsigned long long count = 0;
+	unsigned short line;
+
+	if (source->magic_number == 5 || source->magic_number == 6) {
+		for (line = 0; line <= image->height; line++)
+			source->offsets[line] = position + (off_t)(line * values);
+		return true;
+	}
+
+	// Use the index of the file if it is up to date
+	struct stat status;
+	bool indexed = getenv("IMAGE_EDITOR_INDEX") &&
+				   !fstat(source->file, &status);
+	if (indexed && read_index(file_name, &status, image) &&
+	    source->offsets[0] == position)
+		return true;
+
+	unsigned char *bytes = allocate_block(READ_BUFFER_SIZE);
+	if (!bytes)
+		return false;
+
+	// A line ends after the last number of its pixels
+	bool number = false;
+	ssize_t length, index;
+	line = 0;
+	source->offsets[0] = position;
+	while (line < image->height &&
+	       (length = pread(source->file, bytes, READ_BUFFER_SIZE,
+						   position)) > 0) {
+		for (index = 0; index < length && line < image->height; index++) {
+			bool digit = bytes[index] >= '0' && bytes[index] <= '9';
+			if (number && !digit && ++count == values) {
+				source->offsets[++line] = position + index;
+				count = 0;
+			}
+			number = digit;
+		}
+		position += index;
+	}
+
+	// The number at the end of the file ends a line too, and the lines
+	// missing from the file are empty
+	if (number && line < image->height && ++count == values)
+		source->offsets[++line] = position;
+	while (line < image->height)
+		source->offsets[++line] = position;
+
+	release_block(bytes);
+
+	if (indexed)
+		write_index(file_name, &status, *image);
+
+	return true;
+}
+
+// Function to decode the lines of an ASCII file that can only be read once,
+// in order (see stream_lines())
+//
+// The bytes are read a block at a time, and the lines found in them, which
+// end after the last number of their pixels as in index_lines(), are
+// decoded before the next block is read (the block grows to hold a line
+// longer than it)
+//
+// Parameters:
+//	 - file: Pointer to the FILE structure representing the open file,
+//			 positioned at the pixels
+//	 - image: Pointer to the image
+//
+// Returns:
+//	 - true if the lines were decoded, false if memory could not be allocated
+bool stream_ascii(FILE *file, image_t *image)
+{
+	source_t *source = image->source;
+	unsigned long long values = image->width * (image->color ? 3ULL : 1ULL);
+	unsigned long long count = 0;
+	size_t size = DECODE_BLOCK_SIZE, filled = 0, index = 0, length = 1;
+	unsigned char *bytes = allocate_block(size), *grown;
+	unsigned short line = 0, first = 0;
+	bool number = false;
+
+	if (!bytes)
+		return false;
+
+	// The offsets start at the pixels, the bytes at the first line not
+	// decoded yet
+	source->offsets[0] = 0;
+	while (line < image->height && length) {
+		length = fread(bytes + filled, 1, size - filled, file);
+		filled += length;
+		for (; index < filled && line < image->height; index++) {
+			bool digit = bytes[index] >= '0' && bytes[index] <= '9';
+			if (number && !digit && ++count == values) {
+				source->offsets[++line] = source->offsets[first] + index;
+				count = 0;
+			}
+			number = digit;
+		}
+
+		// The number at the end of the file ends a line too, and the lines
+		// missing from the file are empty
+		if (!length && number && line < image->height && ++count == values)
+			source->offsets[++line] = source->offsets[first] + filled;
+		while (!length && line < image->height)
+			source->offsets[++line] = source->offsets[first] + filled;
+
+		// Decode the lines found and keep the bytes after them
+		if (line > first) {
+			size_t used = source->offsets[line] - source->offsets[first];
+			decode_block(image, bytes, first, line);
+			memmove(bytes, bytes + used, filled - used);
+			filled -= used;
+			index -= used;
+			first = line;
+		}
+
+		// Make room for a line longer than the block
+		if (filled == size) {
+			grown = allocate_block(2 * size);
+			if (!grown) {
+				release_block(bytes);
+				return false;
+			}
+			memcpy(grown, bytes, filled);
+			release_block(bytes);
+			bytes = grown;
+			size *= 2;
+		}
+	}
+
+	release_block(bytes);
+	return true;
+}
+
+// Function to decode the lines of an image from a file that can only be
+// read once, in order (the pipe a compressed file is decompressed into)
+//
+// The lines cannot be read again later, so they are all decoded as their
+// bytes arrive, a block of tiles at a time (see block_end()), and the file
+// is not kept
+//
+// Parameters:
+//	 - file: Pointer to the FILE structure representing the open file,
+//			 positioned after the header
+//	 - image: Pointer to the image, whose offsets are filled in (those of a
+//			  native file are already read)
+//	 - position: The offset in the file of the next byte
+//
+// Returns:
+//	 - true if the lines were decoded, false if memory could not be allocated
+bool stream_lines(FILE *file, image_t *image, off_t position)
+{
+	source_t *source = image->source;
+	unsigned long long values = image->width * (image->color ? 3ULL : 1ULL);
+	unsigned short tiles = (image->height + source->tile_lines - 1UL) /
+						   source->tile_lines, tile, last;
+
+	if (source->magic_number == 2 || source->magic_number == 3) {
+		if (!stream_ascii(file, image))
+			return false;
+		free_source(&image->source);
+		return true;
+	}
+
+	if (source->magic_number == 5 || source->magic_number == 6)
+		for (tile = 0; tile <= tiles; tile++)
+			source->offsets[tile] = position + (off_t)(tile * values);
+
+	for (tile = 0; tile < tiles; tile = last) {
+		last = block_end(source, tile, tiles);
+
+		// The bytes before the first tile (of a native file) are skipped,
+		// and the bytes missing from a file that is too short are read as 0
+		size_t length = source->offsets[last] - position;
+		unsigned char *bytes = allocate_block(length + 1);
+		if (!bytes)
+			return false;
+		size_t count = fread(bytes, 1, length, file);
+		memset(bytes + count, 0, length + 1 - count);
+
+		decode_block(image, bytes + (source->offsets[tile] - position), tile,
+					 last);
+		release_block(bytes);
+		position = source->offsets[last];
+	}
+
+	free_source(&image->source);
+	return true;
+}
+
+// Function to allocate the picture of an image being loaded and keep its
+// file, whose lines are decoded when they are first needed
+//
+// Parameters:
+//	 - file: Pointer to the FILE structure representing the open file
+//	 - image: Pointer to the image, whose dimensions are set
+//	 - magic_number: Format of the file
+//	 - max_value: Maximum pixel value specified in the file
+//	 - tile_lines: Lines of each tile of the file (1 for the PNM formats)
+//
+// Returns:
+//	 - true if the image was set up (its offsets are still to be filled in),
+//	   false if memory could not be allocated
+bool open_source(FILE *file, image_t *image, unsigned short magic_number,
+				 unsigned short max_value, unsigned short tile_lines)
+{
+	// Allocate memory for the image pixels
+	image->picture = create_picture(image->height, image->width);
+	if (!image->picture)
+		return false; // Memory allocation failed
+
+	source_t *source = malloc(sizeof(source_t));
+	if (!source) {
+		free_picture(&image->picture);
+		return false;
+	}
+
+	unsigned short tiles = (image->height + tile_lines - 1UL) / tile_lines;
+	unsigned short index;
+	source->file = fcntl(fileno(file), F_DUPFD_CLOEXEC, 0);
+	source->magic_number = magic_number;
+	source->max_value = max_value;
+	for (index = 0; index <= MAX_VALUE; index++)
+		source->scale[index] = scale_value(index, max_value);
+	source->tile_lines = tile_lines;
+	source->offsets = malloc((tiles + 1) * sizeof(off_t));
+	source->decoded = calloc(image->height + 1, sizeof(bool));
+	source->remaining = image->height;
+	image->source = source;
+
+	if (source->file < 0 || !source->offsets || !source->decoded) {
+		free_source(&image->source);
+		free_picture(&image->picture);
+		return false;
+	}
+
+	return true;
+}
+
+// Function to read the header of a file in the native container format and
+// the offsets of its tiles
+//
+// Parameters:
+//	 - file: Pointer to the FILE structure representing the open file,
+//			 positioned after the magic number
+//	 - image: Pointer to the image structure to store the image data
+//	 - stream: Whether the file can only be read once (see stream_lines())
+//
+// Returns:
+//	 - true if the image is successfully read, false otherwise
+bool read_native(FILE *file, image_t *image, bool stream)
+{
+	native_t header;
+	size_t magic = sizeof(header.magic);
+
+	if (fread((char *)&header + magic, sizeof(native_t) - magic, 1,
+			  file) != 1 || !header.tile_lines)
+		return false;
+
+	image->height = header.height;
+	image->width = header.width;
+	image->color = header.color ? true : false;
+
+	if (!open_source(file, image, NATIVE_FORMAT, MAX_VALUE,
+					 header.tile_lines))
+		return false;
+
+	// The offsets must follow the header and each other
+	source_t *source = image->source;
+	unsigned short tiles = (image->height + header.tile_lines - 1UL) /
+						   header.tile_lines, tile;
+	off_t position = sizeof(native_t) + (tiles + 1) * sizeof(off_t);
+	bool valid = fread(source->offsets, sizeof(off_t), tiles + 1, file) ==
+				 tiles + 1U && source->offsets[0] >= position;
+	for (tile = 0; valid && tile < tiles; tile++)
+		valid = source->offsets[tile] <= source->offsets[tile + 1];
+
+	if (!valid || (stream && !stream_lines(file, image, position))) {
+		free_image(image);
+		return false;
+	}
+
+	// An empty image has nothing to decode
+	if (!image->height)
+		free_source(&image->source);
+
+	return true;
+}
+
+// Function to read the magic number and determine the color type of the image
+//
+// Parameters:
+//   - file: Pointer to the FILE structure representing the open file
+//   - file_name: The name of the file
+//   - image: Pointer to the image structure to store the image data
+//
+// Returns:
+//   - true if the image is successfully read, false otherwise
+bool read_image(FILE *file, char file_name[FILE_NAME_LENGTH], image_t *image)
+{
+	unsigned short magic_number, max_value;
+	char residual, magic[sizeof(NATIVE_MAGIC)];
+
+	// The pipe of a compressed file cannot be read again
+	bool stream = lseek(fileno(file), 0, SEEK_CUR) < 0;
+
+	// Check for the native container format first (no PNM file starts with
+	// its first character)
+	int first = getc(file);
+	if (first == NATIVE_MAGIC[0]) {
+		magic[0] = first;
+		return fread(magic + 1, 1, sizeof(magic) - 1, file) ==
+			   sizeof(magic) - 1 &&
+			   !memcmp(magic, NATIVE_MAGIC, sizeof(magic)) &&
+			   read_native(file, image, stream);
+	}
+	ungetc(first, file);
+
+	// Skip comments in the header
+	skip_comments(file);
+
+	// Read the magic number
+	fscanf(file, "P%hd", &magic_number);
+
+	// Set the color type based on the magic number
+	if (magic_number == 2 || magic_number == 5)
+		image->color = false; // Grayscale
+	else if (magic_number == 3 || magic_number == 6)
+		image->color = true; // Color
+	else
+		return false; // Unsupported magic number
+
+	fscanf(file, "%c", &residual);
+
+	// Skip comments in the header
+	skip_comments(file);
+
+	// Read image dimensions
+	fscanf(file, "%hd %hd", &image->width, &image->height);
+
+	// Skip comments in the header
+	skip_comments(file);
+
+	// Read the maximum pixel value
+	fscanf(file, "%hd", &max_value);
+
+	fscanf(file, "%c", &residual);
+
+	// Keep the file, whose lines are decoded when they are first needed
+	// (all of them at once from a pipe)
+	if (!open_source(file, image, magic_number, max_value, 1))
+		return false;
+
+	if (stream ? !stream_lines(file, image, 0) :
+	    !index_lines(file, file_name, image)) {
+		free_image(image);
+		return false;
+	}
+
+	// An empty image has nothing to decode
+	if (!image->height)
+		free_source(&image->source);
+
+	return true;
+}
+
+// Function to look for an up to date image of a file in the image cache
+//
+// Parameters:
+//	 - cache: Pointer to the cache
+//	 - file_name: The name of the file
+//	 - status: The current status of the file
+//	 - image: Pointer to store the cached image, sharing its picture
+//
+// Returns:
+//	 - true if the image was found in the cache, false otherwise
+bool find_cached_image(cache_t *cache, char file_name[FILE_NAME_LENGTH],
+					   struct stat *status, image_t *image)
+{
+	bool found = false;
+	unsigned short index;
+
+	pthread_rwlock_rdlock(&cache->lock);
+	for (index = 0; index < cache->count && !found; index++) {
+		cache_entry_t *entry = &cache->entries[index];
+		if (strcmp(entry->file_name, file_name) ||
+		    entry->modified != status->st_mtime ||
+		    entry->size != status->st_size)
+			continue;
+
+		// The client shares the picture until it modifies it (see
+		// image_changing()), everything else of the image being its own
+		*image = entry->image;
+		image->picture = share_picture(entry->image.picture);
+		image->source = NULL;
+		image->pyramid = NULL;
+		image->integral = NULL;
+		image->histogram = NULL;
+		image->target = NULL;
+		image->history = NULL;
+		found = true;
+	}
+	pthread_rwlock_unlock(&cache->lock);
+
+	return found;
+}
+
+// Function to add a loaded image to the image cache
+//
+// An older image of the same file is replaced; otherwise, when the cache is
+// full, the images are replaced in the order they were added
+//
+// Parameters:
+//	 - cache: Pointer to the cache
+//	 - file_name: The name of the file
+//	 - status: The status of the file when it was loaded
+//	 - image: The loaded image
+void add_cached_image(cache_t *cache, char file_name[FILE_NAME_LENGTH],
+					  struct stat *status, image_t image)
+{
+	image_t copy = image;
+	copy.picture = share_picture(image.picture);
+	copy.source = NULL;
+	copy.pyramid = NULL;
+	copy.integral = NULL;
+	copy.histogram = NULL;
+	copy.target = NULL;
+	copy.history = NULL;
+
+	pthread_rwlock_wrlock(&cache->lock);
+
+	// Find the entry to be used
+	unsigned short index;
+	for (index = 0; index < cache->count; index++)
+		if (!strcmp(cache->entries[index].file_name, file_name))
+			break;
+
+	if (index == cache->count && cache->count < MAX_CACHED_IMAGES) {
+		cache->count++;
+	} else if (index == cache->count) {
+		index = cache->next;
+		cache->next = (cache->next + 1) % MAX_CACHED_IMAGES;
+	}
+
+	cache_entry_t *entry = &cache->entries[index];
+	if (entry->image.picture)
+		free_image(&entry->image);
+
+	strcpy(entry->file_name, file_name);
+	entry->modified = status->st_mtime;
+	entry->size = status->st_size;
+	entry->image = copy;
+
+	pthread_rwlock_unlock(&cache->lock);
+}
+
+// Function to load an image from a file and set the initial selection area
+//
+// Files whose name ends in ".gz", ".zst" or ".xz" are decompressed by the
+// matching program (see codecs) while they are read
+//
+// Parameters:
+//   - file_name: The name of the file to load
+//   - selection: Pointer to the area structure to be set based on the
+//                loaded image
+//
+// Returns:
+//   - An image_t structure representing the loaded image or
+//     an empty_image structure if the load fails
+image_t load_image(char file_name[FILE_NAME_LENGTH])
+{
+	// Open the file for reading
+	FILE *file = fopen(file_name, "re");
+
+	// Create an empty image structure
+	image_t empty_image;
+	empty_image.picture = NULL;
+	empty_image.source = NULL;
+	empty_image.pyramid = NULL;
+	empty_image.integral = NULL;
+	empty_image.histogram = NULL;
+	empty_image.target = NULL;
+	empty_image.history = NULL;
+
+	// Check if the file opened successfully
+	if (!file) {
+		fprintf(output(), "Failed to load %s\n", file_name);
+		return empty_image;
+	}
+
+	image_t image;
+	image.source = NULL;
+	image.pyramid = NULL;
+	image.integral = NULL;
+	image.histogram = NULL;
+	image.target = NULL;
+	image.history = NULL;
+
+	// Use the cached copy of the file if it is up to date
+	context_t *context = get_context();
+	struct stat status;
+	bool cache = context && context->cache && !fstat(fileno(file), &status);
+	if (cache && find_cached_image(context->cache, file_name, &status,
+								   &image)) {
+		fprintf(output(), "Loaded %s\n", file_name);
+		fclose(file);
+		return image;
+	}
+
+	// Read a compressed file from its decompressed bytes
+	codec_t *codec = find_codec(file_name);
+	pid_t decompressor;
+	if (codec)
+		file = decompress_file(file, codec, &decompressor);
+	if (!file) {
+		fprintf(output(), "Failed to load %s\n", file_name);
+		return empty_image;
+	}
+
+	// Attempt to read the image from the file, then close it (the program
+	// decompressing it must succeed too)
+	bool read = read_image(file, file_name, &image);
+	if (!codec) {
+		fclose(file);
+	} else if (!finish_decompress(file, decompressor) && read) {
+		free_image(&image);
+		read = false;
+	}
+	if (!read) {
+		fprintf(output(), "Failed to load %s\n", file_name);
+		return empty_image;
+	}
+
+	// Share the image with the other clients, decoded
+	if (cache && image_require(&image, full_area(image)))
+		add_cached_image(context->cache, file_name, &status, image);
+
+	// Print a success message
+	fprintf(output(), "Loaded %s\n", file_name);
 
 	// Return the loaded image
 	return image;
 }
 
-// Function to handle the "LOAD" command, loading an image from a file and
-// setting the initial selection area
+// Function to handle the "LOAD" command, loading an image from a file and
+// setting the initial selection area
+//
+// Parameters:
+//   - image: Pointer to the image structure to be updated with the loaded image
+//   - selection: Pointer to the area structure to be set based on the
+//				  loaded image
+//   - file_name: The name of the file to load
+//   - pyramid: Whether to build the pyramid of the loaded image
+void load_command(image_t *image, area_t *selection,
+				  char file_name[FILE_NAME_LENGTH], bool pyramid)
+{
+	// Free existing image if it exists
+	if (image->picture)
+		free_image(image);
+
+	// Load the image from the file
+	*image = load_image(file_name);
+
+	// Set the selection area to cover the entire image if the image is loaded
+	if (image->picture) {
+		selection->all = true;
+		selection->column_start = 0;
+		selection->column_end = image->width;
+		selection->line_start = 0;
+		selection->line_end = image->height;
+
+		// Build the pyramid of the image if it was requested
+		if (pyramid)
+			build_pyramid(image);
+	}
+}
+
+// Function to select an area within the image
+//
+// Parameters:
+//	 - selection: The current area selection
+//	 - image: The image to select an area from
+//	 - first_value, second_value, third_value, fourth_value:
+//					Coordinates of the selected area
+//
+// Returns:
+//	 - The updated area selection based on the input coordinates
+area_t area_select(area_t selection, image_t image, signed short first_value,
+				   signed short second_value, signed short third_value,
+				   signed short fourth_value)
+{
+	// Check if the coordinates are valid
+	if ((first_value < 0 || first_value > image.width) ||
+	    (second_value < 0 || second_value > image.height) ||
+	    (third_value < 0 || third_value > image.width) ||
+	    (fourth_value < 0 || fourth_value > image.height) ||
+	    (first_value == third_value || second_value == fourth_value)) {
+		// Print error message and return the original selection
+		fprintf(output(), "Invalid set of coordinates\n");
+		return selection;
+	}
+
+	// Create a new area structure to store the selected area
+	area_t new_area;
+
+	// Determine the column start and end based on the input coordinates
+	if (first_value < third_value) {
+		new_area.column_start = first_value;
+		new_area.column_end = third_value;
+	} else {
+		new_area.column_start = third_value;
+		new_area.column_end = first_value;
+	}
+
+	// Determine the line start and end based on the input coordinates
+	if (second_value < fourth_value) {
+		new_area.line_start = second_value;
+		new_area.line_end = fourth_value;
+	} else {
+		new_area.line_start = fourth_value;
+		new_area.line_end = second_value;
+	}
+
+	// Update the 'all' flag based on the selected area
+	new_area.all =
+	    (!new_area.line_start && new_area.line_end == image.height &&
+	     !new_area.column_start && new_area.column_end == image.width);
+
+	// Print a message indicating the selected area
+	fprintf(output(), "Selected %hd %hd %hd %hd\n", new_area.column_start,
+	       new_area.line_start, new_area.column_end, new_area.line_end);
+
+	// Return the newly selected area
+	return new_area;
+}
+
+// Function to handle the "SELECT" command, updating the selection area
+//
+// Parameters:
+//   - image: Image structure containing the loaded image data
+//   - selection: Pointer to the area structure representing the current
+//				  selection
+//   - parameter_1: First parameter of the SELECT command
+//   - parameter_2: Second parameter of the SELECT command
+//   - parameter_3: Third parameter of the SELECT command
+//   - parameter_4: Fourth parameter of the SELECT command
+//   - parameter_5: Fifth parameter of the SELECT command
+void select_command(image_t image, area_t *selection,
+					char parameter_1[MAX_INPUT_LINE_LENGTH],
+					char parameter_2[MAX_PARAMETER_LENGTH + 1],
+					char parameter_3[MAX_PARAMETER_LENGTH + 1],
+					char parameter_4[MAX_PARAMETER_LENGTH + 1],
+					char parameter_5[MAX_PARAMETER_LENGTH + 1])
+{
+	// Check if an image is loaded
+	if (!image.picture) {
+		fprintf(output(), "No image loaded\n");
+		return;
+	}
+
+	// Check for the "ALL" option
+	if (!strcmp(parameter_1, "ALL") && !strlen(parameter_2)) {
+		// Select the entire image
+		selection->all = true;
+		selection->line_start = 0;
+		selection->column_start = 0;
+		selection->line_end = image.height;
+		selection->column_end = image.width;
+
+		fprintf(output(), "Selected ALL\n");
+		return;
+	}
+
+	// Check for valid parameters and update the selection area
+	if (strlen(parameter_1) && strlen(parameter_2) && strlen(parameter_3) &&
+	    strlen(parameter_4) && !strlen(parameter_5)) {
+		// Check for invalid parameters
+		if ((!atoi(parameter_1) && parameter_1[0] != '0') ||
+		    (!atoi(parameter_2) && parameter_2[0] != '0') ||
+		    (!atoi(parameter_3) && parameter_3[0] != '0') ||
+		    (!atoi(parameter_4) && parameter_4[0] != '0')) {
+			fprintf(output(), "Invalid command\n");
+			return;
+		}
+
+		// Update the selection area
+		*selection = area_select(*selection, image, atoi(parameter_1),
+								 atoi(parameter_2), atoi(parameter_3),
+								 atoi(parameter_4));
+		return;
+	}
+
+	// Invalid command if none of the conditions are met
+	fprintf(output(), "Invalid command\n");
+}
+
+// Function to print stars representing a histogram bin
+//
+// Parameters:
+//	 - number: The number of stars to print
+void print_stars(unsigned short number)
+{
+	// Print the bin number followed by a tab, a pipe symbol and another tab
+	fprintf(output(), "%hd\t|\t", number);
+
+	// Print the stars representing the bin count
+	unsigned short index;
+	for (index = 0; index < number; index++)
+		fprintf(output(), "*");
+
+	// Move to the next line for the next bin
+	fprintf(output(), "\n");
+}
+
+// Function to count the pixels of each value of each channel of an image,
+// building the histogram the first time and then counting again only the
+// bands of lines modified since (see image_modified())
+//
+// Parameters:
+//	 - image: Pointer to the image (its histogram stays NULL if memory could
+//			  not be allocated)
+void update_histogram(image_t *image)
+{
+	histogram_t *histogram = image->histogram;
+	unsigned short band, line, column, channel, index;
+
+	if (!histogram) {
+		histogram = malloc(sizeof(histogram_t));
+		if (!histogram)
+			return;
+
+		histogram->height = image->height;
+		histogram->width = image->width;
+		histogram->bands = (image->height + HISTOGRAM_BAND_LINES - 1) /
+						   HISTOGRAM_BAND_LINES;
+		histogram->band_counts = calloc(histogram->bands,
+										sizeof(*histogram->band_counts));
+		histogram->stale = malloc(histogram->bands * sizeof(bool));
+		if (!histogram->band_counts || !histogram->stale) {
+			free_histogram(&histogram);
+			return;
+		}
+
+		// Every band is counted, starting from empty counts
+		memset(histogram->counts, 0, sizeof(histogram->counts));
+		for (band = 0; band < histogram->bands; band++)
+			histogram->stale[band] = true;
+		image->histogram = histogram;
+	}
+
+	for (band = 0; band < histogram->bands; band++) {
+		if (!histogram->stale[band])
+			continue;
+		unsigned int (*counts)[MAX_VALUE + 1] = histogram->band_counts[band];
+
+		// Take the old counts of the band out of those of the image
+		for (channel = 0; channel < 3; channel++)
+			for (index = 0; index <= MAX_VALUE; index++)
+				histogram->counts[channel][index] -= counts[channel][index];
+		memset(counts, 0, sizeof(*histogram->band_counts));
+
+		unsigned long end = (band + 1UL) * HISTOGRAM_BAND_LINES;
+		if (end > image->height)
+			end = image->height;
+		for (line = band * HISTOGRAM_BAND_LINES; line < end; line++) {
+			pixel_t *pixels = image->picture[line];
+			for (column = 0; column < image->width; column++) {
+				counts[0][pixels[column].red]++;
+				counts[1][pixels[column].green]++;
+				counts[2][pixels[column].blue]++;
+			}
+		}
+
+		for (channel = 0; channel < 3; channel++)
+			for (index = 0; index <= MAX_VALUE; index++)
+				histogram->counts[channel][index] += counts[channel][index];
+		histogram->stale[band] = false;
+	}
+}
+
+// Function to count the pixels of each value approximately, from the
+// coarsest pyramid level that still has enough pixels
+//
+// Each pixel of the level stands for the pixels of the image it covers
+//
+// Parameters:
+//	 - image: The image to analyze (its pyramid must be built)
+//	 - channel: The channel to count (0 for red, 1 for green, 2 for blue)
+//	 - count: Array to store the number of pixels of each value
+void count_approximate_values(image_t image, unsigned short channel,
+							  unsigned long count[MAX_VALUE + 1])
+{
+	pyramid_t *pyramid = image.pyramid;
+	unsigned short level = 0, line, column;
+
+	// Find the coarsest level with enough pixels
+	while (level + 1 < pyramid->levels &&
+	       (unsigned long)pyramid->heights[level + 1] *
+		   pyramid->widths[level + 1] >= MIN_APPROXIMATE_PIXELS)
+		level++;
+
+	pixel_t **picture = level ? pyramid->pictures[level] : image.picture;
+	unsigned long size = 1UL << level;
+
+	for (line = 0; line < pyramid->heights[level]; line++) {
+		// Determine the number of image lines covered by the line
+		unsigned long lines = image.height - line * size < size ?
+							  image.height - line * size : size;
+
+		for (column = 0; column < pyramid->widths[level]; column++) {
+			unsigned long columns = image.width - column * size < size ?
+									image.width - column * size : size;
+
+			count[pixel_channel(picture[line][column], channel)] +=
+				lines * columns;
+		}
+	}
+}
+
+// Function that constructs and prints a histogram for a channel of an image
+// (the red one of a grayscale image, since all its channels are identical)
+//
+// Parameters:
+//	 - image: The image to analyze
+//	 - number_of_stars: The maximum number of stars to use for representing
+//						each bin
+//	 - number_of_bins: The number of bins in the histogram
+//	 - approximate: Whether the pixels may be counted from the pyramid
+//	 - channel: The channel (0 for red, 1 for green, 2 for blue)
+void make_histogram(image_t image, short number_of_stars, short number_of_bins,
+					bool approximate, unsigned short channel)
+{
+	// Calculate the step size for each histogram bin
+	unsigned short step = (MAX_VALUE + 1) / number_of_bins;
+
+	// Array to store the frequency of values in each bin
+	unsigned long frequency[MAX_VALUE + 1];
+
+	// Array to store the number of pixels of each value
+	unsigned long count[MAX_VALUE + 1] = { 0 };
+
+	unsigned short value, line, column, previous_value = 0, index;
+
+	// Count the pixels of each value in a single pass over the image (or
+	// over a coarse level of its pyramid), unless its histogram has them
+	if (approximate) {
+		count_approximate_values(image, channel, count);
+	} else if (image.histogram) {
+		for (value = 0; value <= MAX_VALUE; value++)
+			count[value] = image.histogram->counts[channel][value];
+	} else {
+		for (line = 0; line < image.height; line++)
+			for (column = 0; column < image.width; column++)
+				count[pixel_channel(image.picture[line][column],
+									channel)]++;
+	}
+
+	// Iterate over each bin
+	for (index = 0; index < number_of_bins; index++) {
+		// Determine the upper value for the current bin
+		value = (index + 1) * step;
+
+		// Add the counts of the values falling within the current bin
+		frequency[index] = 0;
+		for (; previous_value < value; previous_value++)
+			frequency[index] += count[previous_value];
+	}
+
+	// Find the maximum frequency to normalize the histogram
+	unsigned long max_value = frequency[0];
+	for (index = 1; index < number_of_bins; index++) {
+		if (max_value < frequency[index])
+			max_value = frequency[index];
+	}
+
+	// Print stars for each bin, scaled based on their frequency
+	for (index = 0; index < number_of_bins; index++) {
+		print_stars((1. * frequency[index]) / (1. * max_value) *
+			    (1. * number_of_stars));
+	}
+}
+
+// Function to handle the "HISTOGRAM" command, generating a histogram for the
+// specified channel of the image
+//
+// Parameters:
+//   - image: Pointer to the image structure containing the loaded image data
+//   - parameter_1: First parameter of the HISTOGRAM command
+//   - parameter_2: Second parameter of the HISTOGRAM command
+//   - parameter_3: "APPROX" to count the pixels from the pyramid (built if
+//					needed), which is faster but approximate, or "RGB"
+//   - parameter_4: "RGB" (after "APPROX") for a histogram of each channel of
+//					a color image
+//   - keep: Whether the pyramids are kept (see PYRAMID), otherwise the one
+//			 built for APPROX is freed afterwards
+void histogram_command(image_t *image, char parameter_1[MAX_INPUT_LINE_LENGTH],
+					   char parameter_2[MAX_PARAMETER_LENGTH + 1],
+				       char parameter_3[MAX_PARAMETER_LENGTH + 1],
+				       char parameter_4[MAX_PARAMETER_LENGTH + 1], bool keep)
+{
+	// The options, APPROX before RGB
+	bool approximate = !strcmp(parameter_3, "APPROX");
+	char *last = approximate ? parameter_4 : parameter_3;
+	bool channels = !strcmp(last, "RGB");
+
+	// Check if an image is loaded
+	if (!image->picture)
+		fprintf(output(), "No image loaded\n");
+
+	// Check for the correct number of parameters
+	else if (strlen(parameter_1) && strlen(parameter_2) &&
+			 (!strlen(last) || channels) &&
+			 (approximate || !strlen(parameter_4))) {
+		// Check if the image is a color image
+		if (image->color && !channels) {
+			fprintf(output(), "Black and white image needed\n");
+		} else {
+			// Build the pyramid for an approximate histogram, otherwise
+			// (or if it cannot be built) bring the counts of the values up
+			// to date
+			if (approximate && !image->pyramid)
+				build_pyramid(image);
+			if (!approximate || !image->pyramid)
+				update_histogram(image);
+			approximate = approximate && image->pyramid;
+
+			// Generate and display the histogram for the specified channel,
+			// or for each channel of a color image, after its name
+			char *names[3] = { "Red", "Green", "Blue" };
+			unsigned short channel;
+			if (!image->color) {
+				make_histogram(*image, atoi(parameter_1), atoi(parameter_2),
+							   approximate, 0);
+			} else {
+				for (channel = 0; channel < 3; channel++) {
+					fprintf(output(), "%s\n", names[channel]);
+					make_histogram(*image, atoi(parameter_1),
+								   atoi(parameter_2), approximate, channel);
+				}
+			}
+
+			// The pyramid is not kept up to date for the next commands
+			if (!keep)
+				free_pyramid(&image->pyramid);
+		}
+	} else {
+		// Print an error message for an invalid command
+		fprintf(output(), "Invalid command\n");
+	}
+}
+
+// Function to perform histogram equalization on an image, on each channel
+// of a color image separately
+//
+// Parameters:
+//   - image: Pointer to the image structure to be modified
+void equalize(image_t *image)
+{
+	// Initialize arrays to store frequency and cumulative distribution
+	unsigned long frequency[3][MAX_VALUE + 1] = { { 0 } };
+	double cumulative_distribution[MAX_VALUE + 1] = { 0 };
+	unsigned char equalized[3][MAX_VALUE + 1];
+	unsigned short index, line, column, channel;
+	unsigned short channels = image->color ? 3 : 1;
+
+	// Calculate frequency of each intensity level (of the red channel only
+	// for a grayscale image, whose channels are identical), taken from the
+	// histogram of the image when it can be brought up to date
+	update_histogram(image);
+	if (image->histogram)
+		memcpy(frequency, image->histogram->counts, sizeof(frequency));
+	for (line = 0; !image->histogram && line < image->height; line++) {
+		pixel_t *pixels = image->picture[line];
+		for (column = 0; column < image->width; column++) {
+			frequency[0][pixels[column].red]++;
+			if (image->color) {
+				frequency[1][pixels[column].green]++;
+				frequency[2][pixels[column].blue]++;
+			}
+		}
+	}
+
+	for (channel = 0; channel < channels; channel++) {
+		// Calculate cumulative distribution function
+		cumulative_distribution[0] =
+			(double)frequency[channel][0] / (image->height * image->width);
+		for (index = 1; index <= MAX_VALUE; index++) {
+			cumulative_distribution[index] =
+				cumulative_distribution[index - 1] +
+				(double)frequency[channel][index] /
+				(image->height * image->width);
+		}
+
+		// Compute the new value of each intensity level once
+		for (index = 0; index <= MAX_VALUE; index++)
+			equalized[channel][index] =
+				clamp(round_double(cumulative_distribution[index] *
+								   MAX_VALUE));
+	}
+
+	// Record the image before it is modified
+	if (!image_changing(image, full_area(*image))) {
+		fprintf(output(), "Not enough memory\n");
+		return;
+	}
+
+	// Perform histogram equalization
+	for (line = 0; line < image->height; line++) {
+		pixel_t *pixels = image->picture[line];
+		for (column = 0; column < image->width; column++) {
+			// Update pixel values after equalization
+			pixels[column].red = equalized[0][pixels[column].red];
+			if (image->color) {
+				pixels[column].green = equalized[1][pixels[column].green];
+				pixels[column].blue = equalized[2][pixels[column].blue];
+			} else {
+				pixels[column].green = pixels[column].red;
+				pixels[column].blue = pixels[column].red;
+			}
+		}
+	}
+
+	// Update the data derived from the image
+	image_modified(image, full_area(*image));
+
+	// Print a message indicating the completion of equalization
+	fprintf(output(), "Equalize done\n");
+}
+
+#ifdef __SSE2__
+// Function to add up the weighted channels of four pixels, given as the
+// twelve products of their channels in order (four in each vector)
+//
+// Parameters:
+//	 - first: The products of the channels 0 to 3
+//	 - second: The products of the channels 4 to 7
+//	 - third: The products of the channels 8 to 11
+//
+// Returns:
+//	 - The weighted sums of the four pixels
+__m128i sum_channels(__m128i first, __m128i second, __m128i third)
+{
+	__m128 products_1 = _mm_castsi128_ps(first);
+	__m128 products_2 = _mm_castsi128_ps(second);
+	__m128 products_3 = _mm_castsi128_ps(third);
+
+	// Gather the products of each channel: 0 3 6 9, 1 4 7 10 and 2 5 8 11
+	__m128 reds = _mm_shuffle_ps(products_1,
+								 _mm_shuffle_ps(products_2, products_3,
+												_MM_SHUFFLE(0, 1, 0, 2)),
+								 _MM_SHUFFLE(2, 0, 3, 0));
+	__m128 greens = _mm_shuffle_ps(_mm_shuffle_ps(products_1, products_2,
+												  _MM_SHUFFLE(0, 0, 0, 1)),
+								   _mm_shuffle_ps(products_2, products_3,
+												  _MM_SHUFFLE(0, 2, 0, 3)),
+								   _MM_SHUFFLE(2, 0, 2, 0));
+	__m128 blues = _mm_shuffle_ps(_mm_shuffle_ps(products_1, products_2,
+												 _MM_SHUFFLE(0, 1, 0, 2)),
+								  products_3, _MM_SHUFFLE(3, 0, 2, 0));
+
+	return _mm_add_epi32(_mm_add_epi32(_mm_castps_si128(reds),
+									   _mm_castps_si128(greens)),
+						 _mm_castps_si128(blues));
+}
+
+// Function to replace eight pixels with their luma, as three vectors of
+// channels (SSE2 has no shuffle of 16-bit values, so the products are
+// widened to 32 bits, summed per pixel and the luma is repeated on the
+// three channels before being packed back)
+//
+// Parameters:
+//	 - pixels: The eight pixels
+//	 - weights: The weights of the channels of each of the three vectors
+void luma_vectors(pixel_t *pixels, __m128i weights[3])
+{
+	__m128i *values = (__m128i *)pixels;
+	__m128i products[6], half = _mm_set1_epi32(32768);
+	unsigned short part;
+
+	// The channels are below 256 and the weights below 65536, so the high
+	// halves of the products complete them exactly
+	for (part = 0; part < 3; part++) {
+		__m128i channels = _mm_loadu_si128(values + part);
+		__m128i low = _mm_mullo_epi16(channels, weights[part]);
+		__m128i high = _mm_mulhi_epu16(channels, weights[part]);
+		products[2 * part] = _mm_unpacklo_epi16(low, high);
+		products[2 * part + 1] = _mm_unpackhi_epi16(low, high);
+	}
+
+	__m128i first = _mm_srli_epi32(_mm_add_epi32(sum_channels(products[0],
+															  products[1],
+															  products[2]),
+												 half), 16);
+	__m128i second = _mm_srli_epi32(_mm_add_epi32(sum_channels(products[3],
+															   products[4],
+															   products[5]),
+												  half), 16);
+
+	// Each luma fills three channels: 0 0 0 1 1 1 2 2, 2 3 3 3 4 4 4 5 and
+	// 5 5 6 6 6 7 7 7
+	_mm_storeu_si128(values,
+					 _mm_packs_epi32(_mm_shuffle_epi32(first,
+													   _MM_SHUFFLE(1, 0, 0, 0)),
+									 _mm_shuffle_epi32(first,
+													   _MM_SHUFFLE(2, 2, 1, 1))));
+	_mm_storeu_si128(values + 1,
+					 _mm_packs_epi32(_mm_shuffle_epi32(first,
+													   _MM_SHUFFLE(3, 3, 3, 2)),
+									 _mm_shuffle_epi32(second,
+													   _MM_SHUFFLE(1, 0, 0, 0))));
+	_mm_storeu_si128(values + 2,
+					 _mm_packs_epi32(_mm_shuffle_epi32(second,
+													   _MM_SHUFFLE(2, 2, 1, 1)),
+									 _mm_shuffle_epi32(second,
+													   _MM_SHUFFLE(3, 3, 3, 2))));
+}
+#endif
+
+// Function to replace the pixels of some lines of an image with their luma
+// (run by each thread)
+//
+// The pixels are taken eight at a time with SSE2 where it is available (the
+// compilers do not vectorize the loop themselves, as the channels are 16-bit
+// values three apart), the ones left one by one
+//
+// Parameters:
+//	 - data: Pointer to the luma_t structure describing the image
+//	 - start: First line to be converted
+//	 - end: Line after the last one to be converted
+void luma_lines(void *data, unsigned short start, unsigned short end)
+{
+	luma_t *luma = data;
+	unsigned short line, column;
+
+#ifdef __SSE2__
+	// The weights of the channels of the three vectors of eight pixels
+	__m128i weights[3];
+	weights[0] = _mm_setr_epi16(luma->red, luma->green, luma->blue, luma->red,
+								luma->green, luma->blue, luma->red,
+								luma->green);
+	weights[1] = _mm_setr_epi16(luma->blue, luma->red, luma->green,
+								luma->blue, luma->red, luma->green,
+								luma->blue, luma->red);
+	weights[2] = _mm_setr_epi16(luma->green, luma->blue, luma->red,
+								luma->green, luma->blue, luma->red,
+								luma->green, luma->blue);
+#endif
+
+	// The weights add up to 65536, so the rounded luma stays below 256
+	for (line = start; line < end; line++) {
+		pixel_t *pixels = luma->picture[line];
+		column = 0;
+#ifdef __SSE2__
+		for (; column + 8 <= luma->width; column += 8)
+			luma_vectors(pixels + column, weights);
+#endif
+		for (; column < luma->width; column++) {
+			unsigned short value = (luma->red * pixels[column].red +
+									luma->green * pixels[column].green +
+									luma->blue * pixels[column].blue +
+									32768) >> 16;
+			pixels[column].red = value;
+			pixels[column].green = value;
+			pixels[column].blue = value;
+		}
+	}
+}
+
+// Function to handle the "CONVERT" command, converting the image to
+// grayscale or to color
+//
+// A color image becomes the luma of its pixels, computed in integers with
+// the weights of BT.601 (by default) or BT.709, the lines being split
+// between the threads; a grayscale image is already stored with three
+// identical channels, so it only becomes a color image, and the history only
+// records the flag (an empty area)
+//
+// Parameters:
+//   - image: Pointer to the image structure to be modified
+//   - parameter_1: "GRAY" or "COLOR"
+//   - parameter_2: "BT601" or "BT709" (for "GRAY" only, optional)
+//   - parameter_3: Must be empty
+void convert_command(image_t *image, char parameter_1[MAX_INPUT_LINE_LENGTH],
+					 char parameter_2[MAX_PARAMETER_LENGTH + 1],
+					 char parameter_3[MAX_PARAMETER_LENGTH + 1])
+{
+	// Check if an image is loaded
+	if (!image->picture) {
+		fprintf(output(), "No image loaded\n");
+		return;
+	}
+
+	// Check for invalid parameters
+	bool gray = !strcmp(parameter_1, "GRAY");
+	if (!strlen(parameter_1) || strlen(parameter_3) ||
+	    (strlen(parameter_2) && !gray)) {
+		fprintf(output(), "Invalid command\n");
+		return;
+	}
+	if ((!gray && strcmp(parameter_1, "COLOR")) ||
+	    (strlen(parameter_2) && strcmp(parameter_2, "BT601") &&
+		 strcmp(parameter_2, "BT709"))) {
+		fprintf(output(), "CONVERT parameter invalid\n");
+		return;
+	}
+
+	// Nothing changes if the image already has the right type
+	if (image->color != gray) {
+		fprintf(output(), "CONVERT %s done\n", parameter_1);
+		return;
+	}
+
+	// The pixels of a grayscale image do not change, nor the data derived
+	// from them
+	if (!gray) {
+		area_t none;
+		memset(&none, 0, sizeof(area_t));
+		image_changing(image, none);
+		image->color = true;
+		fprintf(output(), "CONVERT %s done\n", parameter_1);
+		return;
+	}
+
+	// Record the image before it is modified
+	if (!image_changing(image, full_area(*image))) {
+		fprintf(output(), "Not enough memory\n");
+		return;
+	}
+
+	bool bt709 = !strcmp(parameter_2, "BT709");
+	luma_t luma;
+	luma.picture = image->picture;
+	luma.width = image->width;
+	luma.red = bt709 ? BT709_RED : BT601_RED;
+	luma.green = bt709 ? BT709_GREEN : BT601_GREEN;
+	luma.blue = bt709 ? BT709_BLUE : BT601_BLUE;
+	parallel_lines(luma_lines, &luma, image->height);
+	image->color = false;
+
+	// Update the data derived from the image
+	image_modified(image, full_area(*image));
+
+	// Print a success message
+	fprintf(output(), "CONVERT %s done\n", parameter_1);
+}
+
+// Function to rotate a selected area within an image
+//
+// Parameters:
+//	 - image: Pointer to the image structure to be rotated
+//	 - selection: The selected area to be rotated
+//	 - angle: The angle (in degrees) by which the area should be rotated
+void rotate_area(image_t *image, area_t selection, signed short angle)
+{
+	// Adjust negative angles
+	signed short flip = angle;
+	if (flip < 0)
+		flip += 360;
+
+	// Determine the number of 90-degree rotations needed
+	flip = (flip / 90) % 4;
+
+	// No rotation needed for multiples of 360 degrees
+	if (!flip) {
+		fprintf(output(), "Rotated %hd\n", angle);
+		return;
+	}
+
+	// Decode the lines of the selection
+	if (!image_require(image, selection)) {
+		fprintf(output(), "Not enough memory\n");
+		return;
+	}
+
+	// Create a copy of the selected area
+	pixel_t **copy =
+	    create_picture((selection.line_end - selection.line_start),
+					   (selection.column_end - selection.column_start));
+
+	if (!copy)
+		return;
+
+	// Record the selected area before it is modified
+	if (!image_changing(image, selection)) {
+		fprintf(output(), "Not enough memory\n");
+		free_picture(&copy);
+		return;
+	}
+
+	// Perform the specified number of 90-degree rotations
+	short line, column, index;
+	for (index = flip; index != 0; index--) {
+		for (line = 0; line < selection.line_end - selection.line_start;
+		     line++) {
+			for (column = 0; column < selection.column_end -
+						      selection.column_start;
+			     column++) {
+				// Rotate the pixels
+				copy[line][column] =
+				    image->picture[selection.line_end - 1 -
+						   column]
+						  [line +
+						   selection.column_start];
+			}
+		}
+
+		// Copy the rotated pixels back to the original location
+		for (line = 0; line < selection.line_end - selection.line_start;
+		     line++) {
+			for (column = 0; column < selection.column_end -
+						      selection.column_start;
+			     column++) {
+				image->picture[line + selection.line_start]
+					      [column + selection.column_start] =
+				    copy[line][column];
+			}
+		}
+	}
+
+	// Free memory used for the copy
+	free_picture(&copy);
+
+	// Update the data derived from the image
+	image_modified(image, selection);
+
+	// Print a message indicating the completion of rotation
+	fprintf(output(), "Rotated %hd\n", angle);
+}
+
+// Function to rotate the entire image
+//
+// Parameters:
+//	 - image: Pointer to the image structure to be rotated
+//	 - angle: The angle (in degrees) by which the image should be rotated
+void rotate_all(image_t *image, signed short angle)
+{
+	// Adjust negative angles
+	signed short flip = angle;
+	if (flip < 0)
+		flip += 360;
+
+	// Determine the number of 90-degree rotations needed
+	flip = (flip / 90) % 4;
+
+	// No rotation needed for multiples of 360 degrees
+	if (!flip) {
+		fprintf(output(), "Rotated %hd\n", angle);
+		return;
+	}
+
+	pixel_t **copy;
+
+	// Decode the whole image
+	if (!image_require(image, full_area(*image))) {
+		fprintf(output(), "Not enough memory\n");
+		return;
+	}
+
+	unsigned short index, auxiliary, line, column;
+	for (index = flip; index != 0; index--) {
+		// Create a copy of the image (once the picture was replaced, the
+		// data derived from it must follow the rotations already done)
+		copy = create_picture(image->width, image->height);
+		if (!copy) {
+			if (index != flip)
+				image_modified(image, full_area(*image));
+			return;
+		}
+
+		// Perform the 90-degree rotation
+		for (line = 0; line < image->width; line++) {
+			for (column = 0; column < image->height; column++) {
+				copy[line][column] =
+				    image->picture[image->height - column - 1]
+						  [line];
+			}
+		}
+
+		// Replace the original image with the rotated copy, keeping the
+		// original in the history
+		if (index == flip)
+			retire_picture(image);
+		else
+			free_picture(&image->picture);
+		image->picture = copy;
+
+		// Swap the image dimensions
+		auxiliary = image->height;
+		image->height = image->width;
+		image->width = auxiliary;
+	}
+
+	// Update the data derived from the image
+	image_modified(image, full_area(*image));
+
+	// Print a message indicating the completion of rotation
+	fprintf(output(), "Rotated %hd\n", angle);
+}
+
+// Function to sample the copy of a rotated area at a fixed-point position
+//
+// Parameters:
+//	 - rotation: The data of the rotation
+//	 - x, y: The position, in fixed point, measured from the top left corner
+//			 of the area (the center of a pixel is at half a pixel)
+//
+// Returns:
+//	 - The sampled pixel, or a black pixel if the position is outside the area
+pixel_t sample_pixel(rotation_t *rotation, long long x, long long y)
+{
+	pixel_t black = { 0, 0, 0 };
+	long long width = rotation->selection.column_end -
+					  rotation->selection.column_start;
+	long long height = rotation->selection.line_end -
+					   rotation->selection.line_start;
+
+	// Positions outside the area are filled with black
+	if (x < 0 || y < 0 || x >= width << FIXED_POINT_BITS ||
+	    y >= height << FIXED_POINT_BITS)
+		return black;
+
+	if (!rotation->bilinear)
+		return rotation->source[y >> FIXED_POINT_BITS][x >> FIXED_POINT_BITS];
+
+	// Move to the coordinates of the pixel centers and keep 8 bits of the
+	// fractional part as the interpolation weights
+	x -= 1 << (FIXED_POINT_BITS - 1);
+	y -= 1 << (FIXED_POINT_BITS - 1);
+	long long left = x >> FIXED_POINT_BITS, top = y >> FIXED_POINT_BITS;
+	unsigned int weight_x = (x >> (FIXED_POINT_BITS - 8)) & 0xFF;
+	unsigned int weight_y = (y >> (FIXED_POINT_BITS - 8)) & 0xFF;
+
+	// Clamp the neighbours to the area
+	long long right = left + 1, bottom = top + 1;
+	if (left < 0)
+		left = 0;
+	if (top < 0)
+		top = 0;
+	if (right >= width)
+		right = width - 1;
+	if (bottom >= height)
+		bottom = height - 1;
+
+	pixel_t top_left = rotation->source[top][left];
+	pixel_t top_right = rotation->source[top][right];
+	pixel_t bottom_left = rotation->source[bottom][left];
+	pixel_t bottom_right = rotation->source[bottom][right];
+	pixel_t result;
+
+	// Interpolate horizontally, then vertically, rounding the result
+	result.red = (((top_left.red * (256 - weight_x) +
+					top_right.red * weight_x) * (256 - weight_y) +
+				   (bottom_left.red * (256 - weight_x) +
+					bottom_right.red * weight_x) * weight_y) + 32768) >> 16;
+	result.green = (((top_left.green * (256 - weight_x) +
+					  top_right.green * weight_x) * (256 - weight_y) +
+					 (bottom_left.green * (256 - weight_x) +
+					  bottom_right.green * weight_x) * weight_y) + 32768) >> 16;
+	result.blue = (((top_left.blue * (256 - weight_x) +
+					 top_right.blue * weight_x) * (256 - weight_y) +
+					(bottom_left.blue * (256 - weight_x) +
+					 bottom_right.blue * weight_x) * weight_y) + 32768) >> 16;
+
+	return result;
+}
+
+// Function to rotate some lines of an area by any angle (run by each thread)
+//
+// The lines are processed in square tiles, so the source pixels read for a
+// tile stay in the cache even though they are walked diagonally. Inside a
+// tile, the source position only changes by a constant fixed-point step
+// from one pixel to the next
+//
+// Parameters:
+//	 - data: Pointer to the rotation_t structure describing the rotation
+//	 - start: First line of the area to be computed
+//	 - end: Line after the last one to be computed
+void rotate_lines(void *data, unsigned short start, unsigned short end)
+{
+	rotation_t *rotation = data;
+	area_t selection = rotation->selection;
+	long long width = selection.column_end - selection.column_start;
+	long long height = selection.line_end - selection.line_start;
+	long long one = 1LL << FIXED_POINT_BITS;
+	unsigned short tile_line, tile_column, line, column, last_line, last_column;
+
+	for (tile_line = start; tile_line < end;
+	     tile_line += ROTATION_TILE_SIZE) {
+		last_line = end - tile_line > ROTATION_TILE_SIZE ?
+					tile_line + ROTATION_TILE_SIZE : end;
+
+		for (tile_column = 0; tile_column < width;
+		     tile_column += ROTATION_TILE_SIZE) {
+			last_column = width - tile_column > ROTATION_TILE_SIZE ?
+						  tile_column + ROTATION_TILE_SIZE : width;
+
+			for (line = tile_line; line < last_line; line++) {
+				// Position of the first pixel relative to the center of
+				// the area, in fixed point
+				long long x = (2 * tile_column + 1 - width) * one / 2;
+				long long y = (2 * line + 1 - height) * one / 2;
+
+				// Map it back to the source area with the inverse rotation
+				long long source_x = ((rotation->cosine * x +
+									   rotation->sine * y) >>
+									  FIXED_POINT_BITS) + width * one / 2;
+				long long source_y = ((rotation->cosine * y -
+									   rotation->sine * x) >>
+									  FIXED_POINT_BITS) + height * one / 2;
+
+				pixel_t *destination =
+					rotation->image->picture[line + selection.line_start] +
+					selection.column_start;
+
+				for (column = tile_column; column < last_column; column++) {
+					destination[column] =
+						sample_pixel(rotation, source_x, source_y);
+
+					// Step to the next pixel of the line
+					source_x += rotation->cosine;
+					source_y -= rotation->sine;
+				}
+			}
+		}
+	}
+}
+
+// Function to rotate the selected area (or the whole image) by any angle
+//
+// The area is rotated clockwise around its center and keeps its dimensions,
+// so the corners that are left uncovered are filled with black
+//
+// Parameters:
+//	 - image: Pointer to the image structure to be rotated
+//	 - selection: The selected area to be rotated
+//	 - angle: The angle (in degrees) by which the area should be rotated
+//	 - bilinear: Whether to use bilinear interpolation instead of the nearest
+//				 pixel
+void rotate_arbitrary(image_t *image, area_t selection, double angle,
+					  bool bilinear)
+{
+	unsigned short height = selection.line_end - selection.line_start;
+	unsigned short width = selection.column_end - selection.column_start;
+
+	// Decode the lines of the selection
+	if (!image_require(image, selection)) {
+		fprintf(output(), "Not enough memory\n");
+		return;
+	}
+
+	// Create a copy of the selected area
+	pixel_t **copy = create_picture(height, width);
+	if (!copy)
+		return;
+
+	unsigned short line;
+	for (line = 0; line < height; line++)
+		memcpy(copy[line],
+			   image->picture[line + selection.line_start] +
+			   selection.column_start,
+			   width * sizeof(pixel_t));
+
+	// Convert the angle to radians and then to fixed point
+	double radians = angle * acos(-1.) / 180.;
+	rotation_t rotation;
+	rotation.image = image;
+	rotation.selection = selection;
+	rotation.source = copy;
+	rotation.cosine = llround(cos(radians) * (1LL << FIXED_POINT_BITS));
+	rotation.sine = llround(sin(radians) * (1LL << FIXED_POINT_BITS));
+	rotation.bilinear = bilinear;
+
+	// Record the selected area before it is modified
+	if (!image_changing(image, selection)) {
+		fprintf(output(), "Not enough memory\n");
+		free_picture(&copy);
+		return;
+	}
+
+	// Compute the rotated lines in parallel
+	parallel_lines(rotate_lines, &rotation, height);
+
+	// Free memory used for the copy
+	free_picture(&copy);
+
+	// Update the data derived from the image
+	image_modified(image, selection);
+
+	// Print a message indicating the completion of rotation
+	fprintf(output(), "Rotated %g\n", angle);
+}
+
+// Function to handle the "ROTATE" command, rotating the image or a selected
+// area
+//
+// Parameters:
+//   - image: Pointer to the image structure to be modified
+//   - selection: Pointer to the area selection structure specifying the region
+//				  to rotate (updated when the dimensions of the image change)
+//   - parameter_1: Angle parameter of the ROTATE command
+//   - parameter_2: Resampling used for arbitrary angles ("BILINEAR", the
+//					default, or "NEAREST")
+void rotate_command(image_t *image, area_t *selection,
+					char parameter_1[MAX_INPUT_LINE_LENGTH],
+					char parameter_2[MAX_PARAMETER_LENGTH + 1])
+{
+	// Convert the angle parameter to a number of degrees
+	char *end;
+	double angle = strtod(parameter_1, &end);
+
+	// Check if the angle parameter is missing or not a number, or the
+	// resampling is unknown
+	if (!strlen(parameter_1) || *end || (strlen(parameter_2) &&
+										 strcmp(parameter_2, "BILINEAR") &&
+										 strcmp(parameter_2, "NEAREST"))) {
+		fprintf(output(), "Invalid command\n");
+		return;
+	}
+
+	// Check if an image is loaded
+	if (!image->picture) {
+		fprintf(output(), "No image loaded\n");
+		return;
+	}
+
+	// Check if the rotation angle is supported (NAN and infinite angles
+	// are not)
+	if (!isfinite(angle) || angle < -360 || angle > 360) {
+		fprintf(output(), "Unsupported rotation angle\n");
+		return;
+	}
+
+	// Angles that are not multiples of 90 degrees need resampling
+	if (angle != 90 * (signed short)(angle / 90)) {
+		rotate_arbitrary(image, *selection, angle,
+						 strcmp(parameter_2, "NEAREST"));
+		return;
+	}
+
+	// Check if the rotation is applied to the entire image or a selected area
+	if (selection->all) {
+		// Rotate the entire image
+		rotate_all(image, angle);
+
+		// Keep the selection covering the image, whose dimensions may have
+		// been swapped
+		selection->line_end = image->height;
+		selection->column_end = image->width;
+	} else {
+		// Check if the selected area is square
+		if (selection->line_end - selection->line_start !=
+		    selection->column_end - selection->column_start) {
+			fprintf(output(), "The selection must be square\n");
+			return;
+		}
+
+		// Rotate the selected area
+		rotate_area(image, *selection, angle);
+	}
+}
+
+// Function to crop the image based on the specified selection area
+//
+// Parameters:
+//	 - image: Pointer to the image structure to be cropped
+//	 - selection: Pointer to the area selection structure specifying the
+//                crop region
+void crop(image_t *image, area_t *selection)
+{
+	// Decode the lines of the selection
+	if (!image_require(image, *selection)) {
+		fprintf(output(), "Not enough memory\n");
+		return;
+	}
+
+	// Create a copy of the selected area
+	pixel_t **copy =
+	    create_picture((selection->line_end - selection->line_start),
+					   (selection->column_end - selection->column_start));
+
+	// Check if memory allocation for the copy was successful
+	if (!copy)
+		return;
+
+	short line, column;
+	// Copy pixels from the selected area to the copy
+	for (line = 0; line < selection->line_end - selection->line_start;
+	     line++) {
+		for (column = 0;
+		     column < selection->column_end - selection->column_start;
+		     column++) {
+			copy[line][column] =
+			    image->picture[line + selection->line_start]
+					  [column + selection->column_start];
+		}
+	}
+
+	// Keep the original image in the history (or free it)
+	retire_picture(image);
+
+	// Update the image structure with the cropped image
+	image->picture = copy;
+	image->height = selection->line_end - selection->line_start;
+	image->width = selection->column_end - selection->column_start;
+
+	// Update the selection area to cover the entire cropped image
+	selection->all = true;
+	selection->line_start = 0;
+	selection->line_end = image->height;
+	selection->column_start = 0;
+	selection->column_end = image->width;
+
+	// Update the data derived from the image
+	image_modified(image, *selection);
+
+	// Print a message indicating the completion of cropping
+	fprintf(output(), "Image cropped\n");
+}
+
+// Function to compute the weights used to resample an axis of the image
+//
+// When the axis shrinks, each output pixel averages the source pixels it
+// covers, weighted by the covered area, counted in integers (in 1/destination
+// of a source pixel, so the weights add up to the number of source pixels
+// whatever the ratio). When it grows, the output pixels are interpolated from
+// the 2 (bilinear) or 4 (bicubic, Catmull-Rom) closest source pixels, clamped
+// to the edges, with weights rounded to fixed point so that they add up to
+// exactly 1
+//
+// Parameters:
+//	 - source: The number of source pixels
+//	 - destination: The number of output pixels
+//	 - bicubic: Whether to use bicubic instead of bilinear interpolation
+//
+// Returns:
+//	 - The resampling, whose arrays are NULL if allocation fails
+resampling_t make_resampling(unsigned short source, unsigned short destination,
+							 bool bicubic)
+{
+	resampling_t resampling;
+	double scale = (double)source / destination;
+
+	// Determine the number of source pixels needed for an output pixel
+	if (source == destination)
+		resampling.taps = 1;
+	else if (source > destination)
+		resampling.taps = (source + destination - 1UL) / destination + 1;
+	else
+		resampling.taps = bicubic ? 4 : 2;
+	resampling.divider = make_divider(source > destination ?
+									  source : 1 << WEIGHT_BITS);
+
+	resampling.indexes = NULL;
+	resampling.weights = NULL;
+	if (destination && resampling.taps <= ULONG_MAX / sizeof(signed int) /
+										  destination) {
+		resampling.indexes = calloc(destination * resampling.taps,
+									sizeof(unsigned short));
+		resampling.weights = calloc(destination * resampling.taps,
+									sizeof(signed int));
+	}
+	if (!resampling.indexes || !resampling.weights) {
+		free(resampling.indexes);
+		free(resampling.weights);
+		resampling.indexes = NULL;
+		resampling.weights = NULL;
+		return resampling;
+	}
+
+	unsigned short output;
+	unsigned long tap;
+	for (output = 0; output < destination; output++) {
+		unsigned short *indexes = resampling.indexes + output * resampling.taps;
+		signed int *weights = resampling.weights + output * resampling.taps;
+		double real_weights[4] = { 1, 0, 0, 0 };
+		signed long first;
+
+		if (source > destination) {
+			// Average the source pixels covered by [start, end), in
+			// 1/destination of a source pixel
+			unsigned long start = (unsigned long)output * source;
+			unsigned long end = start + source;
+			first = start / destination;
+			for (tap = 0; tap < resampling.taps; tap++) {
+				unsigned long left = (first + tap) * destination;
+				unsigned long right = left + destination;
+				if (left < start)
+					left = start;
+				if (right > end)
+					right = end;
+
+				indexes[tap] = first + tap < source ? first + tap : source - 1UL;
+				weights[tap] = right > left ? right - left : 0;
+			}
+		} else {
+			// Interpolate between the closest pixel centers
+			double center = (output + 0.5) * scale - 0.5;
+			first = (signed long)floor(center);
+			double fraction = center - first;
+
+			if (source == destination) {
+				first = output;
+			} else if (!bicubic) {
+				real_weights[0] = 1 - fraction;
+				real_weights[1] = fraction;
+			} else {
+				// Catmull-Rom weights for the pixels first - 1 to first + 2
+				double squared = fraction * fraction;
+				double cubed = squared * fraction;
+				real_weights[0] = (-cubed + 2 * squared - fraction) / 2;
+				real_weights[1] = (3 * cubed - 5 * squared + 2) / 2;
+				real_weights[2] = (-3 * cubed + 4 * squared + fraction) / 2;
+				real_weights[3] = (cubed - squared) / 2;
+				first--;
+			}
+
+			for (tap = 0; tap < resampling.taps; tap++) {
+				signed long index = first + tap;
+				if (index < 0)
+					index = 0;
+				if (index >= source)
+					index = source - 1;
+
+				indexes[tap] = index;
+				weights[tap] =
+					(signed int)lround(real_weights[tap] * (1 << WEIGHT_BITS));
+			}
+
+			// Give the rounding error to the largest weight, so that the
+			// weights add up to exactly 1
+			signed int total = 0;
+			unsigned short largest = 0;
+			for (tap = 0; tap < resampling.taps; tap++) {
+				total += weights[tap];
+				if (weights[tap] > weights[largest])
+					largest = tap;
+			}
+			weights[largest] += (1 << WEIGHT_BITS) - total;
+		}
+	}
+
+	return resampling;
+}
+
+// Function to convert a weighted channel sum to a channel value
+//
+// Parameters:
+//	 - sum: The weighted sum of the channel values
+//	 - divider: Division by the sum of the weights
+//
+// Returns:
+//	 - The rounded value, clamped between 0 and 255
+unsigned short weighted_value(signed int sum, divider_t divider)
+{
+	if (sum <= 0)
+		return 0;
+	if ((unsigned long long)sum >= MAX_VALUE * divider.divisor)
+		return MAX_VALUE;
+
+	return divide_sum(sum, divider);
+}
+
+// Function to resample some lines horizontally (run by each thread)
+//
+// Parameters:
+//	 - data: Pointer to the resize_t structure describing the pass
+//	 - start: First line to be resampled
+//	 - end: Line after the last one to be resampled
+void resize_lines(void *data, unsigned short start, unsigned short end)
+{
+	resize_t *resize = data;
+	unsigned long taps = resize->resampling.taps, tap;
+	unsigned short line, column;
+
+	for (line = start; line < end; line++) {
+		pixel_t *source = resize->source[line] + resize->column_start;
+
+		for (column = 0; column < resize->width; column++) {
+			unsigned short *indexes =
+				resize->resampling.indexes + column * taps;
+			signed int *weights = resize->resampling.weights + column * taps;
+			signed int red = 0, green = 0, blue = 0;
+
+			for (tap = 0; tap < taps; tap++) {
+				red += weights[tap] * source[indexes[tap]].red;
+				green += weights[tap] * source[indexes[tap]].green;
+				blue += weights[tap] * source[indexes[tap]].blue;
+			}
+
+			resize->destination[line][column].red =
+				weighted_value(red, resize->resampling.divider);
+			resize->destination[line][column].green =
+				weighted_value(green, resize->resampling.divider);
+			resize->destination[line][column].blue =
+				weighted_value(blue, resize->resampling.divider);
+		}
+	}
+}
+
+// Function to resample some lines vertically (run by each thread)
+//
+// Each output line combines whole source lines, so the pixels are read in
+// the order they are stored
+//
+// Parameters:
+//	 - data: Pointer to the resize_t structure describing the pass
+//	 - start: First output line to be computed
+//	 - end: Line after the last one to be computed
+void resize_columns(void *data, unsigned short start, unsigned short end)
+{
+	resize_t *resize = data;
+	unsigned long taps = resize->resampling.taps, tap;
+	unsigned short line, column;
+
+	for (line = start; line < end; line++) {
+		unsigned short *indexes = resize->resampling.indexes + line * taps;
+		signed int *weights = resize->resampling.weights + line * taps;
+
+		for (column = 0; column < resize->width; column++) {
+			signed int red = 0, green = 0, blue = 0;
+
+			for (tap = 0; tap < taps; tap++) {
+				pixel_t pixel = resize->source[indexes[tap]][column];
+				red += weights[tap] * pixel.red;
+				green += weights[tap] * pixel.green;
+				blue += weights[tap] * pixel.blue;
+			}
+
+			resize->destination[line][column].red =
+				weighted_value(red, resize->resampling.divider);
+			resize->destination[line][column].green =
+				weighted_value(green, resize->resampling.divider);
+			resize->destination[line][column].blue =
+				weighted_value(blue, resize->resampling.divider);
+		}
+	}
+}
+
+// Function to resize the selected area of the image, which then becomes the
+// whole image
+//
+// The resampling is separable: the lines of the selection are first
+// resampled horizontally, then the resulting lines are combined vertically,
+// each pass being split between threads
+//
+// Parameters:
+//	 - image: Pointer to the image structure to be resized
+//	 - selection: Pointer to the area selection structure specifying the
+//				  region to resize
+//	 - width: The width of the resulting image
+//	 - height: The height of the resulting image
+//	 - bicubic: Whether to use bicubic instead of bilinear interpolation when
+//				enlarging
+void resize(image_t *image, area_t *selection, unsigned short width,
+			unsigned short height, bool bicubic)
+{
+	unsigned short source_height = selection->line_end - selection->line_start;
+	unsigned short source_width =
+		selection->column_end - selection->column_start;
+
+	// Decode the lines of the selection
+	if (!image_require(image, *selection)) {
+		fprintf(output(), "Not enough memory\n");
+		return;
+	}
+
+	// Compute the weights for both axes
+	resampling_t horizontal = make_resampling(source_width, width, bicubic);
+	resampling_t vertical = make_resampling(source_height, height, bicubic);
+
+	// Allocate the horizontally resampled lines and the resulting picture
+	pixel_t **lines = create_picture(source_height, width);
+	pixel_t **new_picture = create_picture(height, width);
+
+	// Check if memory allocation was successful
+	if (!horizontal.indexes || !vertical.indexes || !lines || !new_picture) {
+		free(horizontal.indexes);
+		free(horizontal.weights);
+		free(vertical.indexes);
+		free(vertical.weights);
+		if (lines)
+			free_picture(&lines);
+		if (new_picture)
+			free_picture(&new_picture);
+		fprintf(output(), "Not enough memory\n");
+		return;
+	}
+
+	// Resample the lines of the selection horizontally
+	resize_t pass;
+	pass.source = image->picture + selection->line_start;
+	pass.column_start = selection->column_start;
+	pass.destination = lines;
+	pass.width = width;
+	pass.resampling = horizontal;
+	parallel_lines(resize_lines, &pass, source_height);
+
+	// Resample the resulting lines vertically
+	pass.source = lines;
+	pass.column_start = 0;
+	pass.destination = new_picture;
+	pass.resampling = vertical;
+	parallel_lines(resize_columns, &pass, height);
+
+	free(horizontal.indexes);
+	free(horizontal.weights);
+	free(vertical.indexes);
+	free(vertical.weights);
+	free_picture(&lines);
+
+	// Replace the image with the resized one, keeping the original in the
+	// history
+	retire_picture(image);
+	image->picture = new_picture;
+	image->height = height;
+	image->width = width;
+
+	// Update the selection area to cover the entire resized image
+	selection->all = true;
+	selection->line_start = 0;
+	selection->line_end = image->height;
+	selection->column_start = 0;
+	selection->column_end = image->width;
+
+	// Update the data derived from the image
+	image_modified(image, *selection);
+
+	// Print a message indicating the completion of resizing
+	fprintf(output(), "Resized %hu %hu\n", width, height);
+}
+
+// Function to handle the "RESIZE" command, resizing the selected area
+//
+// Parameters:
+//   - image: Pointer to the image structure to be modified
+//   - selection: Pointer to the area selection structure specifying the
+//				  region to resize
+//   - parameter_1: Width of the resulting image
+//   - parameter_2: Height of the resulting image
+//   - parameter_3: Interpolation used when enlarging ("BILINEAR", the default,
+//					or "BICUBIC")
+void resize_command(image_t *image, area_t *selection,
+					char parameter_1[MAX_INPUT_LINE_LENGTH],
+					char parameter_2[MAX_PARAMETER_LENGTH + 1],
+					char parameter_3[MAX_PARAMETER_LENGTH + 1])
+{
+	// Check if an image is loaded
+	if (!image->picture) {
+		fprintf(output(), "No image loaded\n");
+		return;
+	}
+
+	// Check for invalid parameters (the sizes must be whole numbers)
+	char *width_end, *height_end;
+	long width = strtol(parameter_1, &width_end, 10);
+	long height = strtol(parameter_2, &height_end, 10);
+	if (!strlen(parameter_1) || *width_end || !strlen(parameter_2) ||
+	    *height_end || width < 1 || width > USHRT_MAX || height < 1 ||
+	    height > USHRT_MAX || (strlen(parameter_3) && strcmp(parameter_3, "BILINEAR") &&
+	     strcmp(parameter_3, "BICUBIC"))) {
+		fprintf(output(), "Invalid command\n");
+		return;
+	}
+
+	resize(image, selection, width, height, !strcmp(parameter_3, "BICUBIC"));
+}
+
+// Function to apply an edge filter to the specified area of the image
+//
+// Parameters:
+//	 - image: The image to be filtered
+//	 - area: The area to be filtered, at least one pixel away from the edges
+//		     of the image (see filter_area())
+//
+// Returns:
+//   - A dynamically allocated picture of the size of the area, holding its
+//	   pixels with the edge filter applied
+pixel_t **apply_edge(image_t image, area_t area)
+{
+	unsigned short height = area.line_end - area.line_start;
+	unsigned short width = area.column_end - area.column_start;
+	pixel_t **filtered = create_picture(height, width);
+
+	// Check if memory allocation for the filtered pixels was successful
+	if (!filtered)
+		return NULL;
+
+	unsigned short line, column;
+	for (line = 0; line < height; line++) {
+		// The lines around the pixels, from the column before the area
+		pixel_t *above = image.picture[area.line_start + line - 1] +
+						 area.column_start - 1;
+		pixel_t *middle = image.picture[area.line_start + line] +
+						  area.column_start - 1;
+		pixel_t *below = image.picture[area.line_start + line + 1] +
+						 area.column_start - 1;
+
+		for (column = 0; column < width; column++) {
+			// Apply the edge filter to the pixel
+			filtered[line][column].red =
+				clamp(8 * middle[column + 1].red -
+					  above[column].red - above[column + 1].red -
+					  above[column + 2].red - middle[column].red -
+					  middle[column + 2].red - below[column].red -
+					  below[column + 1].red - below[column + 2].red);
+
+			filtered[line][column].green =
+				clamp(8 * middle[column + 1].green -
+					  above[column].green - above[column + 1].green -
+					  above[column + 2].green - middle[column].green -
+					  middle[column + 2].green - below[column].green -
+					  below[column + 1].green - below[column + 2].green);
+
+			filtered[line][column].blue =
+				clamp(8 * middle[column + 1].blue -
+					  above[column].blue - above[column + 1].blue -
+					  above[column + 2].blue - middle[column].blue -
+					  middle[column + 2].blue - below[column].blue -
+					  below[column + 1].blue - below[column + 2].blue);
+		}
+	}
+
+	// Return the dynamically allocated filtered pixels
+	return filtered;
+}
+
+// Function to apply a sharpening filter to the specified area of the image
+//
+// Parameters:
+//	 - image: The image to be filtered
+//	 - area: The area to be filtered, at least one pixel away from the edges
+//		     of the image (see filter_area())
+//
+// Returns:
+//   - A dynamically allocated picture of the size of the area, holding its
+//	   pixels with the sharpening filter applied
+pixel_t **apply_sharpen(image_t image, area_t area)
+{
+	unsigned short height = area.line_end - area.line_start;
+	unsigned short width = area.column_end - area.column_start;
+	pixel_t **filtered = create_picture(height, width);
+
+	// Check if memory allocation for the filtered pixels was successful
+	if (!filtered)
+		return NULL;
+
+	unsigned short line, column;
+	for (line = 0; line < height; line++) {
+		// The lines around the pixels, from the column before the area
+		pixel_t *above = image.picture[area.line_start + line - 1] +
+						 area.column_start;
+		pixel_t *middle = image.picture[area.line_start + line] +
+						  area.column_start - 1;
+		pixel_t *below = image.picture[area.line_start + line + 1] +
+						 area.column_start;
+
+		for (column = 0; column < width; column++) {
+			// Apply the sharpening filter to the pixel
+			filtered[line][column].red =
+				clamp(5 * middle[column + 1].red - above[column].red -
+					  middle[column].red - middle[column + 2].red -
+					  below[column].red);
+
+			filtered[line][column].green =
+				clamp(5 * middle[column + 1].green - above[column].green -
+					  middle[column].green - middle[column + 2].green -
+					  below[column].green);
+
+			filtered[line][column].blue =
+				clamp(5 * middle[column + 1].blue - above[column].blue -
+					  middle[column].blue - middle[column + 2].blue -
+					  below[column].blue);
+		}
+	}
+
+	// Return the dynamically allocated filtered pixels
+	return filtered;
+}
+
+// Function to filter one line of the image horizontally for the Gaussian
+// blur, using running sums
+//
+// The pixels are weighted with a triangle (two stacked boxes), with
+// (radius + 1 - distance) each, which reproduces the 1 2 1 kernel for a
+// radius of 1. The cost per pixel does not depend on the radius
+//
+// Parameters:
+//	 - image: The image to be filtered
+//	 - line: The line to be filtered
+//	 - column_start: The first column to be computed
+//	 - column_end: The column after the last one to be computed (the columns
+//				   must be at least radius pixels away from the edges)
+//	 - radius: The radius of the filter
+//	 - result: Array to store the sums, one for each column
+void blur_line(image_t image, unsigned short line, unsigned short column_start,
+			   unsigned short column_end, unsigned short radius, sum_t *result)
+{
+	pixel_t *pixels = image.picture[line];
+	sum_t total = { 0 }, left = { 0 }, right = { 0 };
+	signed short offset;
+	unsigned short column;
+
+	// Compute the sums for the first column directly
+	for (offset = -radius; offset <= radius + 1; offset++) {
+		// The pixel to the right of the window is only needed if the window
+		// slides further
+		if (offset == radius + 1 && column_start + 1 == column_end)
+			break;
+
+		pixel_t pixel = pixels[column_start + offset];
+
+		// Weight the pixels with the triangle and keep the two halves of
+		// the window, which are needed to slide it
+		if (offset <= radius)
+			add_pixel(&total, pixel,
+					  radius + 1 - (offset < 0 ? -offset : offset));
+		if (offset <= 0)
+			add_pixel(&left, pixel, 1);
+		else
+			add_pixel(&right, pixel, 1);
+	}
+
+	// Slide the window over the rest of the columns
+	for (column = column_start; column < column_end; column++) {
+		result[column - column_start] = total;
+
+		if (column + 1 == column_end)
+			break;
+
+		// Moving the triangle adds its right half and removes its left half
+		add_sum(&total, right, 1);
+		subtract_sum(&total, left);
+
+		// Slide the two halves, if the window slides further
+		if (column + 2 < column_end) {
+			add_pixel(&left, pixels[column + 1], 1);
+			subtract_pixel(&left, pixels[column - radius]);
+			add_pixel(&right, pixels[column + radius + 2], 1);
+			subtract_pixel(&right, pixels[column + 1]);
+		}
+	}
+}
+
+// Function to add a line of sums to another one, multiplied by a weight
+//
+// Parameters:
+//	 - sums: The sums to be updated
+//	 - other: The sums to be added
+//	 - weight: The weight of the added sums
+//	 - length: The number of sums
+void add_line(sum_t *sums, sum_t *other, unsigned long long weight,
+			  unsigned short length)
+{
+	unsigned short index;
+	for (index = 0; index < length; index++)
+		add_sum(&sums[index], other[index], weight);
+}
+
+// Function to subtract a line of sums from another one
+//
+// Parameters:
+//	 - sums: The sums to be updated
+//	 - other: The sums to be subtracted
+//	 - length: The number of sums
+void subtract_line(sum_t *sums, sum_t *other, unsigned short length)
+{
+	unsigned short index;
+	for (index = 0; index < length; index++)
+		subtract_sum(&sums[index], other[index]);
+}
+
+// Function to determine which pixels of the selection a filter can change
+//
+// The other pixels keep their value, so the filters only go over this area,
+// without checking the edges of the image for each pixel
+//
+// Parameters:
+//	 - image: The image to be filtered
+//	 - selection: The selected area
+//	 - radius: The radius of the filter (1 for the 3x3 kernels)
+//	 - area: Pointer to the area to store the pixels that are inside the
+//			 selection and at least radius pixels away from the edges
+//
+// Returns:
+//	 - false if there is no such pixel, true otherwise
+bool filter_area(image_t image, area_t selection, unsigned short radius,
+				 area_t *area)
+{
+	signed long line_end = image.height - radius;
+	signed long column_end = image.width - radius;
+	if (line_end > selection.line_end)
+		line_end = selection.line_end;
+	if (column_end > selection.column_end)
+		column_end = selection.column_end;
+
+	area->all = false;
+	area->line_start = selection.line_start > radius ?
+					   selection.line_start : radius;
+	area->column_start = selection.column_start > radius ?
+						 selection.column_start : radius;
+
+	if (area->line_start >= line_end || area->column_start >= column_end)
+		return false;
+
+	area->line_end = line_end;
+	area->column_end = column_end;
+	return true;
+}
+
+// Function to find the border mode named by a parameter
+//
+// Parameters:
+//	 - name: The parameter
+//
+// Returns:
+//	 - The border mode (BORDER_KEEP if the parameter names none)
+border_t find_border(char *name)
+{
+	if (!strcmp(name, "CLAMP"))
+		return BORDER_CLAMP;
+	if (!strcmp(name, "MIRROR"))
+		return BORDER_MIRROR;
+	if (!strcmp(name, "WRAP"))
+		return BORDER_WRAP;
+
+	return BORDER_KEEP;
+}
+
+// Function to find the line or column of an image that stands for one that
+// may be outside of it, according to a border mode
+//
+// Parameters:
+//	 - index: The line or column
+//	 - size: The height or width of the image
+//	 - border: The border mode (mirrored without repeating the edge)
+//
+// Returns:
+//	 - The line or column inside the image
+unsigned short border_index(signed long index, unsigned short size,
+							border_t border)
+{
+	if (index >= 0 && index < size)
+		return index;
+
+	if (border == BORDER_WRAP) {
+		index %= size;
+		return index < 0 ? index + size : index;
+	}
+
+	// Mirroring repeats the image back and forth with this period
+	if (border == BORDER_MIRROR && size > 1) {
+		signed long period = 2L * (size - 1);
+		index %= period;
+		if (index < 0)
+			index += period;
+		return index < size ? index : period - index;
+	}
+
+	return index < 0 ? 0 : size - 1;
+}
+
+// Function to copy an area of an image with the radius pixels around it,
+// those outside of the image being taken from inside it according to a
+// border mode, so the filters can go over the whole area without checking
+// the edges of the image
+//
+// Parameters:
+//	 - image: The image
+//	 - area: The area
+//	 - radius: The radius of the filter
+//	 - border: The border mode (not BORDER_KEEP)
+//
+// Returns:
+//	 - A dynamically allocated picture of the area, radius pixels bigger on
+//	   each side, or NULL if it is too big or memory could not be allocated
+pixel_t **pad_area(image_t image, area_t area, unsigned short radius,
+				   border_t border)
+{
+	unsigned long height = area.line_end - area.line_start + 2UL * radius;
+	unsigned long width = area.column_end - area.column_start + 2UL * radius;
+	if (height > USHRT_MAX || width > USHRT_MAX)
+		return NULL;
+
+	pixel_t **padded = create_picture(height, width);
+	unsigned short *columns = malloc(width * sizeof(unsigned short));
+	if (!padded || !columns) {
+		free_picture(&padded);
+		free(columns);
+		return NULL;
+	}
+
+	// The columns of the image inside the padded lines are copied at once,
+	// the others one by one
+	signed long first = (signed long)area.column_start - radius;
+	signed long start = first < 0 ? 0 : first;
+	signed long end = (signed long)area.column_end + radius;
+	if (end > image.width)
+		end = image.width;
+
+	unsigned long line, column;
+	for (column = 0; column < width; column++)
+		columns[column] = border_index(first + (signed long)column,
+									   image.width, border);
+
+	for (line = 0; line < height; line++) {
+		pixel_t *pixels = image.picture[border_index((signed long)
+													 area.line_start -
+													 radius + line,
+													 image.height, border)];
+
+		memcpy(padded[line] + (start - first), pixels + start,
+			   (end - start) * sizeof(pixel_t));
+		for (column = 0; column < (unsigned long)(start - first); column++)
+			padded[line][column] = pixels[columns[column]];
+		for (column = end - first; column < width; column++)
+			padded[line][column] = pixels[columns[column]];
+	}
+
+	free(columns);
+	return padded;
+}
+
+// Function to apply a Gaussian blur of any radius to the specified area of
+// the image
+//
+// The filter is separable, so each line is filtered horizontally by
+// blur_line(), and the results are combined vertically with the same running
+// sums, so the cost per pixel is constant regardless of the radius. Only the
+// lines of the area and the radius lines around it are read
+//
+// Parameters:
+//	 - image: The image to be filtered
+//	 - area: The area to be filtered, at least radius pixels away from the
+//		     edges of the image (see filter_area())
+//	 - radius: The radius of the filter
+//
+// Returns:
+//   - A dynamically allocated picture of the size of the area, holding its
+//	   pixels with the filter applied
+pixel_t **blur_picture(image_t image, area_t area, unsigned short radius)
+{
+	unsigned short line, column, width = area.column_end - area.column_start;
+	pixel_t **blurred = create_picture(area.line_end - area.line_start,
+									   width);
+
+	// Check if memory allocation for the filtered pixels was successful
+	if (!blurred)
+		return NULL;
+
+	// Allocate the running sums, in one block: the window, its two halves
+	// and a line filtered horizontally
+	sum_t *total = allocate_block(4 * width * sizeof(sum_t));
+	if (!total) {
+		free_picture(&blurred);
+		return NULL;
+	}
+
+	sum_t *upper = total + width;
+	sum_t *lower = upper + width;
+	sum_t *filtered = lower + width;
+	memset(total, 0, 3 * width * sizeof(sum_t));
+
+	// Compute the sums for the first line directly
+	signed short offset;
+	for (offset = -radius; offset <= radius + 1; offset++) {
+		// The line below the window is only needed if the window slides
+		// further
+		if (offset == radius + 1 && area.line_start + 1 == area.line_end)
+			break;
+
+		blur_line(image, area.line_start + offset, area.column_start,
+				  area.column_end, radius, filtered);
+
+		if (offset <= radius)
+			add_line(total, filtered,
+					 radius + 1 - (offset < 0 ? -offset : offset), width);
+		if (offset <= 0)
+			add_line(upper, filtered, 1, width);
+		else
+			add_line(lower, filtered, 1, width);
+	}
+
+	// Divide by the sum of the weights
+	divider_t weights = make_divider((unsigned long long)(radius + 1) *
+									 (radius + 1) * (radius + 1) *
+									 (radius + 1));
+
+	// Slide the window over the rest of the lines
+	for (line = area.line_start; line < area.line_end; line++) {
+		pixel_t *pixels = blurred[line - area.line_start];
+		for (column = 0; column < width; column++) {
+			pixels[column].red = divide_sum(total[column].red, weights);
+			pixels[column].green = divide_sum(total[column].green, weights);
+			pixels[column].blue = divide_sum(total[column].blue, weights);
+		}
+
+		if (line + 1 == area.line_end)
+			break;
+
+		// Moving the triangle adds its lower half and removes its upper half
+		add_line(total, lower, 1, width);
+		subtract_line(total, upper, width);
+
+		// Slide the two halves, if the window slides further
+		if (line + 2 < area.line_end) {
+			blur_line(image, line + 1, area.column_start, area.column_end,
+					  radius, filtered);
+			add_line(upper, filtered, 1, width);
+			subtract_line(lower, filtered, width);
+			blur_line(image, line - radius, area.column_start,
+					  area.column_end, radius, filtered);
+			subtract_line(upper, filtered, width);
+			blur_line(image, line + radius + 2, area.column_start,
+					  area.column_end, radius, filtered);
+			add_line(lower, filtered, 1, width);
+		}
+	}
+
+	release_block(total);
+
+	// Return the dynamically allocated filtered pixels
+	return blurred;
+}
+
+// Function to apply a blur filter to the specified area of the image
+//
+// Each pixel is the average of the (2 * radius + 1)^2 pixels around it. The
+// sums of the columns of the window are kept while it slides down, a line
+// entering and a line leaving it, and each line of the area slides the
+// window along these sums, so the cost per pixel does not depend on the
+// radius and only the lines of the area and the radius lines around it are
+// read
+//
+// Parameters:
+//	 - image: The image to be filtered
+//	 - area: The area to be filtered, at least radius pixels away from the
+//		     edges of the image (see filter_area())
+//	 - radius: The radius of the blur (1 for the classic 3x3 kernel)
+//
+// Returns:
+//   - A dynamically allocated picture of the size of the area, holding its
+//	   pixels with the blur filter applied
+pixel_t **apply_blur(image_t image, area_t area, unsigned short radius)
+{
+	unsigned short height = area.line_end - area.line_start;
+	unsigned short width = area.column_end - area.column_start;
+	pixel_t **filtered = create_picture(height, width);
+
+	// Check if memory allocation for the filtered pixels was successful
+	if (!filtered)
+		return NULL;
+
+	// The sums of the columns of the window, from radius columns before the
+	// area to radius columns after it
+	unsigned long span = width + 2UL * radius, column;
+	sum_t *sums = allocate_block(span * sizeof(sum_t));
+	if (!sums) {
+		free_picture(&filtered);
+		return NULL;
+	}
+	memset(sums, 0, span * sizeof(sum_t));
+
+	signed short offset;
+	for (offset = -radius; offset <= radius; offset++) {
+		pixel_t *pixels = image.picture[area.line_start + offset] +
+						  area.column_start - radius;
+		for (column = 0; column < span; column++)
+			add_pixel(&sums[column], pixels[column], 1);
+	}
+
+	divider_t weights = make_divider((2 * radius + 1) * (2 * radius + 1));
+	unsigned short line;
+
+	for (line = 0; line < height; line++) {
+		// Slide the window down a line
+		if (line) {
+			pixel_t *entering = image.picture[area.line_start + line +
+											  radius] +
+								area.column_start - radius;
+			pixel_t *leaving = image.picture[area.line_start + line -
+											 radius - 1] +
+							   area.column_start - radius;
+			for (column = 0; column < span; column++) {
+				add_pixel(&sums[column], entering[column], 1);
+				subtract_pixel(&sums[column], leaving[column]);
+			}
+		}
+
+		// Slide the window along the line
+		sum_t total = { 0 };
+		for (column = 0; column <= 2UL * radius; column++)
+			add_sum(&total, sums[column], 1);
+
+		pixel_t *pixels = filtered[line];
+		for (column = 0; column < width; column++) {
+			pixels[column].red = divide_sum(total.red, weights);
+			pixels[column].green = divide_sum(total.green, weights);
+			pixels[column].blue = divide_sum(total.blue, weights);
+
+			if (column + 1 < width) {
+				add_sum(&total, sums[column + 2 * radius + 1], 1);
+				subtract_sum(&total, sums[column]);
+			}
+		}
+	}
+
+	release_block(sums);
+
+	// Return the dynamically allocated filtered pixels
+	return filtered;
+}
+
+// Function to apply a Gaussian blur filter to the specified area of the image
+//
+// Parameters:
+//	 - image: The image to be filtered
+//	 - area: The area to be filtered, at least radius pixels away from the
+//		     edges of the image (see filter_area())
+//	 - radius: The radius of the blur (1 for the classic 3x3 kernel)
+//
+// Returns:
+//   - A dynamically allocated picture of the size of the area, holding its
+//	   pixels with the Gaussian blur filter applied
+pixel_t **apply_gaussian_blur(image_t image, area_t area,
+							  unsigned short radius)
+{
+	return blur_picture(image, area, radius);
+}
+
+// Function to add the pixels of a line to the histograms of the columns of
+// a rank filter, or remove them
+//
+// Parameters:
+//	 - pixels: The pixels of the line, from the first column of the window
+//	 - span: The number of columns
+//	 - channels: The number of channels (1 for a grayscale image)
+//	 - fine: The histograms of the values of each channel and column
+//	 - coarse: The histograms of the coarse bins of each channel and column
+//	 - change: 1 to add the pixels, -1 to remove them
+void count_line(pixel_t *pixels, unsigned long span, unsigned short channels,
+				unsigned short *fine, unsigned short *coarse,
+				signed short change)
+{
+	unsigned long column, histogram;
+	unsigned short channel, value;
+
+	for (channel = 0; channel < channels; channel++) {
+		for (column = 0; column < span; column++) {
+			value = pixel_channel(pixels[column], channel);
+			histogram = channel * span + column;
+			fine[histogram * (MAX_VALUE + 1) + value] += change;
+			coarse[histogram * COARSE_BINS +
+				   value / ((MAX_VALUE + 1) / COARSE_BINS)] += change;
+		}
+	}
+}
+
+// Function to apply a rank filter to a line of an area, for one channel
+//
+// The histogram of the window is kept in two levels: the coarse bins are
+// updated for each pixel by adding the histogram of the column entering the
+// window and removing the one of the column leaving it, which finds the
+// coarse bin of the value; only the fine bins of that coarse bin are then
+// brought up to date, from the columns that moved since they last were, so
+// the cost per pixel does not depend on the radius
+//
+// Parameters:
+//	 - ranking: Pointer to the ranking_t structure describing the filter
+//	 - fine: The histograms of the values of the columns of the channel
+//	 - coarse: The histograms of the coarse bins of the columns of the channel
+//	 - pixels: The filtered pixels of the line
+//	 - channel: The channel (0 for red, 1 for green, 2 for blue)
+void rank_line(ranking_t *ranking, unsigned short *fine,
+			   unsigned short *coarse, pixel_t *pixels, unsigned short channel)
+{
+	unsigned short width = ranking->area.column_end -
+						   ranking->area.column_start;
+	unsigned long size = 2UL * ranking->radius + 1;
+	unsigned int window_fine[MAX_VALUE + 1], window_coarse[COARSE_BINS];
+	signed long updated[COARSE_BINS];
+	unsigned long column, count, moved;
+	unsigned short bin, value, bins = (MAX_VALUE + 1) / COARSE_BINS;
+
+	// The coarse bins of the window of the first pixel, whose fine bins are
+	// all out of date
+	memset(window_coarse, 0, sizeof(window_coarse));
+	for (column = 0; column < size; column++)
+		for (bin = 0; bin < COARSE_BINS; bin++)
+			window_coarse[bin] += coarse[column * COARSE_BINS + bin];
+	for (bin = 0; bin < COARSE_BINS; bin++)
+		updated[bin] = -1;
+
+	for (column = 0; column < width; column++) {
+		// Slide the window, its columns being column to column + size - 1
+		if (column) {
+			unsigned short *entering = coarse + (column + size - 1) *
+									   COARSE_BINS;
+			unsigned short *leaving = coarse + (column - 1) * COARSE_BINS;
+			for (bin = 0; bin < COARSE_BINS; bin++)
+				window_coarse[bin] += entering[bin] - leaving[bin];
+		}
+
+		// Find the coarse bin holding the value of the rank
+		count = 0;
+		for (bin = 0; count + window_coarse[bin] <= ranking->rank; bin++)
+			count += window_coarse[bin];
+
+		// Bring its fine bins up to date, from scratch if most of the
+		// columns moved
+		unsigned int *window = window_fine + bin * bins;
+		moved = column - updated[bin];
+		if (updated[bin] < 0 || 2 * moved >= size) {
+			memset(window, 0, bins * sizeof(unsigned int));
+			for (moved = column; moved < column + size; moved++)
+				for (value = 0; value < bins; value++)
+					window[value] += fine[moved * (MAX_VALUE + 1) +
+										  bin * bins + value];
+		} else {
+			for (moved = updated[bin] + 1; moved <= column; moved++) {
+				unsigned short *entering = fine + (moved + size - 1) *
+										   (MAX_VALUE + 1) + bin * bins;
+				unsigned short *leaving = fine + (moved - 1) *
+										  (MAX_VALUE + 1) + bin * bins;
+				for (value = 0; value < bins; value++)
+					window[value] += entering[value] - leaving[value];
+			}
+		}
+		updated[bin] = column;
+
+		// Find the value of the rank among them
+		for (value = 0; count + window[value] <= ranking->rank; value++)
+			count += window[value];
+		value += bin * bins;
+
+		if (channel == 0) {
+			pixels[column].red = value;
+			pixels[column].green = value;
+			pixels[column].blue = value;
+		} else if (channel == 1) {
+			pixels[column].green = value;
+		} else {
+			pixels[column].blue = value;
+		}
+	}
+}
+
+// Function to apply a rank filter to some lines of an area (run by each
+// thread)
+//
+// Each thread keeps the histograms of the columns of its window, a line
+// entering them and a line leaving them as it moves down
+//
+// Parameters:
+//	 - data: Pointer to the ranking_t structure describing the filter
+//	 - start: First line to be filtered, relative to the area
+//	 - end: Line after the last one to be filtered, relative to the area
+void rank_lines(void *data, unsigned short start, unsigned short end)
+{
+	ranking_t *ranking = data;
+	area_t area = ranking->area;
+	unsigned short radius = ranking->radius, line, channel;
+	unsigned short channels = ranking->image.color ? 3 : 1;
+	unsigned long span = area.column_end - area.column_start + 2UL * radius;
+	if (start == end)
+		return;
+
+	// The histograms of the columns, for each channel
+	unsigned short *fine = allocate_block(channels * span * (MAX_VALUE + 1) *
+										  sizeof(unsigned short));
+	unsigned short *coarse = allocate_block(channels * span * COARSE_BINS *
+											sizeof(unsigned short));
+	if (!fine || !coarse) {
+		release_block(fine);
+		release_block(coarse);
+		pthread_mutex_lock(&ranking->lock);
+		ranking->failed = true;
+		pthread_mutex_unlock(&ranking->lock);
+		return;
+	}
+	memset(fine, 0, channels * span * (MAX_VALUE + 1) *
+		   sizeof(unsigned short));
+	memset(coarse, 0, channels * span * COARSE_BINS * sizeof(unsigned short));
+
+	// The lines of the window of the first line, from radius columns before
+	// the area
+	pixel_t **picture = ranking->image.picture;
+	unsigned long first = area.column_start - radius;
+	signed long offset;
+	for (offset = -radius; offset <= radius; offset++)
+		count_line(picture[area.line_start + start + offset] + first, span,
+				   channels, fine, coarse, 1);
+
+	for (line = start; line < end; line++) {
+		// Slide the window down a line
+		if (line != start) {
+			count_line(picture[area.line_start + line + radius] + first,
+					   span, channels, fine, coarse, 1);
+			count_line(picture[area.line_start + line - radius - 1] + first,
+					   span, channels, fine, coarse, -1);
+		}
+
+		for (channel = 0; channel < channels; channel++)
+			rank_line(ranking, fine + channel * span * (MAX_VALUE + 1),
+					  coarse + channel * span * COARSE_BINS,
+					  ranking->filtered[line], channel);
+	}
+
+	release_block(fine);
+	release_block(coarse);
+}
+
+// Function to apply a rank filter to the specified area of the image: each
+// pixel gets the value of the given rank among the sorted values of the
+// (2 * radius + 1)^2 pixels around it, for each channel (the median for
+// the middle rank)
+//
+// Parameters:
+//	 - image: The image to be filtered
+//	 - area: The area to be filtered, at least radius pixels away from the
+//		     edges of the image (see filter_area())
+//	 - radius: The radius of the filter
+//	 - percentile: The rank, as a percentage of the values of the window
+//				   (0 for the minimum, 50 for the median, 100 for the
+//				   maximum)
+//
+// Returns:
+//   - A dynamically allocated picture of the size of the area, holding its
+//	   pixels with the rank filter applied
+pixel_t **apply_rank(image_t image, area_t area, unsigned short radius,
+					 unsigned short percentile)
+{
+	ranking_t ranking;
+	unsigned long size = 2UL * radius + 1;
+
+	ranking.image = image;
+	ranking.area = area;
+	ranking.radius = radius;
+	ranking.rank = (size * size - 1) * percentile / 100;
+	ranking.failed = false;
+	ranking.filtered = create_picture(area.line_end - area.line_start,
+									  area.column_end - area.column_start);
+	if (!ranking.filtered)
+		return NULL;
+
+	pthread_mutex_init(&ranking.lock, NULL);
+	parallel_lines(rank_lines, &ranking, area.line_end - area.line_start);
+	pthread_mutex_destroy(&ranking.lock);
+
+	if (ranking.failed)
+		free_picture(&ranking.filtered);
+
+	return ranking.filtered;
+}
+
+// Function to apply a specified filter to the specified area of the image
+//
+// Parameters:
+//   - image: Pointer to the image structure to be modified
+//   - selection: Area selection structure specifying the region to apply the
+//				  filter
+//   - parameter_1: String specifying the filter to apply
+//   - parameter_2: Radius of the filter (only for BLUR, GAUSSIAN_BLUR and
+//					MEDIAN), or the percentile of PERCENTILE
+//   - parameter_3: Radius of PERCENTILE
+//   - border: How the pixels near the edges of the image are filtered
+void apply_command(image_t *image, area_t selection,
+				   char parameter_1[MAX_INPUT_LINE_LENGTH],
+				   char parameter_2[MAX_PARAMETER_LENGTH + 1],
+				   char parameter_3[MAX_PARAMETER_LENGTH + 1],
+				   border_t border)
+{
+	// Check if an image is loaded
+	if (!image->picture) {
+		fprintf(output(), "No image loaded\n");
+		return;
+	}
+
+	// Determine whether the filter ranks the values of the window (which
+	// works for grayscale images too) and whether it accepts a radius
+	bool percentile = !strcmp(parameter_1, "PERCENTILE");
+	bool rank = percentile || !strcmp(parameter_1, "MEDIAN");
+	bool sized = rank || !strcmp(parameter_1, "BLUR") ||
+				 !strcmp(parameter_1, "GAUSSIAN_BLUR");
+
+	// Check for invalid parameters
+	if (!strlen(parameter_1) || (strlen(parameter_2) && !sized) ||
+	    (percentile && !strlen(parameter_2))) {
+		fprintf(output(), "Invalid command\n");
+		return;
+	}
+
+	// Check if the image is a grayscale image
+	if (!image->color && !rank) {
+		fprintf(output(), "Easy, Charlie Chaplin\n");
+		return;
+	}
+
+	// Read the radius of the filters, 1 (the 3x3 kernel) by default
+	char *size = percentile ? parameter_3 : parameter_2;
+	signed long radius = 1;
+	if (strlen(size)) {
+		radius = atoi(size);
+		if (radius < 1 || radius > MAX_BLUR_RADIUS) {
+			fprintf(output(), "APPLY parameter invalid\n");
+			return;
+		}
+	}
+
+	// Read the percentile, 50 (the median) by default
+	signed long percent = 50;
+	if (percentile) {
+		percent = atoi(parameter_2);
+		if (strspn(parameter_2, "0123456789") != strlen(parameter_2) ||
+		    percent > 100) {
+			fprintf(output(), "APPLY parameter invalid\n");
+			return;
+		}
+	}
+
+	// Print an error message if the input parameter is not valid
+	if (!sized && strcmp(parameter_1, "EDGE") &&
+	    strcmp(parameter_1, "SHARPEN")) {
+		fprintf(output(), "APPLY parameter invalid\n");
+		return;
+	}
+
+	// Without a border mode, only the pixels of the selection far enough
+	// from the edges of the image are filtered, the others keep their value.
+	// Otherwise the whole selection is, from a padded copy of it
+	image_t source = *image;
+	pixel_t **padded = NULL;
+	area_t area, window;
+	bool filter;
+
+	if (border == BORDER_KEEP) {
+		filter = filter_area(*image, selection, radius, &area);
+		window = area;
+	} else {
+		area = selection;
+		padded = pad_area(*image, area, radius, border);
+		if (!padded)
+			return;
+
+		source.picture = padded;
+		source.height = area.line_end - area.line_start + 2 * radius;
+		source.width = area.column_end - area.column_start + 2 * radius;
+		window.all = false;
+		window.line_start = radius;
+		window.column_start = radius;
+		window.line_end = radius + area.line_end - area.line_start;
+		window.column_end = radius + area.column_end - area.column_start;
+		filter = true;
+	}
+
+	// Declare a variable to store the filtered pixels of the area
+	pixel_t **filtered = NULL;
+
+	// Compare the input parameter with different filter options
+	if (filter && !strcmp(parameter_1, "EDGE")) {
+		// Apply the edge filter
+		filtered = apply_edge(source, window);
+	} else if (filter && !strcmp(parameter_1, "SHARPEN")) {
+		// Apply the sharpen filter
+		filtered = apply_sharpen(source, window);
+	} else if (filter && !strcmp(parameter_1, "BLUR")) {
+		// Apply the blur filter
+		filtered = apply_blur(source, window, radius);
+	} else if (filter && rank) {
+		// Apply the median or percentile filter
+		filtered = apply_rank(source, window, radius, percent);
+	} else if (filter) {
+		// Apply the Gaussian blur filter
+		filtered = apply_gaussian_blur(source, window, radius);
+	}
+
+	free_picture(&padded);
+
+	// Check if the filter application was successful
+	if (filter && !filtered)
+		return;
+
+	// Record the selected area before it is modified
+	if (!image_changing(image, selection)) {
+		fprintf(output(), "Not enough memory\n");
+		free_picture(&filtered);
+		return;
+	}
+
+	// Copy the filtered pixels over the area
+	unsigned short line;
+	for (line = 0; filter && line < area.line_end - area.line_start; line++)
+		memcpy(image->picture[area.line_start + line] + area.column_start,
+			   filtered[line],
+			   (area.column_end - area.column_start) * sizeof(pixel_t));
+	free_picture(&filtered);
+
+	// Update the data derived from the image
+	image_modified(image, selection);
+
+	// Print a success message
+	fprintf(output(), "APPLY %s done\n", parameter_1);
+}
+
+// Function to take the maximum of two rows of values, value by value
+//
+// The rows do not overlap the result (restrict), and the values are taken
+// in blocks of MAX_BLOCK_VALUES, so each block is one vector instruction
+// without checking the rows at run time or a loop for the values left
+//
+// Parameters:
+//	 - result: The maximums (count values)
+//	 - first: The first row (count values)
+//	 - second: The second row (count values)
+//	 - count: The number of values
+void max_values(unsigned char *restrict result,
+				const unsigned char *restrict first,
+				const unsigned char *restrict second, unsigned long count)
+{
+	unsigned long index = 0;
+	unsigned short lane;
+
+	for (; index + MAX_BLOCK_VALUES <= count; index += MAX_BLOCK_VALUES)
+		for (lane = 0; lane < MAX_BLOCK_VALUES; lane++)
+			result[index + lane] = first[index + lane] > second[index + lane] ?
+								   first[index + lane] : second[index + lane];
+
+	for (; index < count; index++)
+		result[index] = first[index] > second[index] ?
+						first[index] : second[index];
+}
+
+// Function to replace each value of a line with the maximum of the size
+// values around it, with the van Herk/Gil-Werman algorithm: the line is cut
+// into blocks of size values, and the maximum of the values of a block up to
+// each one (prefix) and from each one (suffix) gives the maximum of any
+// window with one comparison, whatever its size
+//
+// Parameters:
+//	 - values: The values of the line (replaced)
+//	 - length: The number of values
+//	 - size: The number of values of each window
+//	 - before: The number of values of a window before its value (the values
+//			   outside of the line count as 0)
+//	 - padded: Buffer of length + size - 1 values
+//	 - prefix: Buffer of length + size - 1 values
+//	 - suffix: Buffer of length + size - 1 values
+void dilate_line(unsigned char *values, unsigned long length,
+				 unsigned short size, unsigned short before,
+				 unsigned char *padded, unsigned char *prefix,
+				 unsigned char *suffix)
+{
+	unsigned long count = length + size - 1, index;
+
+	memset(padded, 0, count);
+	memcpy(padded + before, values, length);
+
+	for (index = 0; index < count; index++)
+		prefix[index] = index % size && prefix[index - 1] > padded[index] ?
+						prefix[index - 1] : padded[index];
+	for (index = count; index-- > 0;)
+		suffix[index] = (index + 1) % size && index + 1 < count &&
+						suffix[index + 1] > padded[index] ?
+						suffix[index + 1] : padded[index];
+
+	max_values(values, suffix, prefix + size - 1, length);
+}
+
+// Function to replace each value of a plane with the maximum of the size
+// values around it in its column, with the van Herk/Gil-Werman algorithm
+// (see dilate_line()), whole lines at a time
+//
+// Parameters:
+//	 - plane: The values of the plane, line after line (replaced)
+//	 - lines: The number of lines
+//	 - columns: The number of columns
+//	 - size: The number of values of each window
+//	 - before: The number of values of a window above its value (the values
+//			   outside of the plane count as 0)
+//	 - zero: A line of columns values of 0
+//	 - prefix: Buffer of (lines + size - 1) * columns values
+//	 - suffix: Buffer of (lines + size - 1) * columns values
+void dilate_columns(unsigned char *plane, unsigned long lines,
+					unsigned long columns, unsigned short size,
+					unsigned short before, unsigned char *zero,
+					unsigned char *prefix, unsigned char *suffix)
+{
+	unsigned long count = lines + size - 1, line;
+
+	for (line = 0; line < count; line++) {
+		unsigned char *values = line >= before && line < before + lines ?
+								plane + (line - before) * columns : zero;
+		unsigned char *result = prefix + line * columns;
+		unsigned char *previous = result - columns;
+
+		if (!(line % size))
+			memcpy(result, values, columns);
+		else
+			max_values(result, previous, values, columns);
+	}
+
+	for (line = count; line-- > 0;) {
+		unsigned char *values = line >= before && line < before + lines ?
+								plane + (line - before) * columns : zero;
+		unsigned char *result = suffix + line * columns;
+		unsigned char *next = result + columns;
+
+		if (!((line + 1) % size) || line + 1 == count)
+			memcpy(result, values, columns);
+		else
+			max_values(result, next, values, columns);
+	}
+
+	for (line = 0; line < lines; line++)
+		max_values(plane + line * columns, suffix + line * columns,
+				   prefix + (line + size - 1) * columns, columns);
+}
+
+// Function to dilate or erode a plane with a rectangular structuring
+// element, the lines being dilated first and then the columns
+//
+// An erosion is the dilation of the inverted values, inverted back, with
+// the element reflected: the values outside of the plane are ignored either
+// way
+//
+// Parameters:
+//	 - plane: The values of the plane, line after line (replaced)
+//	 - lines: The number of lines
+//	 - columns: The number of columns
+//	 - width: The width of the element
+//	 - height: The height of the element
+//	 - erode: Whether to erode instead of dilating
+//	 - buffer: Buffer of columns + width - 1 plus
+//			   (2 * (lines + height - 1) + 1) * columns values, at least
+//
+// Returns:
+//	 - The plane
+void dilate_plane(unsigned char *plane, unsigned long lines,
+				  unsigned long columns, unsigned short width,
+				  unsigned short height, bool erode, unsigned char *buffer)
+{
+	unsigned long size = lines * columns, index, line;
+
+	// The element is centered, the extra value of an even size being after
+	// the center for an erosion and before it for a dilation
+	unsigned short left = erode ? (width - 1) / 2 : width / 2;
+	unsigned short above = erode ? (height - 1) / 2 : height / 2;
+
+	if (erode)
+		for (index = 0; index < size; index++)
+			plane[index] = MAX_VALUE - plane[index];
+
+	unsigned long length = columns + width - 1;
+	for (line = 0; line < lines; line++)
+		dilate_line(plane + line * columns, columns, width, left, buffer,
+					buffer + length, buffer + 2 * length);
+
+	unsigned long count = (lines + height - 1) * columns;
+	memset(buffer, 0, columns);
+	dilate_columns(plane, lines, columns, height, above, buffer,
+				   buffer + columns, buffer + columns + count);
+
+	if (erode)
+		for (index = 0; index < size; index++)
+			plane[index] = MAX_VALUE - plane[index];
+}
+
+// Function to handle the "MORPH" command, applying a morphological operation
+// with a rectangular structuring element to the selection
+//
+// Each channel of the selection, with the pixels around it that the
+// operation reads, is copied to a plane of bytes, which is eroded and/or
+// dilated at a constant cost per pixel whatever the size of the element
+// (see dilate_plane()); the pixels outside of the image are ignored
+//
+// Parameters:
+//   - image: Pointer to the image structure to be modified
+//   - selection: The selected area
+//   - parameter_1: The operation (ERODE, DILATE, OPEN or CLOSE)
+//   - parameter_2: The width of the element
+//   - parameter_3: The height of the element (the width by default)
+void morph_command(image_t *image, area_t selection,
+				   char parameter_1[MAX_PARAMETER_LENGTH + 1],
+				   char parameter_2[MAX_PARAMETER_LENGTH + 1],
+				   char parameter_3[MAX_PARAMETER_LENGTH + 1])
+{
+	// Check if an image is loaded
+	if (!image->picture) {
+		fprintf(output(), "No image loaded\n");
+		return;
+	}
+
+	// Check for invalid parameters
+	if (!strlen(parameter_1) || !strlen(parameter_2)) {
+		fprintf(output(), "Invalid command\n");
+		return;
+	}
+
+	// The erosions and dilations of each operation, in order
+	bool steps[2];
+	unsigned short count = 1, step;
+	if (!strcmp(parameter_1, "ERODE") || !strcmp(parameter_1, "OPEN")) {
+		steps[0] = true;
+		steps[1] = false;
+		count = strcmp(parameter_1, "ERODE") ? 2 : 1;
+	} else if (!strcmp(parameter_1, "DILATE") ||
+			   !strcmp(parameter_1, "CLOSE")) {
+		steps[0] = false;
+		steps[1] = true;
+		count = strcmp(parameter_1, "DILATE") ? 2 : 1;
+	} else {
+		fprintf(output(), "MORPH parameter invalid\n");
+		return;
+	}
+
+	signed long width = atoi(parameter_2);
+	signed long height = strlen(parameter_3) ? atoi(parameter_3) : width;
+	if (width < 1 || width > MAX_ELEMENT_SIZE || height < 1 ||
+	    height > MAX_ELEMENT_SIZE) {
+		fprintf(output(), "MORPH parameter invalid\n");
+		return;
+	}
+
+	// The pixels read by the operation, within the image
+	area_t area;
+	signed long start = selection.line_start - (height - 1) * count;
+	signed long end = selection.line_end + (height - 1) * count;
+	area.line_start = start < 0 ? 0 : start;
+	area.line_end = end > image->height ? image->height : end;
+	start = selection.column_start - (width - 1) * count;
+	end = selection.column_end + (width - 1) * count;
+	area.column_start = start < 0 ? 0 : start;
+	area.column_end = end > image->width ? image->width : end;
+
+	unsigned long lines = area.line_end - area.line_start;
+	unsigned long columns = area.column_end - area.column_start;
+	unsigned char *plane = allocate_block(lines * columns);
+	unsigned char *buffer =
+		allocate_block(columns + width - 1 + 2 * (columns + width - 1) +
+					   (2 * (lines + height - 1) + 1) * columns);
+	if (!plane || !buffer) {
+		release_block(plane);
+		release_block(buffer);
+		return;
+	}
+
+	// Record the selected area before it is modified
+	if (!image_changing(image, selection)) {
+		fprintf(output(), "Not enough memory\n");
+		release_block(plane);
+		release_block(buffer);
+		return;
+	}
+
+	unsigned short channel, channels = image->color ? 3 : 1;
+	unsigned long line, column;
+	for (channel = 0; channel < channels; channel++) {
+		for (line = 0; line < lines; line++) {
+			pixel_t *pixels = image->picture[area.line_start + line] +
+							  area.column_start;
+			unsigned char *values = plane + line * columns;
+			for (column = 0; column < columns; column++)
+				values[column] = pixel_channel(pixels[column], channel);
+		}
+
+		for (step = 0; step < count; step++)
+			dilate_plane(plane, lines, columns, width, height, steps[step],
+						 buffer);
+
+		// Only the selection changes
+		for (line = selection.line_start; line < selection.line_end;
+			 line++) {
+			pixel_t *pixels = image->picture[line];
+			unsigned char *values = plane + (line - area.line_start) *
+									columns - area.column_start;
+			for (column = selection.column_start;
+				 column < selection.column_end; column++) {
+				if (channel == 0) {
+					pixels[column].red = values[column];
+					if (!image->color) {
+						pixels[column].green = values[column];
+						pixels[column].blue = values[column];
+					}
+				} else if (channel == 1) {
+					pixels[column].green = values[column];
+				} else {
+					pixels[column].blue = values[column];
+				}
+			}
+		}
+	}
+
+	release_block(plane);
+	release_block(buffer);
+
+	// Update the data derived from the image
+	image_modified(image, selection);
+
+	// Print a success message
+	fprintf(output(), "MORPH %s done\n", parameter_1);
+}
+
+// Function to format a pixel value as fprintf's "%3hd " would
+//
+// Parameters:
+//	 - text: Buffer to store the 4 characters
+//	 - value: The value (at most 999)
+void format_value(char *text, unsigned short value)
+{
+	text[0] = value >= 100 ? '0' + value / 100 : ' ';
+	text[1] = value >= 10 ? '0' + value / 10 % 10 : ' ';
+	text[2] = '0' + value % 10;
+	text[3] = ' ';
+}
+
+// Function to format some lines of an image in ASCII format
+//
+// Parameters:
+//	 - image: The image
+//	 - start: First line to be formatted
+//	 - end: Line after the last one to be formatted
+//	 - text: Buffer to store the lines
+//
+// Returns:
+//	 - The end of the lines in the buffer
+char *format_lines(image_t image, unsigned short start, unsigned short end,
+				   char *text)
+{
+	unsigned short line, column;
+
+	for (line = start; line < end; line++) {
+		pixel_t *pixels = image.picture[line];
+		for (column = 0; column < image.width; column++) {
+			format_value(text, pixels[column].red);
+			text += 4;
+			if (image.color) {
+				format_value(text, pixels[column].green);
+				format_value(text + 4, pixels[column].blue);
+				text += 8;
+			}
+		}
+		*text++ = '\n';
+	}
+
+	return text;
+}
+
+// Function to write some lines of an image in ASCII format (run by each
+// thread)
+//
+// Every value takes 4 characters, so each line starts at a known offset: the
+// lines are formatted into a buffer, a block at a time, and written there.
+// When the file has no offsets, they are formatted at their place in the
+// buffer of the whole pixels instead
+//
+// Parameters:
+//	 - data: Pointer to the encoding_t structure describing the file
+//	 - start: First line to be written
+//	 - end: Line after the last one to be written
+void encode_lines(void *data, unsigned short start, unsigned short end)
+{
+	encoding_t *encoding = data;
+	if (encoding->buffer) {
+		format_lines(encoding->image, start, end, encoding->buffer +
+					 (size_t)start * encoding->line_length);
+		return;
+	}
+
+	size_t block = ENCODE_BUFFER_SIZE / encoding->line_length;
+	if (!block)
+		block = 1;
+	if (block > (size_t)(end - start))
+		block = end - start;
+
+	char *buffer = allocate_block(block * encoding->line_length);
+	bool failed = !buffer;
+
+	while (!failed && start < end) {
+		unsigned short last = start + block < end ? start + block : end;
+		char *text = format_lines(encoding->image, start, last, buffer);
+
+		failed = pwrite(encoding->file, buffer, text - buffer,
+						encoding->start +
+						(off_t)start * encoding->line_length) !=
+				 text - buffer;
+		start = last;
+	}
+
+	release_block(buffer);
+
+	if (failed) {
+		pthread_mutex_lock(&encoding->lock);
+		encoding->failed = true;
+		pthread_mutex_unlock(&encoding->lock);
+	}
+}
+
+// Function to write the pixels of an image to a file in ASCII format, after
+// its header
+//
+// The pixels of a file without offsets (a pipe to a compressor) are
+// formatted in parallel in a single buffer, then written in order
+//
+// Parameters:
+//	 - file: Pointer to the FILE structure representing the open file
+//	 - image: The image to be written
+//
+// Returns:
+//	 - true if the pixels were written, false otherwise
+bool encode_image(FILE *file, image_t image)
+{
+	encoding_t encoding;
+
+	// The lines are written after the header, which is written out first
+	if (fflush(file))
+		return false;
+
+	encoding.image = image;
+	encoding.file = fileno(file);
+	encoding.start = ftello(file);
+	encoding.line_length = image.width * (image.color ? 12 : 4) + 1;
+	encoding.buffer = NULL;
+	encoding.failed = false;
+
+	size_t length = image.height * encoding.line_length;
+	if (encoding.start < 0) {
+		encoding.buffer = allocate_block(length + 1);
+		if (!encoding.buffer)
+			return false;
+	}
+
+	pthread_mutex_init(&encoding.lock, NULL);
+	parallel_lines(encode_lines, &encoding, image.height);
+	pthread_mutex_destroy(&encoding.lock);
+
+	if (encoding.buffer) {
+		encoding.failed = fwrite(encoding.buffer, 1, length, file) != length;
+		release_block(encoding.buffer);
+	}
+
+	return !encoding.failed;
+}
+
+// Function to compress some lines of an image with run-length encoding, as
+// a tile of a native file
+//
+// A control byte below 128 is followed by that many pixels plus one, other
+// control bytes by one pixel repeated that many times minus 126. A pixel is
+// one byte for a grayscale image and three for a color image
+//
+// Parameters:
+//	 - image: The image
+//	 - start: First line of the tile
+//	 - end: Line after the last one of the tile
+//	 - bytes: Buffer to store the compressed bytes (big enough for each pixel
+//			  and a control byte, as each control byte covers at least one
+//			  pixel)
+//
+// Returns:
+//	 - The number of compressed bytes
+size_t pack_tile(image_t image, unsigned short start, unsigned short end,
+				 unsigned char *bytes)
+{
+	unsigned short channels = image.color ? 3 : 1;
+	size_t pixel = 0, pixels = (size_t)(end - start) * image.width;
+	size_t length = 0, run, index;
+	bool repeat;
+
+	// The lines of a picture follow each other in its block
+	pixel_t *line = image.picture[start];
+
+	while (pixel < pixels) {
+		// Count the pixels repeating this one
+		for (run = 1; pixel + run < pixels && run < 129 &&
+			 !memcmp(&line[pixel], &line[pixel + run], sizeof(pixel_t));
+			 run++)
+			;
+
+		// Otherwise count the pixels up to the next repetition
+		repeat = run > 1;
+		if (!repeat)
+			for (; pixel + run < pixels && run < 128 &&
+				 (pixel + run + 1 == pixels ||
+				  memcmp(&line[pixel + run], &line[pixel + run + 1],
+						 sizeof(pixel_t)));
+				 run++)
+				;
+
+		bytes[length++] = repeat ? run + 126 : run - 1;
+		for (index = 0; index < (repeat ? 1 : run); index++) {
+			bytes[length++] = line[pixel + index].red;
+			if (channels == 3) {
+				bytes[length++] = line[pixel + index].green;
+				bytes[length++] = line[pixel + index].blue;
+			}
+		}
+		pixel += run;
+	}
+
+	return length;
+}
+
+// Function to compress the tiles starting in some lines of an image (run by
+// each thread)
+//
+// Parameters:
+//	 - data: Pointer to the packing_t structure describing the image
+//	 - start: First line of the lines
+//	 - end: Line after the last one of the lines
+void pack_lines(void *data, unsigned short start, unsigned short end)
+{
+	packing_t *packing = data;
+	unsigned short channels = packing->image.color ? 3 : 1;
+	unsigned long line, tile_end;
+
+	// Start at the first tile starting in the lines
+	line = (start + NATIVE_TILE_LINES - 1) / NATIVE_TILE_LINES *
+		   NATIVE_TILE_LINES;
+	for (; line < end; line += NATIVE_TILE_LINES) {
+		tile_end = line + NATIVE_TILE_LINES;
+		if (tile_end > packing->image.height)
+			tile_end = packing->image.height;
+
+		size_t pixels = (tile_end - line) * packing->image.width;
+		unsigned char *bytes =
+			allocate_block(pixels * (channels + 1) + 1);
+		if (!bytes)
+			return;
+
+		packing->tiles[line / NATIVE_TILE_LINES] = bytes;
+		packing->lengths[line / NATIVE_TILE_LINES] =
+			pack_tile(packing->image, line, tile_end, bytes);
+	}
+}
+
+// Function to write an image to a file in the native container format: the
+// header, the offsets of the tiles and the tiles, compressed in parallel
+//
+// Parameters:
+//	 - file: Pointer to the FILE structure of the file
+//	 - image: The image to be written
+//
+// Returns:
+//	 - true if the image was written, false otherwise
+bool write_native(FILE *file, image_t image)
+{
+	unsigned short tiles =
+		(image.height + NATIVE_TILE_LINES - 1) / NATIVE_TILE_LINES, tile;
+	packing_t packing;
+	native_t header;
+
+	packing.image = image;
+	packing.tiles = calloc(tiles + 1, sizeof(unsigned char *));
+	packing.lengths = calloc(tiles + 1, sizeof(size_t));
+	off_t *offsets = malloc((tiles + 1) * sizeof(off_t));
+	bool written = packing.tiles && packing.lengths && offsets;
+
+	if (written)
+		parallel_lines(pack_lines, &packing, image.height);
+
+	// The tiles follow the header and the offsets
+	memset(&header, 0, sizeof(native_t));
+	memcpy(header.magic, NATIVE_MAGIC, sizeof(NATIVE_MAGIC));
+	header.height = image.height;
+	header.width = image.width;
+	header.color = image.color;
+	header.tile_lines = NATIVE_TILE_LINES;
+
+	if (written) {
+		offsets[0] = sizeof(native_t) + (tiles + 1) * sizeof(off_t);
+		for (tile = 0; tile < tiles; tile++) {
+			written = written && packing.tiles[tile];
+			offsets[tile + 1] = offsets[tile] + packing.lengths[tile];
+		}
+	}
+
+	written = written && fwrite(&header, sizeof(native_t), 1, file) == 1 &&
+			  fwrite(offsets, sizeof(off_t), tiles + 1, file) == tiles + 1U;
+	for (tile = 0; written && tile < tiles; tile++)
+		written = fwrite(packing.tiles[tile], 1, packing.lengths[tile],
+						 file) == packing.lengths[tile];
+
+	for (tile = 0; packing.tiles && tile < tiles; tile++)
+		release_block(packing.tiles[tile]);
+	free(packing.tiles);
+	free(packing.lengths);
+	free(offsets);
+
+	return written;
+}
+
+// Function to create a file to be compressed as it is written
 //
 // Parameters:
-//   - image: Pointer to the image structure to be updated with the loaded image
-//   - selection: Pointer to the area structure to be set based on the
-//				  loaded image
-//   - file_name: The name of the file to load
-void load_command(image_t *image, area_t *selection,
-				  char file_name[FILE_NAME_LENGTH])
+//	 - file_name: The name of the file
+//	 - codec: Pointer to the codec of the file
+//	 - compressor: Pointer to store the process of the program compressing
+//				   the file
+//
+// Returns:
+//	 - Pointer to the FILE structure of the pipe to the program, or NULL if
+//	   the file cannot be created
+FILE *create_compressed_file(char file_name[FILE_NAME_LENGTH],
+							 codec_t *codec, pid_t *compressor)
 {
-	// Free existing image if it exists
-	if (image->picture)
-		free_picture(&image->picture, image->height);
+	int file = open(file_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+					0666), pipes[2];
+	if (file < 0)
+		return NULL;
+	if (pipe2(pipes, O_CLOEXEC)) {
+		close(file);
+		return NULL;
+	}
 
-	// Load the image from the file
-	*image = load_image(file_name);
+	*compressor = start_codec(codec, codec->compress, pipes[0], file);
+	close(pipes[0]);
+	close(file);
 
-	// Set the selection area to cover the entire image if the image is loaded
-	if (image->picture) {
-		selection->all = true;
-		selection->column_start = 0;
-		selection->column_end = image->width;
-		selection->line_start = 0;
-		selection->line_end = image->height;
+	FILE *compressed = *compressor > 0 ? fdopen(pipes[1], "w") : NULL;
+	if (!compressed) {
+		close(pipes[1]);
+		if (*compressor > 0)
+			finish_codec(*compressor);
+		*compressor = 0;
 	}
+
+	return compressed;
 }
 
-// Function to select an area within the image
+// Function to create a file for an image and write its header
+//
+// Files whose name ends in ".gz", ".zst" or ".xz" are compressed by the
+// matching program (see codecs) while they are written
 //
 // Parameters:
-//	 - selection: The current area selection
-//	 - image: The image to select an area from
-//	 - first_value, second_value, third_value, fourth_value:
-//					Coordinates of the selected area
+//	 - image: Image structure containing the data to be saved
+//	 - file_name: String specifying the name of the file to save
+//	 - magic_number: The format of the file (2, 3, 5, 6 or NATIVE_FORMAT,
+//					 whose header is written with the pixels)
+//	 - compressor: Pointer to store the process of the program compressing
+//				   the file (0 if it is not compressed)
 //
 // Returns:
-//	 - The updated area selection based on the input coordinates
-area_t area_select(area_t selection, image_t image, signed short first_value,
-				   signed short second_value, signed short third_value,
-				   signed short fourth_value)
+//	 - Pointer to the FILE structure of the file or NULL if it cannot be
+//	   opened
+FILE *create_image_file(image_t image, char file_name[FILE_NAME_LENGTH],
+						unsigned short magic_number, pid_t *compressor)
 {
-	// Check if the coordinates are valid
-	if ((first_value < 0 || first_value > image.width) ||
-	    (second_value < 0 || second_value > image.height) ||
-	    (third_value < 0 || third_value > image.width) ||
-	    (fourth_value < 0 || fourth_value > image.height) ||
-	    (first_value == third_value || second_value == fourth_value)) {
-		// Print error message and return the original selection
-		printf("Invalid set of coordinates\n");
-		return selection;
-	}
+	bool ascii = magic_number == 2 || magic_number == 3;
+	codec_t *codec = find_codec(file_name);
+	FILE *file;
+
+	// Open the file for writing (in binary mode for the binary formats)
+	*compressor = 0;
+	if (codec)
+		file = create_compressed_file(file_name, codec, compressor);
+	else
+		file = fopen(file_name, ascii ? "wte" : "wbe");
 
-	// Create a new area structure to store the selected area
-	area_t new_area;
+	// Check if the file is opened successfully
+	if (!file || magic_number == NATIVE_FORMAT)
+		return file;
 
-	// Determine the column start and end based on the input coordinates
-	if (first_value < third_value) {
-		new_area.column_start = first_value;
-		new_area.column_end = third_value;
+	// Write the header information to the file
+	fprintf(file, "P%hd\n# %s\n%hd %hd\n%hd\n", magic_number, file_name,
+			image.width, image.height, MAX_VALUE);
+
+	return file;
+}
+
+// Function to write the pixels of an image after the header of its file and
+// close the file (waiting for the program compressing it, if any)
+//
+// The ASCII formats (2 & 3) are written by encode_image(), in parallel, the
+// binary ones (5 & 6) a line at a time and the native container by
+// write_native(). The grayscale formats (2 & 5) hold one value for each
+// pixel, the color ones (3 & 6) three
+//
+// Parameters:
+//	 - file: Pointer to the FILE structure of the file
+//	 - image: Image structure containing the data to be saved
+//	 - magic_number: The format of the file (2, 3, 5, 6 or NATIVE_FORMAT)
+//	 - compressor: The process of the program compressing the file (0 if
+//				   none)
+//
+// Returns:
+//	 - true if the file was written, false otherwise
+bool write_pixels(FILE *file, image_t image, unsigned short magic_number,
+				  pid_t compressor)
+{
+	bool written = true;
+
+	if (magic_number == NATIVE_FORMAT) {
+		written = write_native(file, image);
+	} else if (magic_number == 2 || magic_number == 3) {
+		written = encode_image(file, image);
 	} else {
-		new_area.column_start = third_value;
-		new_area.column_end = first_value;
+		unsigned short channels = magic_number == 6 ? 3 : 1;
+		unsigned char *bytes = allocate_block(image.width * channels + 1);
+		unsigned short line, column;
+
+		for (line = 0; bytes && written && line < image.height; line++) {
+			unsigned char *byte = bytes;
+			for (column = 0; column < image.width; column++) {
+				*byte++ = image.picture[line][column].red;
+				if (channels == 3) {
+					*byte++ = image.picture[line][column].green;
+					*byte++ = image.picture[line][column].blue;
+				}
+			}
+			written = fwrite(bytes, 1, byte - bytes, file) ==
+					  (size_t)(byte - bytes);
+		}
+
+		written = written && bytes;
+		release_block(bytes);
 	}
 
-	// Determine the line start and end based on the input coordinates
-	if (second_value < fourth_value) {
-		new_area.line_start = second_value;
-		new_area.line_end = fourth_value;
-	} else {
-		new_area.line_start = fourth_value;
-		new_area.line_end = second_value;
+	// Close the file, which lets the compressor finish
+	written = !fclose(file) && written;
+	if (compressor)
+		written = finish_codec(compressor) && written;
+
+	return written;
+}
+
+// Function to save an image in a format (P2, P3, P5 or P6)
+//
+// Parameters:
+//	 - image: Image structure containing the data to be saved
+//	 - file_name: String specifying the name of the file to save
+//	 - magic_number: The format of the file
+void save_image(image_t image, char file_name[FILE_NAME_LENGTH],
+				unsigned short magic_number)
+{
+	pid_t compressor;
+	FILE *file = create_image_file(image, file_name, magic_number,
+								   &compressor);
+	if (!file || !write_pixels(file, image, magic_number, compressor))
+		return;
+
+	fprintf(output(), "Saved %s\n", file_name);
+}
+
+// Function to write the pixels of a SAVE command in the background (thread
+// entry point)
+//
+// Parameters:
+//	 - argument: Pointer to the save_t structure describing the command
+//
+// Returns:
+//	 - NULL
+void *run_save(void *argument)
+{
+	save_t *save = argument;
+
+	// Use as many threads as the command would have
+	context_t context = { stdout, save->threads, NULL };
+	set_context(&context);
+
+	save->written = write_pixels(save->file, save->image, save->magic_number,
+								 save->compressor);
+	free_picture(&save->image.picture);
+
+	set_context(NULL);
+	return NULL;
+}
+
+// Function to start writing the pixels of an image in the background, from
+// a copy of the image
+//
+// Parameters:
+//	 - saves: Pointer to the list of the SAVE commands of the session
+//	 - file: Pointer to the FILE structure of the file, its header written
+//	 - compressor: The process of the program compressing the file (0 if
+//				   none)
+//	 - image: The image to be saved
+//	 - file_name: The name of the file
+//	 - magic_number: The format of the file
+//
+// Returns:
+//	 - true if the pixels are being written, false if the copy or the thread
+//	   could not be created
+bool start_save(save_t **saves, FILE *file, pid_t compressor, image_t image,
+				char file_name[FILE_NAME_LENGTH], unsigned short magic_number)
+{
+	save_t *save = malloc(sizeof(save_t));
+	if (!save)
+		return false;
+
+	strcpy(save->file_name, file_name);
+	save->file = file;
+	save->compressor = compressor;
+	save->image = image;
+	save->image.picture = copy_picture(image);
+	save->magic_number = magic_number;
+	save->threads = number_of_threads();
+
+	if (!save->image.picture ||
+	    pthread_create(&save->thread, NULL, run_save, save)) {
+		if (save->image.picture)
+			free_picture(&save->image.picture);
+		free(save);
+		return false;
 	}
 
-	// Update the 'all' flag based on the selected area
-	new_area.all =
-	    (!new_area.line_start && new_area.line_end == image.height &&
-	     !new_area.column_start && new_area.column_end == image.width);
+	// The commands are kept in order, to print how they ended in order
+	while (*saves)
+		saves = &(*saves)->next;
+	save->next = NULL;
+	*saves = save;
+	return true;
+}
 
-	// Print a message indicating the selected area
-	printf("Selected %hd %hd %hd %hd\n", new_area.column_start,
-	       new_area.line_start, new_area.column_end, new_area.line_end);
+// Function to wait for the SAVE commands writing in the background and
+// print how each one ended
+//
+// Parameters:
+//	 - saves: Pointer to the list of the SAVE commands of the session
+//	 - file_name: The name of the file whose commands are waited for (NULL
+//				  for all of them)
+void finish_saves(save_t **saves, char *file_name)
+{
+	while (*saves) {
+		save_t *save = *saves;
+		if (file_name && strcmp(save->file_name, file_name)) {
+			saves = &save->next;
+			continue;
+		}
 
-	// Return the newly selected area
-	return new_area;
+		pthread_join(save->thread, NULL);
+		if (save->written)
+			fprintf(output(), "Saved %s\n", save->file_name);
+		else
+			fprintf(output(), "Failed to save %s\n", save->file_name);
+		*saves = save->next;
+		free(save);
+	}
 }
 
-// Function to handle the "SELECT" command, updating the selection area
+// Function to remember the binary file an image was just saved to, so that
+// the next SAVE to it only rewrites what changed (see rewrite_target())
 //
 // Parameters:
-//   - image: Image structure containing the loaded image data
-//   - selection: Pointer to the area structure representing the current
-//				  selection
-//   - parameter_1: First parameter of the SELECT command
-//   - parameter_2: Second parameter of the SELECT command
-//   - parameter_3: Third parameter of the SELECT command
-//   - parameter_4: Fourth parameter of the SELECT command
-//   - parameter_5: Fifth parameter of the SELECT command
-void select_command(image_t image, area_t *selection,
-					char parameter_1[MAX_INPUT_LINE_LENGTH],
-					char parameter_2[MAX_NUMBER_SIZE + 1],
-					char parameter_3[MAX_NUMBER_SIZE + 1],
-					char parameter_4[MAX_NUMBER_SIZE + 1], char parameter_5[1])
+//	 - image: Pointer to the image
+//	 - file_name: The name of the file
+//	 - magic_number: The format of the file (5 or 6)
+void set_target(image_t *image, char file_name[FILE_NAME_LENGTH],
+				unsigned short magic_number)
 {
-	// Check if an image is loaded
-	if (!image.picture) {
-		printf("No image loaded\n");
+	free_target(&image->target);
+
+	target_t *target = malloc(sizeof(target_t));
+	if (!target)
+		return;
+	target->starts = calloc(image->height, sizeof(unsigned short));
+	target->ends = calloc(image->height, sizeof(unsigned short));
+
+	// The pixels are at the end of the file
+	off_t size = (off_t)image->height * image->width *
+				 (magic_number == 6 ? 3 : 1);
+	if (!target->starts || !target->ends ||
+	    stat(file_name, &target->status) || target->status.st_size < size) {
+		free_target(&target);
 		return;
 	}
 
-	// Check for the "ALL" option
-	if (!strcmp(parameter_1, "ALL") && !strlen(parameter_2)) {
-		// Select the entire image
-		selection->all = true;
-		selection->line_start = 0;
-		selection->column_start = 0;
-		selection->line_end = image.height;
-		selection->column_end = image.width;
+	strcpy(target->name, file_name);
+	target->magic_number = magic_number;
+	target->height = image->height;
+	target->width = image->width;
+	target->offset = target->status.st_size - size;
+	image->target = target;
+}
 
-		printf("Selected ALL\n");
-		return;
+// Function to save an image to the binary file it was last saved to, by
+// rewriting in place only the bytes of the pixels modified since
+//
+// The file must have the same format and dimensions, and still be the one
+// written then (same device, inode, size and modification time)
+//
+// Parameters:
+//	 - image: Pointer to the image
+//	 - file_name: The name of the file
+//	 - magic_number: The format of the file (5 or 6)
+//
+// Returns:
+//	 - true if the file was rewritten, false if it must be written whole
+bool rewrite_target(image_t *image, char file_name[FILE_NAME_LENGTH],
+					unsigned short magic_number)
+{
+	target_t *target = image->target;
+	if (!target || strcmp(target->name, file_name) ||
+	    target->magic_number != magic_number ||
+	    target->height != image->height || target->width != image->width)
+		return false;
+
+	struct stat status;
+	int file = open(file_name, O_WRONLY | O_CLOEXEC);
+	if (file < 0)
+		return false;
+	if (fstat(file, &status) || status.st_dev != target->status.st_dev ||
+	    status.st_ino != target->status.st_ino ||
+	    status.st_size != target->status.st_size ||
+	    status.st_mtim.tv_sec != target->status.st_mtim.tv_sec ||
+	    status.st_mtim.tv_nsec != target->status.st_mtim.tv_nsec) {
+		close(file);
+		return false;
 	}
 
-	// Check for valid parameters and update the selection area
-	if (strlen(parameter_1) && strlen(parameter_2) && strlen(parameter_3) &&
-	    strlen(parameter_4) && !strlen(parameter_5)) {
-		// Check for invalid parameters
-		if ((!atoi(parameter_1) && parameter_1[0] != '0') ||
-		    (!atoi(parameter_2) && parameter_2[0] != '0') ||
-		    (!atoi(parameter_3) && parameter_3[0] != '0') ||
-		    (!atoi(parameter_4) && parameter_4[0] != '0')) {
-			printf("Invalid command\n");
-			return;
+	unsigned short channels = magic_number == 6 ? 3 : 1, line, column;
+	unsigned char *bytes = allocate_block(image->width * channels);
+	bool written = bytes != NULL;
+
+	// Write the modified columns of each line where they are in the file
+	for (line = 0; written && line < image->height; line++) {
+		unsigned short start = target->starts[line];
+		unsigned short end = target->ends[line];
+		if (start == end)
+			continue;
+
+		unsigned char *byte = bytes;
+		for (column = start; column < end; column++) {
+			*byte++ = image->picture[line][column].red;
+			if (channels == 3) {
+				*byte++ = image->picture[line][column].green;
+				*byte++ = image->picture[line][column].blue;
+			}
 		}
+		ssize_t length = byte - bytes;
+		written = pwrite(file, bytes, length, target->offset +
+						 ((off_t)line * image->width + start) * channels) ==
+				  length;
+	}
+	release_block(bytes);
 
-		// Update the selection area
-		*selection = area_select(*selection, image, atoi(parameter_1),
-								 atoi(parameter_2), atoi(parameter_3),
-								 atoi(parameter_4));
+	// Remember the file as it is now
+	written = written && !fstat(file, &target->status);
+	written = !close(file) && written;
+	if (!written)
+		return false;
+
+	memset(target->starts, 0, image->height * sizeof(unsigned short));
+	memset(target->ends, 0, image->height * sizeof(unsigned short));
+	return true;
+}
+
+// Function to save an image based on the required format (P2, P3, P5, P6)
+//
+// In the background, the file is created and its header written right away,
+// then a copy of the image is written by a separate thread while the next
+// commands run, and the command only prints whether it was saved once the
+// thread is waited for (see finish_saves()). Otherwise, the
+// binary file the image was last saved to is only rewritten where the image
+// changed since (see rewrite_target())
+//
+// Parameters:
+//   - image: Pointer to the image structure containing the data to be saved
+//   - file_name: String specifying the name of the file to save
+//   - parameter_2: String specifying the format ("ascii" for ASCII, "native"
+//					for the native container, otherwise binary)
+//   - saves: Pointer to the list of the SAVE commands of the session, to
+//			  save in the background (NULL otherwise)
+void save_command(image_t *image, char file_name[FILE_NAME_LENGTH],
+				  char parameter_2[MAX_PARAMETER_LENGTH + 1], save_t **saves)
+{
+	// Print an error message if no image is loaded
+	if (!image->picture) {
+		fprintf(output(), "No image loaded\n");
 		return;
 	}
 
-	// Invalid command if none of the conditions are met
-	printf("Invalid command\n");
+	// Check the color type and the format: P2 or P3 in ASCII, P5 or P6 in
+	// binary, or the native container
+	unsigned short magic_number =
+		(!strncmp(parameter_2, "ascii", strlen("ascii")) ? 2 : 5) +
+		(image->color ? 1 : 0);
+	if (!strcmp(parameter_2, "native"))
+		magic_number = NATIVE_FORMAT;
+	bool binary = (magic_number == 5 || magic_number == 6) &&
+				  !find_codec(file_name);
+
+	if (!saves && binary && rewrite_target(image, file_name, magic_number)) {
+		fprintf(output(), "Saved %s\n", file_name);
+		return;
+	}
+
+	pid_t compressor;
+	FILE *file = create_image_file(*image, file_name, magic_number,
+								   &compressor);
+	if (!file)
+		return;
+
+	if (saves && start_save(saves, file, compressor, *image, file_name,
+							magic_number))
+		return;
+
+	if (!write_pixels(file, *image, magic_number, compressor))
+		return;
+
+	// The next SAVE to the file only rewrites what changes
+	if (binary)
+		set_target(image, file_name, magic_number);
+
+	fprintf(output(), "Saved %s\n", file_name);
 }
 
-// Function to print stars representing a histogram bin
+// Function to handle the "PREVIEW" command, saving a small version of the
+// image taken from its pyramid (built if needed)
+//
+// The finest level that fits within the given size is saved, in binary
+// format
 //
 // Parameters:
-//	 - number: The number of stars to print
-void print_stars(unsigned short number)
+//   - image: Pointer to the image structure containing the loaded image data
+//   - file_name: String specifying the name of the file to save
+//   - parameter_2: The maximum width and height of the preview
+//   - keep: Whether the pyramids are kept (see PYRAMID), otherwise the one
+//			 built for the preview is freed afterwards
+void preview_command(image_t *image, char file_name[FILE_NAME_LENGTH],
+					 char parameter_2[MAX_PARAMETER_LENGTH + 1], bool keep)
 {
-	// Print the bin number followed by a tab, a pipe symbol and another tab
-	printf("%hd\t|\t", number);
+	// Print an error message if no image is loaded
+	if (!image->picture) {
+		fprintf(output(), "No image loaded\n");
+		return;
+	}
 
-	// Print the stars representing the bin count
-	unsigned short index;
-	for (index = 0; index < number; index++)
-		printf("*");
+	// Check for invalid parameters
+	signed long size = atol(parameter_2);
+	if (size < 1) {
+		fprintf(output(), "Invalid command\n");
+		return;
+	}
 
-	// Move to the next line for the next bin
-	printf("\n");
+	if (!image->pyramid)
+		build_pyramid(image);
+	if (!image->pyramid) {
+		fprintf(output(), "Not enough memory\n");
+		return;
+	}
+
+	// Find the finest level that fits (or the coarsest one)
+	pyramid_t *pyramid = image->pyramid;
+	unsigned short level = 0;
+	while (level + 1 < pyramid->levels &&
+	       (pyramid->heights[level] > size || pyramid->widths[level] > size))
+		level++;
+
+	// Save the level as if it were an image
+	image_t preview = *image;
+	preview.picture = level ? pyramid->pictures[level] : image->picture;
+	preview.height = pyramid->heights[level];
+	preview.width = pyramid->widths[level];
+
+	save_image(preview, file_name, preview.color ? 6 : 5);
+
+	// The pyramid is not kept up to date for the next commands
+	if (!keep)
+		free_pyramid(&image->pyramid);
 }
 
-// Function that constructs and prints a histogram for an image, focusing on
-// the red channel for simplicity since all color channels are identical
+// Function to handle the "PYRAMID" command, choosing whether the pyramid of
+// each loaded image is built right away and kept up to date
 //
 // Parameters:
-//	 - image: The image to analyze
-//	 - number_of_stars: The maximum number of stars to use for representing
-//						each bin
-//	 - number_of_bins: The number of bins in the histogram
-void make_histogram(image_t image, short number_of_stars, short number_of_bins)
+//   - image: Pointer to the image structure containing the loaded image data
+//   - pyramid: Pointer to the flag to be updated
+//   - parameter_1: "ON" or "OFF"
+void pyramid_command(image_t *image, bool *pyramid,
+					 char parameter_1[MAX_INPUT_LINE_LENGTH])
 {
-	// Calculate the step size for each histogram bin
-	unsigned short step = (MAX_VALUE + 1) / number_of_bins;
+	if (!strcmp(parameter_1, "ON")) {
+		*pyramid = true;
+		if (image->picture && !image->pyramid)
+			build_pyramid(image);
+		fprintf(output(), "Pyramid enabled\n");
+	} else if (!strcmp(parameter_1, "OFF")) {
+		*pyramid = false;
+		free_pyramid(&image->pyramid);
+		fprintf(output(), "Pyramid disabled\n");
+	} else {
+		fprintf(output(), "Invalid command\n");
+	}
+}
 
-	// Array to store the frequency of values in each bin
-	unsigned long frequency[MAX_VALUE + 1];
+// Function to print the statistics of a channel over an area
+//
+// Parameters:
+//	 - name: The name of the channel (empty for grayscale images)
+//	 - sum: The sum of the channel values
+//	 - square: The sum of their squares
+//	 - count: The number of pixels
+void print_statistics(char *name, unsigned long long sum,
+					  unsigned long long square, unsigned long count)
+{
+	double mean = (double)sum / count;
+	double variance = (double)square / count - mean * mean;
 
-	unsigned short value, line, column, previous_value = 0, index;
+	// Avoid printing tiny negative variances caused by rounding
+	if (variance < 0)
+		variance = 0;
 
-	// Iterate over each bin
-	for (index = 0; index < number_of_bins; index++) {
-		// Determine the upper value for the current bin
-		value = (index + 1) * step;
+	fprintf(output(), "%sSum %llu Mean %.2f Variance %.2f\n", name, sum, mean,
+		variance);
+}
 
-		// Initialize frequency for the current bin
-		frequency[index] = 0;
+// Function to handle the "STATS" command, printing the sum, mean and variance
+// of the selected area in constant time, using the integral image
+//
+// Parameters:
+//   - image: Pointer to the image structure containing the loaded image data
+//   - selection: Area selection structure specifying the region to analyze
+//   - parameter_1: First parameter of the STATS command (must be empty)
+void stats_command(image_t *image, area_t selection,
+				   char parameter_1[MAX_INPUT_LINE_LENGTH])
+{
+	// Check if an image is loaded
+	if (!image->picture) {
+		fprintf(output(), "No image loaded\n");
+		return;
+	}
 
-		// Iterate over each pixel in the image
-		for (line = 0; line < image.height; line++) {
-			for (column = 0; column < image.width; column++) {
-				// Check if the red channel value falls within the current bin
-				if (image.picture[line][column].red >=
-					previous_value &&
-				    image.picture[line][column].red < value) {
-					frequency[index]++;
-				}
-			}
-		}
-		previous_value = value;
+	// Check for invalid parameters
+	if (strlen(parameter_1)) {
+		fprintf(output(), "Invalid command\n");
+		return;
+	}
+
+	// Build the integral image if needed, or bring it up to date
+	update_integral(image);
+	if (!image->integral)
+		return;
+
+	unsigned long count =
+		(unsigned long)(selection.line_end - selection.line_start) *
+		(selection.column_end - selection.column_start);
+	sum_t square = integral_sum(*image, image->integral->squares, selection);
+
+	// The channel values of larger areas may not add up to less than 2^32,
+	// so they are added up from the pixels
+	sum_t sum;
+	if (count <= MAX_NARROW_PIXELS) {
+		sum = narrow_integral_sum(*image, selection);
+	} else {
+		memset(&sum, 0, sizeof(sum_t));
+		unsigned short line, column;
+		for (line = selection.line_start; line < selection.line_end; line++)
+			for (column = selection.column_start;
+				 column < selection.column_end; column++)
+				add_pixel(&sum, image->picture[line][column], 1);
 	}
 
-	// Find the maximum frequency to normalize the histogram
-	unsigned long max_value = frequency[0];
-	for (index = 1; index < number_of_bins; index++) {
-		if (max_value < frequency[index])
-			max_value = frequency[index];
+	// Print a single channel for grayscale images
+	if (!image->color) {
+		print_statistics("", sum.red, square.red, count);
+		return;
 	}
 
-	// Print stars for each bin, scaled based on their frequency
-	for (index = 0; index < number_of_bins; index++) {
-		print_stars((1. * frequency[index]) / (1. * max_value) *
-			    (1. * number_of_stars));
-	}
+	print_statistics("Red ", sum.red, square.red, count);
+	print_statistics("Green ", sum.green, square.green, count);
+	print_statistics("Blue ", sum.blue, square.blue, count);
 }
 
-// Function to handle the "HISTOGRAM" command, generating a histogram for the
-// specified channel of the image
+// Function to initialize a session with a single, empty, default slot
 //
 // Parameters:
-//   - image: Image structure containing the loaded image data
-//   - parameter_1: First parameter of the HISTOGRAM command
-//   - parameter_2: Second parameter of the HISTOGRAM command
-//   - parameter_3: Third parameter of the HISTOGRAM command
-void histogram_command(image_t image, char parameter_1[MAX_INPUT_LINE_LENGTH],
-					   char parameter_2[MAX_NUMBER_SIZE + 1],
-				       char parameter_3[MAX_NUMBER_SIZE + 1])
+//	 - session: Pointer to the session to be initialized
+void init_session(session_t *session)
 {
-	// Check if an image is loaded
-	if (!image.picture)
-		printf("No image loaded\n");
+	session->count = 1;
+	session->current = 0;
+	session->pyramid = false;
+	session->slots[0].name[0] = '\0';
+	session->slots[0].image.picture = NULL;
+	session->slots[0].image.source = NULL;
+	session->slots[0].image.pyramid = NULL;
+	session->slots[0].image.integral = NULL;
+	session->slots[0].image.histogram = NULL;
+	session->slots[0].image.target = NULL;
+	session->slots[0].image.history = NULL;
+	session->history_limit = (unsigned long long)HISTORY_MEMORY_LIMIT << 20;
+	session->saves = NULL;
+}
 
-	// Check for the correct number of parameters
-	else if (strlen(parameter_1) && strlen(parameter_2) &&
-			 !strlen(parameter_3)) {
-		// Check if the image is a color image
-		if (image.color) {
-			printf("Black and white image needed\n");
-		} else {
-			// Generate and display the histogram for the specified channel
-			make_histogram(image, atoi(parameter_1),
-						   atoi(parameter_2));
-		}
-	} else {
-		// Print an error message for an invalid command
-		printf("Invalid command\n");
-	}
+// Function to find an image slot by name
+//
+// Parameters:
+//	 - session: Pointer to the session to search in
+//	 - name: The name of the slot
+//
+// Returns:
+//	 - Pointer to the slot or NULL if there is no slot with that name
+slot_t *find_slot(session_t *session, char *name)
+{
+	unsigned short index;
+	for (index = 0; index < session->count; index++)
+		if (!strcmp(session->slots[index].name, name))
+			return &session->slots[index];
+
+	return NULL;
 }
 
-// Function to perform histogram equalization on an image
+// Function to handle the "LOAD <name> <file_name>" command, loading an image
+// into a named slot (created if needed), which becomes the current one
 //
 // Parameters:
-//   - image: Pointer to the image structure to be modified
-void equalize(image_t *image)
+//	 - session: Pointer to the session
+//	 - name: The name of the slot
+//	 - file_name: The name of the file to load
+void load_slot_command(session_t *session, char *name,
+					   char file_name[FILE_NAME_LENGTH])
 {
-	// Initialize arrays to store frequency and cumulative distribution
-	unsigned int frequency[MAX_VALUE + 1] = { 0 };
-	double cumulative_distribution[MAX_VALUE + 1] = { 0 };
-	unsigned short index, line, column;
+	slot_t *slot = find_slot(session, name);
 
-	// Calculate frequency of each intensity level
-	for (line = 0; line < image->height; line++)
-		for (column = 0; column < image->width; column++)
-			frequency[image->picture[line][column].red]++;
+	// Create the slot if it does not exist yet
+	if (!slot) {
+		if (session->count == MAX_SLOTS) {
+			fprintf(output(), "Too many images loaded\n");
+			return;
+		}
 
-	// Calculate cumulative distribution function
-	cumulative_distribution[0] =
-	    (double)frequency[0] / (image->height * image->width);
-	for (index = 1; index <= MAX_VALUE; index++) {
-		cumulative_distribution[index] =
-		    cumulative_distribution[index - 1] +
-		    (double)frequency[index] / (image->height * image->width);
+		slot = &session->slots[session->count++];
+		strcpy(slot->name, name);
+		slot->image.picture = NULL;
+		slot->image.source = NULL;
+		slot->image.pyramid = NULL;
+		slot->image.integral = NULL;
+		slot->image.histogram = NULL;
+		slot->image.target = NULL;
+		slot->image.history = NULL;
 	}
 
-	// Perform histogram equalization
-	for (line = 0; line < image->height; line++) {
-		for (column = 0; column < image->width; column++) {
-			double result =
-			    cumulative_distribution[image->picture[line][column]
-							.red] *
-			    MAX_VALUE;
+	session->current = slot - session->slots;
+	load_command(&slot->image, &slot->selection, file_name, session->pyramid);
+}
 
-			// Update pixel values after equalization
-			image->picture[line][column].red =
-			    clamp(round_double(result));
-			image->picture[line][column].green =
-			    image->picture[line][column].red;
-			image->picture[line][column].blue =
-			    image->picture[line][column].red;
-		}
+// Function to handle the "USE" command, choosing the slot the following
+// commands work on
+//
+// Parameters:
+//	 - session: Pointer to the session
+//	 - name: The name of the slot
+void use_command(session_t *session, char *name)
+{
+	slot_t *slot = find_slot(session, name);
+	if (!slot) {
+		fprintf(output(), "No image named %s\n", name);
+		return;
 	}
 
-	// Print a message indicating the completion of equalization
-	printf("Equalize done\n");
+	session->current = slot - session->slots;
+	fprintf(output(), "Using %s\n", name);
 }
 
-// Function to rotate a selected area within an image
+// Function to handle the "CLOSE" command, freeing a named slot
 //
 // Parameters:
-//	 - image: Pointer to the image structure to be rotated
-//	 - selection: The selected area to be rotated
-//	 - angle: The angle (in degrees) by which the area should be rotated
-void rotate_area(image_t *image, area_t selection, signed short angle)
+//	 - session: Pointer to the session
+//	 - name: The name of the slot
+void close_command(session_t *session, char *name)
 {
-	// Adjust negative angles
-	signed short flip = angle;
-	if (flip < 0)
-		flip += 360;
+	slot_t *slot = find_slot(session, name);
 
-	// Determine the number of 90-degree rotations needed
-	flip = (flip / 90) % 4;
-
-	// No rotation needed for multiples of 360 degrees
-	if (!flip) {
-		printf("Rotated %hd\n", angle);
+	// The default slot cannot be closed
+	if (!slot || slot == session->slots) {
+		fprintf(output(), "No image named %s\n", name);
 		return;
 	}
 
-	// Create a copy of the selected area
-	pixel_t **copy =
-	    create_picture((selection.line_end - selection.line_start),
-					   (selection.column_end - selection.column_start));
+	if (slot->image.picture)
+		free_image(&slot->image);
 
-	if (!copy)
-		return;
+	// Move the last slot in its place, keeping the current one
+	unsigned short index = slot - session->slots;
+	session->count--;
+	session->slots[index] = session->slots[session->count];
+	if (session->current == index)
+		session->current = 0;
+	else if (session->current == session->count)
+		session->current = index;
 
-	// Perform the specified number of 90-degree rotations
-	short line, column, index;
-	for (index = flip; index != 0; index--) {
-		for (line = 0; line < selection.line_end - selection.line_start;
-		     line++) {
-			for (column = 0; column < selection.column_end -
-						      selection.column_start;
-			     column++) {
-				// Rotate the pixels
-				copy[line][column] =
-				    image->picture[selection.line_end - 1 -
-						   column]
-						  [line +
-						   selection.column_start];
-			}
-		}
+	fprintf(output(), "Closed %s\n", name);
+}
 
-		// Copy the rotated pixels back to the original location
-		for (line = 0; line < selection.line_end - selection.line_start;
-		     line++) {
-			for (column = 0; column < selection.column_end -
-						      selection.column_start;
-			     column++) {
-				image->picture[line + selection.line_start]
-					      [column + selection.column_start] =
-				    copy[line][column];
-			}
-		}
-	}
+// Function to take the next word of a line, ending it in place
+//
+// Parameters:
+//	 - position: Pointer to the position in the line, moved after the word
+//
+// Returns:
+//	 - The word, or an empty string if the line has no words left
+char *next_word(char **position)
+{
+	// Skip the separators before the word
+	while (**position == ' ' || **position == '\n')
+		(*position)++;
 
-	// Free memory used for the copy
-	free_picture(&copy, (selection.line_end - selection.line_start));
+	char *word = *position;
+	if (!*word)
+		return "";
 
-	// Print a message indicating the completion of rotation
-	printf("Rotated %hd\n", angle);
+	// Find the end of the word and terminate it
+	while (**position && **position != ' ' && **position != '\n')
+		(*position)++;
+	if (**position)
+		*(*position)++ = '\0';
+
+	return word;
 }
 
-// Function to rotate the entire image
+// Function to split an input line into a command and its parameters, without
+// copying them (the words are terminated in place)
+//
+// A line with a word longer than MAX_PARAMETER_LENGTH gets an empty command
+// (so it is reported as invalid); the words after the last parameter are
+// ignored
 //
 // Parameters:
-//	 - image: Pointer to the image structure to be rotated
-//	 - angle: The angle (in degrees) by which the image should be rotated
-void rotate_all(image_t *image, signed short angle)
+//	 - input_line: The line to be split (modified)
+//	 - command: Pointer to the structure to store the command and parameters
+void parse_command(char *input_line, command_t *command)
 {
-	// Adjust negative angles
-	signed short flip = angle;
-	if (flip < 0)
-		flip += 360;
+	char *position = input_line;
+	unsigned short index;
 
-	// Determine the number of 90-degree rotations needed
-	flip = (flip / 90) % 4;
+	command->name = next_word(&position);
+	bool valid = strlen(command->name) <= MAX_PARAMETER_LENGTH;
 
-	// No rotation needed for multiples of 360 degrees
-	if (!flip) {
-		printf("Rotated %hd\n", angle);
-		return;
+	for (index = 0; index < MAX_PARAMETERS; index++) {
+		command->parameters[index] = next_word(&position);
+		if (strlen(command->parameters[index]) > MAX_PARAMETER_LENGTH)
+			valid = false;
 	}
 
-	pixel_t **copy;
+	if (!valid)
+		command->name = "";
+}
 
-	unsigned short index, auxiliary, line, column;
-	for (index = flip; index != 0; index--) {
-		// Create a copy of the image
-		copy = create_picture(image->width, image->height);
-		if (!copy)
-			return;
+// Function to initialize a reader of command lines
+//
+// Parameters:
+//	 - reader: Pointer to the reader
+//	 - file: The file descriptor to read from
+void init_reader(reader_t *reader, int file)
+{
+	reader->file = file;
+	reader->start = 0;
+	reader->end = 0;
+	reader->skipping = false;
+}
 
-		// Perform the 90-degree rotation
-		for (line = 0; line < image->width; line++) {
-			for (column = 0; column < image->height; column++) {
-				copy[line][column] =
-				    image->picture[image->height - column - 1]
-						  [line];
-			}
+// Function to read the next line, reading as much input as is available at
+// once into the buffer of the reader
+//
+// A line that does not fit in the buffer is returned once as an empty line
+// and the rest of it is dropped
+//
+// Parameters:
+//	 - reader: Pointer to the reader
+//
+// Returns:
+//	 - The line (valid until the next call, without its terminator) or NULL
+//	   at the end of the input
+char *read_line(reader_t *reader)
+{
+	while (true) {
+		// Return the next complete line in the buffer
+		char *start = reader->buffer + reader->start;
+		char *newline = memchr(start, '\n', reader->end - reader->start);
+		if (newline) {
+			*newline = '\0';
+			reader->start = newline + 1 - reader->buffer;
+			if (!reader->skipping)
+				return start;
+
+			// This was the end of a line too long
+			reader->skipping = false;
+			continue;
 		}
 
-		// Free memory used by the original image
-		free_picture(&image->picture, image->height);
+		// Move the incomplete line to the start of the buffer
+		memmove(reader->buffer, start, reader->end - reader->start);
+		reader->end -= reader->start;
+		reader->start = 0;
+
+		// Drop the line if it fills the whole buffer
+		if (reader->end == READ_BUFFER_SIZE - 1) {
+			bool report = !reader->skipping;
+			reader->skipping = true;
+			reader->end = 0;
+			if (report) {
+				reader->buffer[0] = '\0';
+				return reader->buffer;
+			}
+		}
 
-		// Swap the image dimensions
-		auxiliary = image->height;
-		image->height = image->width;
-		image->width = auxiliary;
+		ssize_t count = read(reader->file, reader->buffer + reader->end,
+							 READ_BUFFER_SIZE - 1 - reader->end);
+		if (count < 0 && errno == EINTR)
+			continue;
 
-		// Allocate memory for the rotated image
-		image->picture = create_picture(image->height, image->width);
-		if (!image->picture)
-			return;
+		if (count <= 0) {
+			// Return the last line, even without a terminator
+			if (!reader->end || reader->skipping)
+				return NULL;
 
-		// Copy the rotated pixels back to the image structure
-		for (line = 0; line < image->height; line++)
-			for (column = 0; column < image->width; column++)
-				image->picture[line][column] =
-				    copy[line][column];
+			reader->buffer[reader->end] = '\0';
+			reader->start = reader->end;
+			return reader->buffer;
+		}
 
-		// Free memory used by the copy
-		free_picture(&copy, image->height);
+		reader->end += count;
 	}
+}
 
-	// Print a message indicating the completion of rotation
-	printf("Rotated %hd\n", angle);
+// Function to get command and parameters from the input
+//
+// Parameters:
+//	 - reader: Pointer to the reader of the input (STDIN for the user)
+//	 - command: Pointer to the structure to store the command and parameters
+//				(valid until the next call)
+//
+// Returns:
+//	 - false if the end of the input was reached, true otherwise
+bool get_command(reader_t *reader, command_t *command)
+{
+	char *input_line = read_line(reader);
+	if (!input_line)
+		return false;
+
+	parse_command(input_line, command);
+	return true;
 }
 
-// Function to handle the "ROTATE" command, rotating the image or a selected
-// area
+// Function to free the images of all the slots of a session
 //
 // Parameters:
-//   - image: Pointer to the image structure to be modified
-//   - selection: Area selection structure specifying the region to rotate
-//   - parameter_1: Angle parameter of the ROTATE command
-void rotate_command(image_t *image, area_t selection,
-					char parameter_1[MAX_NUMBER_SIZE + 1])
+//	 - session: Pointer to the session
+//
+// Returns:
+//	 - true if any image was loaded, false otherwise
+bool free_session(session_t *session)
 {
-	// Check if the angle parameter is missing
-	if (!strlen(parameter_1)) {
-		printf("Invalid command\n");
-		return;
-	}
+	bool loaded = false;
+	unsigned short index;
 
-	// Convert the angle parameter to a signed short
-	signed short angle = atoi(parameter_1);
+	// Wait for the files still being written
+	finish_saves(&session->saves, NULL);
 
-	// Check if an image is loaded
-	if (!image->picture) {
-		printf("No image loaded\n");
-		return;
+	for (index = 0; index < session->count; index++) {
+		if (session->slots[index].image.picture) {
+			free_image(&session->slots[index].image);
+			loaded = true;
+		}
 	}
 
-	// Check if the rotation angle is supported
-	if (angle != -360 && angle != -270 && angle != -180 && angle != -90 &&
-	    angle && angle != 90 && angle != 180 && angle != 270 &&
-	    angle != 360) {
-		printf("Unsupported rotation angle\n");
-		return;
-	}
+	return loaded;
+}
 
-	// Check if the rotation is applied to the entire image or a selected area
-	if (selection.all) {
-		// Rotate the entire image
-		rotate_all(image, angle);
-	} else {
-		// Check if the selected area is square
-		if (selection.line_end - selection.line_start !=
-		    selection.column_end - selection.column_start) {
-			printf("The selection must be square\n");
-			return;
-		}
+// Function to get the image of the current slot of a session
+//
+// Parameters:
+//	 - session: Pointer to the session
+//
+// Returns:
+//	 - Pointer to the image the commands work on
+image_t *current_image(session_t *session)
+{
+	return &session->slots[session->current].image;
+}
 
-		// Rotate the selected area
-		rotate_area(image, selection, angle);
-	}
+// Function to get the selection of the current slot of a session
+//
+// Parameters:
+//	 - session: Pointer to the session
+//
+// Returns:
+//	 - Pointer to the selection the commands work on
+area_t *current_selection(session_t *session)
+{
+	return &session->slots[session->current].selection;
 }
 
-// Function to crop the image based on the specified selection area
+// Functions to execute each command on the current image of a session,
+// checking its number of parameters (see build_dispatch_table())
 //
 // Parameters:
-//	 - image: Pointer to the image structure to be cropped
-//	 - selection: Pointer to the area selection structure specifying the
-//                crop region
-void crop(image_t *image, area_t *selection)
+//	 - session: Pointer to the session
+//	 - command: The command and its parameters
+void handle_load(session_t *session, command_t *command)
 {
-	// Create a copy of the selected area
-	pixel_t **copy =
-	    create_picture((selection->line_end - selection->line_start),
-					   (selection->column_end - selection->column_start));
+	char **parameter = command->parameters;
 
-	// Check if memory allocation for the copy was successful
-	if (!copy)
-		return;
+	// The file may be one still being written
+	finish_saves(&session->saves, NULL);
 
-	short line, column;
-	// Copy pixels from the selected area to the copy
-	for (line = 0; line < selection->line_end - selection->line_start;
-	     line++) {
-		for (column = 0;
-		     column < selection->column_end - selection->column_start;
-		     column++) {
-			copy[line][column] =
-			    image->picture[line + selection->line_start]
-					  [column + selection->column_start];
-		}
+	if (strlen(parameter[0]) && !strlen(parameter[1])) {
+		load_command(current_image(session), current_selection(session),
+					 parameter[0], session->pyramid);
+	} else if (strlen(parameter[0]) && !strlen(parameter[2])) {
+		// Load into a named slot
+		load_slot_command(session, parameter[0], parameter[1]);
+	} else {
+		fprintf(output(), "Invalid command\n");
 	}
+}
 
-	// Free memory used by the original image
-	free_picture(&image->picture, image->height);
+void handle_use(session_t *session, command_t *command)
+{
+	char **parameter = command->parameters;
 
-	// Update the image structure with the cropped image
-	image->picture = copy;
-	image->height = selection->line_end - selection->line_start;
-	image->width = selection->column_end - selection->column_start;
+	if (strlen(parameter[0]) && !strlen(parameter[1]))
+		use_command(session, parameter[0]);
+	else
+		fprintf(output(), "Invalid command\n");
+}
+
+void handle_close(session_t *session, command_t *command)
+{
+	char **parameter = command->parameters;
+
+	if (strlen(parameter[0]) && !strlen(parameter[1]))
+		close_command(session, parameter[0]);
+	else
+		fprintf(output(), "Invalid command\n");
+}
+
+void handle_select(session_t *session, command_t *command)
+{
+	char **parameter = command->parameters;
+
+	select_command(*current_image(session), current_selection(session),
+				   parameter[0], parameter[1], parameter[2], parameter[3],
+				   parameter[4]);
+}
+
+void handle_histogram(session_t *session, command_t *command)
+{
+	char **parameter = command->parameters;
+
+	histogram_command(current_image(session), parameter[0], parameter[1],
+					  parameter[2], parameter[3], session->pyramid);
+}
+
+void handle_equalize(session_t *session, command_t *command)
+{
+	image_t *image = current_image(session);
+
+	char **parameter = command->parameters;
+
+	// RGB equalizes each channel of a color image
+	bool channels = !strcmp(parameter[0], "RGB");
+	if ((strlen(parameter[0]) && !channels) || strlen(parameter[1]))
+		fprintf(output(), "Invalid command\n");
+	else if (!image->picture)
+		fprintf(output(), "No image loaded\n");
+	else if (image->color && !channels)
+		fprintf(output(), "Black and white image needed\n");
+	else
+		equalize(image);
+}
+
+void handle_convert(session_t *session, command_t *command)
+{
+	char **parameter = command->parameters;
+
+	convert_command(current_image(session), parameter[0], parameter[1],
+					parameter[2]);
+}
+
+void handle_rotate(session_t *session, command_t *command)
+{
+	char **parameter = command->parameters;
 
-	// Update the selection area to cover the entire cropped image
-	selection->all = true;
-	selection->line_start = 0;
-	selection->line_end = image->height;
-	selection->column_start = 0;
-	selection->column_end = image->width;
+	rotate_command(current_image(session), current_selection(session),
+				   parameter[0], parameter[1]);
+}
 
-	// Print a message indicating the completion of cropping
-	printf("Image cropped\n");
+void handle_crop(session_t *session, command_t *command)
+{
+	image_t *image = current_image(session);
+	area_t *selection = current_selection(session);
+
+	if (strlen(command->parameters[0]))
+		fprintf(output(), "Invalid command\n");
+	else if (!image->picture)
+		fprintf(output(), "No image loaded\n");
+	else if (selection->all)
+		fprintf(output(), "Image cropped\n");
+	else
+		crop(image, selection);
 }
 
-// Function to apply an edge filter to the specified area of the image
-//
-// Parameters:
-//	 - image: Pointer to the image structure to be modified
-//	 - selection: Area selection structure specifying the region to apply
-//				  the edge filter
-//
-// Returns:
-//   - A dynamically allocated copy of the image with the edge filter applied
-pixel_t **apply_edge(image_t image, area_t selection)
+void handle_resize(session_t *session, command_t *command)
 {
-	// Create a copy of the image
-	pixel_t **copy = create_picture(image.height, image.width);
+	char **parameter = command->parameters;
 
-	// Check if memory allocation for the copy was successful
-	if (!copy)
-		return NULL;
+	resize_command(current_image(session), current_selection(session),
+				   parameter[0], parameter[1], parameter[2]);
+}
 
-	unsigned short line, column;
-	// Iterate through each pixel in the image
-	for (line = 0; line < image.height; line++) {
-		for (column = 0; column < image.width; column++) {
-			// Check if the pixel is within the specified area or on the image
-			// boundary
-			if ((line < selection.line_start ||
-			     line > selection.line_end - 1 ||
-			     column < selection.column_start ||
-			     column > selection.column_end - 1) ||
-			    (line == image.height - 1 || line == 0 ||
-			     column == image.width - 1 || column == 0)) {
-				// If so, copy the pixel as is
-				copy[line][column] =
-				    image.picture[line][column];
-			} else {
-				// Apply the edge filter to the pixel
-				copy[line][column].red =
-					clamp(8 * image.picture[line][column].red -
-						image.picture[line - 1][column - 1].red -
-						image.picture[line - 1][column].red -
-						image.picture[line - 1][column + 1].red -
-						image.picture[line][column - 1].red -
-						image.picture[line][column + 1].red -
-						image.picture[line + 1][column - 1].red -
-						image.picture[line + 1][column].red -
-						image.picture[line + 1][column + 1].red);
-
-				copy[line][column].green =
-					clamp(8 * image.picture[line][column].green -
-						image.picture[line - 1][column - 1].green -
-						image.picture[line - 1][column].green -
-						image.picture[line - 1][column + 1].green -
-						image.picture[line][column - 1].green -
-						image.picture[line][column + 1].green -
-						image.picture[line + 1][column - 1].green -
-						image.picture[line + 1][column].green -
-						image.picture[line + 1][column + 1].green);
-
-				copy[line][column].blue =
-					clamp(8 * image.picture[line][column].blue -
-						image.picture[line - 1][column - 1].blue -
-						image.picture[line - 1][column].blue -
-						image.picture[line - 1][column + 1].blue -
-						image.picture[line][column - 1].blue -
-						image.picture[line][column + 1].blue -
-						image.picture[line + 1][column - 1].blue -
-						image.picture[line + 1][column].blue -
-						image.picture[line + 1][column + 1].blue);
-			}
-		}
+void handle_apply(session_t *session, command_t *command)
+{
+	char **parameter = command->parameters;
+	border_t border = BORDER_KEEP;
+	unsigned short count = 0;
+
+	// A last parameter CLAMP, MIRROR or WRAP sets the border mode (and is
+	// dropped)
+	while (count < MAX_PARAMETERS && strlen(parameter[count]))
+		count++;
+	if (count > 1) {
+		border = find_border(parameter[count - 1]);
+		if (border != BORDER_KEEP)
+			parameter[count - 1] += strlen(parameter[count - 1]);
 	}
 
-	// Return the dynamically allocated copy of the image with the edge filter
-	// applied
-	return copy;
+	apply_command(current_image(session), *current_selection(session),
+				  parameter[0], parameter[1], parameter[2], border);
 }
 
-// Function to apply a sharpening filter to the specified area of the image
+// Function to handle the "MORPH" command
 //
 // Parameters:
-//	 - image: Pointer to the image structure to be modified
-//	 - selection: Area selection structure specifying the region to apply
-//				  the sharpening filter
-//
-// Returns:
-//   - A dynamically allocated copy of the image with the sharpening filter
-//	   applied
-pixel_t **apply_sharpen(image_t image, area_t selection)
+//	 - session: Pointer to the session
+//	 - command: Pointer to the command
+void handle_morph(session_t *session, command_t *command)
 {
-	// Create a copy of the image
-	pixel_t **copy = create_picture(image.height, image.width);
-
-	// Check if memory allocation for the copy was successful
-	if (!copy)
-		return NULL;
-
-	unsigned short line, column;
-	// Iterate through each pixel in the image
-	for (line = 0; line < image.height; line++) {
-		for (column = 0; column < image.width; column++) {
-			// Check if the pixel is within the specified area or on the image
-			// boundary
-			if ((line < selection.line_start ||
-			     line > selection.line_end - 1 ||
-			     column < selection.column_start ||
-			     column > selection.column_end - 1) ||
-			    (line == image.height - 1 || line == 0 ||
-			     column == image.width - 1 || column == 0)) {
-				// If so, copy the pixel as is
-				copy[line][column] =
-				    image.picture[line][column];
-			} else {
-				// Apply the sharpening filter to the pixel
-				copy[line][column].red =
-				    clamp(5 * image.picture[line][column].red -
-					  image.picture[line - 1][column].red -
-					  image.picture[line][column - 1].red -
-					  image.picture[line][column + 1].red -
-					  image.picture[line + 1][column].red);
-
-				copy[line][column].green =
-					clamp(5 * image.picture[line][column].green -
-						image.picture[line - 1][column].green -
-						image.picture[line][column - 1].green -
-						image.picture[line][column + 1].green -
-						image.picture[line + 1][column].green);
-
-				copy[line][column].blue =
-				    clamp(5 * image.picture[line][column].blue -
-					  image.picture[line - 1][column].blue -
-					  image.picture[line][column - 1].blue -
-					  image.picture[line][column + 1].blue -
-					  image.picture[line + 1][column].blue);
-			}
-		}
-	}
+	char **parameter = command->parameters;
 
-	// Return the dynamically allocated copy of the image with the sharpening
-	// filter applied
-	return copy;
+	morph_command(current_image(session), *current_selection(session),
+				  parameter[0], parameter[1], parameter[2]);
 }
 
-// Function to apply a blur filter to the specified area of the image
+// Function to check whether the lines still to be read from a file are read
+// from another one
 //
 // Parameters:
-//	 - image: Pointer to the image structure to be modified
-//	 - selection: Area selection structure specifying the region to apply
-//				  the blur filter
+//	 - source: Pointer to the lines not decoded yet (or NULL)
+//	 - status: The status of the other file
 //
 // Returns:
-//   - A dynamically allocated copy of the image with the blur filter applied
-pixel_t **apply_blur(image_t image, area_t selection)
+//	 - true if the lines are read from the other file, false otherwise
+bool reads_file(source_t *source, struct stat *status)
 {
-	// Create a copy of the image
-	pixel_t **copy = create_picture(image.height, image.width);
-
-	// Check if memory allocation for the copy was successful
-	if (!copy)
-		return NULL;
-
-	unsigned short line, column;
-	// Iterate through each pixel in the image
-	for (line = 0; line < image.height; line++) {
-		for (column = 0; column < image.width; column++) {
-			// Check if the pixel is within the specified area or on the image
-			// boundary
-			if ((line < selection.line_start ||
-			     line > selection.line_end - 1 ||
-			     column < selection.column_start ||
-			     column > selection.column_end - 1) ||
-			    (line == image.height - 1 || line == 0 ||
-			     column == image.width - 1 || column == 0)) {
-				// If so, copy the pixel as is
-				copy[line][column] =
-				    image.picture[line][column];
-			} else {
-				// Apply the blur filter to the pixel
-				copy[line][column].red =
-					round_double(1. *
-						(image.picture[line - 1][column - 1].red +
-						image.picture[line - 1][column].red +
-						image.picture[line - 1][column + 1].red +
-						image.picture[line][column - 1].red +
-						image.picture[line][column].red +
-						image.picture[line][column + 1].red +
-						image.picture[line + 1][column - 1].red +
-						image.picture[line + 1][column].red +
-						image.picture[line + 1][column + 1].red) /
-						9.);
-
-				copy[line][column].green =
-					round_double(1. *
-						(image.picture[line - 1][column - 1].green +
-						image.picture[line - 1][column].green +
-						image.picture[line - 1][column + 1].green +
-						image.picture[line][column - 1].green +
-						image.picture[line][column].green +
-						image.picture[line][column + 1].green +
-						image.picture[line + 1][column - 1].green +
-						image.picture[line + 1][column].green +
-						image.picture[line + 1][column + 1].green) /
-						9.);
-
-				copy[line][column].blue =
-					round_double(1. *
-						(image.picture[line - 1][column - 1].blue +
-						image.picture[line - 1][column].blue +
-						image.picture[line - 1][column + 1].blue +
-						image.picture[line][column - 1].blue +
-						image.picture[line][column].blue +
-						image.picture[line][column + 1].blue +
-						image.picture[line + 1][column - 1].blue +
-						image.picture[line + 1][column].blue +
-						image.picture[line + 1][column + 1].blue) /
-						9.);
-			}
-		}
-	}
+	struct stat own;
 
-	// Return the dynamically allocated copy of the image with the blur filter
-	// applied
-	return copy;
+	return source && !fstat(source->file, &own) &&
+		   own.st_dev == status->st_dev && own.st_ino == status->st_ino;
 }
 
-// Function to apply a Gaussian blur filter to the specified area of the image
+// Function to decode every line still to be read from a file, by the images
+// of a session and the pictures of their histories, before it is written
+// over (which would change what the lines are decoded from)
 //
 // Parameters:
-//	 - image: Pointer to the image structure to be modified
-//	 - selection: Area selection structure specifying the region to apply
-//				  the Gaussian blur filter
+//	 - session: Pointer to the session
+//	 - file_name: The name of the file about to be written
 //
 // Returns:
-//   - A dynamically allocated copy of the image with the Gaussian blur filter
-//	   applied
-pixel_t **apply_gaussian_blur(image_t image, area_t selection)
+//	 - true if no line is read from the file anymore, false if memory could
+//	   not be allocated to decode them
+bool release_file(session_t *session, char file_name[FILE_NAME_LENGTH])
 {
-	// Create a copy of the image
-	pixel_t **copy = create_picture(image.height, image.width);
+	struct stat status;
+	unsigned short index, list;
+	bool released = true;
 
-	// Check if memory allocation for the copy was successful
-	if (!copy)
-		return NULL;
+	if (stat(file_name, &status))
+		return true;
 
-	unsigned short line, column;
-	// Iterate through each pixel in the image
-	for (line = 0; line < image.height; line++) {
-		for (column = 0; column < image.width; column++) {
-			// Check if the pixel is within the specified area or on the image
-			// boundary
-			if ((line < selection.line_start ||
-			     line > selection.line_end - 1 ||
-			     column < selection.column_start ||
-			     column > selection.column_end - 1) ||
-			    (line == image.height - 1 || line == 0 ||
-			     column == image.width - 1 || column == 0)) {
-				// If so, copy the pixel as is
-				copy[line][column] =
-				    image.picture[line][column];
-			} else {
-				// Apply the Gaussian blur filter to the pixel
-				copy[line][column].red =
-					round_double(1. *
-						(image.picture[line - 1][column - 1].red +
-						2 * image.picture[line - 1][column].red +
-						image.picture[line - 1][column + 1].red +
-						2 * image.picture[line][column - 1].red +
-						4 * image.picture[line][column].red +
-						2 * image.picture[line][column + 1].red +
-						image.picture[line + 1][column - 1].red +
-						2 * image.picture[line + 1][column].red +
-						image.picture[line + 1][column + 1].red) /
-						16.);
-
-				copy[line][column].green =
-					round_double(1. *
-						(image.picture[line - 1][column - 1].green +
-						2 * image.picture[line - 1][column].green +
-						image.picture[line - 1][column + 1].green +
-						2 * image.picture[line][column - 1].green +
-						4 * image.picture[line][column].green +
-						2 * image.picture[line][column + 1].green +
-						image.picture[line + 1][column - 1].green +
-						2 * image.picture[line + 1][column].green +
-						image.picture[line + 1][column + 1].green) /
-						16.);
-
-				copy[line][column].blue =
-					round_double(1. *
-						(image.picture[line - 1][column - 1].blue +
-						2 * image.picture[line - 1][column].blue +
-						image.picture[line - 1][column + 1].blue +
-						2 * image.picture[line][column - 1].blue +
-						4 * image.picture[line][column].blue +
-						2 * image.picture[line][column + 1].blue +
-						image.picture[line + 1][column - 1].blue +
-						2 * image.picture[line + 1][column].blue +
-						image.picture[line + 1][column + 1].blue) /
-						16.);
+	for (index = 0; index < session->count; index++) {
+		image_t *image = &session->slots[index].image;
+		if (!image->picture)
+			continue;
+
+		if (reads_file(image->source, &status))
+			released = image_require(image, full_area(*image)) && released;
+
+		// The pictures replaced by CROP, RESIZE or ROTATE
+		for (list = 0; image->history && list < 2; list++) {
+			step_t *step = list ? image->history->redo :
+						   image->history->undo;
+			for (; step; step = step->next) {
+				if (!step->picture || !reads_file(step->source, &status))
+					continue;
+
+				image_t replaced;
+				memset(&replaced, 0, sizeof(image_t));
+				replaced.picture = step->picture;
+				replaced.source = step->source;
+				replaced.color = step->color;
+				replaced.height = step->height;
+				replaced.width = step->width;
+				released = image_require(&replaced, full_area(replaced)) &&
+						   released;
+				step->source = replaced.source;
 			}
 		}
 	}
 
-	// Return the dynamically allocated copy of the image with the Gaussian
-	// blur filter applied
-	return copy;
+	return released;
 }
 
-// Function to apply a specified filter to the specified area of the image
+// Function to handle the "SAVE" command
 //
 // Parameters:
-//   - image: Pointer to the image structure to be modified
-//   - selection: Area selection structure specifying the region to apply the
-//				  filter
-//   - parameter_1: String specifying the filter to apply
-//   - parameter_2: Extra parameter (not used for now)
-void apply_command(image_t *image, area_t selection,
-				   char parameter_1[MAX_INPUT_LINE_LENGTH],
-				   char parameter_2[MAX_NUMBER_SIZE + 1])
+//	 - session: Pointer to the session
+//	 - command: Pointer to the command
+void handle_save(session_t *session, command_t *command)
 {
-	// Check if an image is loaded
-	if (!image->picture) {
-		printf("No image loaded\n");
-		return;
+	char **parameter = command->parameters;
+	slot_t *slot = find_slot(session, parameter[0]);
+	save_t **saves = NULL;
+	unsigned short count = 0;
+
+	// A last parameter BACKGROUND saves in the background (and is dropped)
+	while (count < MAX_PARAMETERS && strlen(parameter[count]))
+		count++;
+	if (count > 1 && !strcmp(parameter[count - 1], "BACKGROUND")) {
+		parameter[count - 1] += strlen(parameter[count - 1]);
+		saves = &session->saves;
 	}
 
-	// Check for invalid parameters
-	if (!strlen(parameter_1) || strlen(parameter_2)) {
-		printf("Invalid command\n");
-		return;
+	if (!strlen(parameter[0])) {
+		fprintf(output(), "Invalid command\n");
+	} else if (slot && strlen(parameter[1]) && strcmp(parameter[1], "ascii") &&
+			   strcmp(parameter[1], "native")) {
+		// Save a named slot
+		finish_saves(&session->saves, parameter[1]);
+		if (!image_require(&slot->image, full_area(slot->image)) ||
+		    !release_file(session, parameter[1]))
+			fprintf(output(), "Not enough memory\n");
+		else
+			save_command(&slot->image, parameter[1], parameter[2], saves);
+	} else {
+		image_t *image = current_image(session);
+		finish_saves(&session->saves, parameter[0]);
+		if (!image_require(image, full_area(*image)) ||
+		    !release_file(session, parameter[0]))
+			fprintf(output(), "Not enough memory\n");
+		else
+			save_command(image, parameter[0], parameter[1], saves);
 	}
+}
 
-	// Check if the image is a grayscale image
-	if (!image->color) {
-		printf("Easy, Charlie Chaplin\n");
-		return;
-	}
+void handle_preview(session_t *session, command_t *command)
+{
+	char **parameter = command->parameters;
 
-	// Declare a variable to store the resulting image after applying the filter
-	pixel_t **new_image;
+	if (strlen(parameter[0]) && !release_file(session, parameter[0]))
+		fprintf(output(), "Not enough memory\n");
+	else if (strlen(parameter[0]))
+		preview_command(current_image(session), parameter[0], parameter[1],
+						session->pyramid);
+	else
+		fprintf(output(), "Invalid command\n");
+}
 
-	// Compare the input parameter with different filter options
-	if (!strcmp(parameter_1, "EDGE")) {
-		// Apply the edge filter
-		new_image = apply_edge(*image, selection);
-	} else if (!strcmp(parameter_1, "SHARPEN")) {
-		// Apply the sharpen filter
-		new_image = apply_sharpen(*image, selection);
-	} else if (!strcmp(parameter_1, "BLUR")) {
-		// Apply the blur filter
-		new_image = apply_blur(*image, selection);
-	} else if (!strcmp(parameter_1, "GAUSSIAN_BLUR")) {
-		// Apply the Gaussian blur filter
-		new_image = apply_gaussian_blur(*image, selection);
-	} else {
-		// Print an error message if the input parameter is not valid
-		printf("APPLY parameter invalid\n");
-		return;
-	}
+void handle_stats(session_t *session, command_t *command)
+{
+	stats_command(current_image(session), *current_selection(session),
+				  command->parameters[0]);
+}
 
-	// Check if the filter application was successful (new_image is not NULL)
-	if (new_image) {
-		// Free the memory of the original image
-		free_picture(&image->picture, image->height);
-		// Update the image structure with the new image
-		image->picture = new_image;
+void handle_pyramid(session_t *session, command_t *command)
+{
+	pyramid_command(current_image(session), &session->pyramid,
+					command->parameters[0]);
+}
 
-		// Print a success message
-		printf("APPLY %s done\n", parameter_1);
-	}
+void handle_undo(session_t *session, command_t *command)
+{
+	if (strlen(command->parameters[0]))
+		fprintf(output(), "Invalid command\n");
+	else
+		undo_command(current_image(session), current_selection(session),
+					 false);
+}
+
+void handle_redo(session_t *session, command_t *command)
+{
+	if (strlen(command->parameters[0]))
+		fprintf(output(), "Invalid command\n");
+	else
+		undo_command(current_image(session), current_selection(session),
+					 true);
+}
+
+void handle_history(session_t *session, command_t *command)
+{
+	if (strlen(command->parameters[1]))
+		fprintf(output(), "Invalid command\n");
+	else
+		history_command(session, command->parameters[0]);
 }
 
-// Function to save an image in P2 format
+// Function to compute the hash of a command (FNV-1a)
 //
 // Parameters:
-//	 - image: Image structure containing the data to be saved
-//	 - file_name: String specifying the name of the file to save
-void save_P2(image_t image, char file_name[FILE_NAME_LENGTH])
+//	 - name: The command
+//
+// Returns:
+//	 - The index of the command in the hash table, before any collision
+unsigned int hash_command(const char *name)
 {
-	// Open the file for writing
-	FILE *file = fopen(file_name, "wt");
-
-	// Check if the file is opened successfully
-	if (!file)
-		return;
+	unsigned int hash = 2166136261u;
+	while (*name) {
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619u;
+	}
 
-	// Write the P2 header information to the file
-	fprintf(file, "P2\n# %s\n%hd %hd\n%hd\n", file_name, image.width,
-			image.height, MAX_VALUE);
+	return hash & (DISPATCH_TABLE_SIZE - 1);
+}
 
-	// Write the pixel values to the file
-	short line, column;
-	for (line = 0; line < image.height; line++) {
-		for (column = 0; column < image.width; column++)
-			fprintf(file, "%3hd ", image.picture[line][column].red);
-		fprintf(file, "\n");
-	}
+// Function to add a command to the hash table, in the first free entry
+// starting from its hash
+//
+// Parameters:
+//	 - name: The command
+//	 - handle: The function executing it
+//	 - lazy: Whether it decodes the lines of the image it needs itself
+void add_command(const char *name, void (*handle)(session_t *, command_t *),
+				 bool lazy)
+{
+	unsigned int index = hash_command(name);
+	while (dispatch_table[index].name)
+		index = (index + 1) & (DISPATCH_TABLE_SIZE - 1);
 
-	// Close the file
-	fclose(file);
+	dispatch_table[index].name = name;
+	dispatch_table[index].handle = handle;
+	dispatch_table[index].lazy = lazy;
+}
 
-	printf("Saved %s\n", file_name);
+// Function to build the hash table of the commands (see pthread_once)
+void build_dispatch_table(void)
+{
+	add_command("LOAD", handle_load, true);
+	add_command("USE", handle_use, true);
+	add_command("CLOSE", handle_close, true);
+	add_command("SELECT", handle_select, true);
+	add_command("HISTOGRAM", handle_histogram, false);
+	add_command("EQUALIZE", handle_equalize, false);
+	add_command("CONVERT", handle_convert, false);
+	add_command("ROTATE", handle_rotate, true);
+	add_command("CROP", handle_crop, true);
+	add_command("RESIZE", handle_resize, true);
+	add_command("APPLY", handle_apply, false);
+	add_command("MORPH", handle_morph, false);
+	add_command("SAVE", handle_save, true);
+	add_command("PREVIEW", handle_preview, false);
+	add_command("STATS", handle_stats, false);
+	add_command("PYRAMID", handle_pyramid, false);
+	add_command("UNDO", handle_undo, true);
+	add_command("REDO", handle_redo, true);
+	add_command("HISTORY", handle_history, true);
 }
 
-// Function to save an image in P3 format
+// Function to find the function executing a command
 //
 // Parameters:
-//	 - image: Image structure containing the data to be saved
-//	 - file_name: String specifying the name of the file to save
-void save_P3(image_t image, char file_name[FILE_NAME_LENGTH])
+//	 - name: The command
+//
+// Returns:
+//	 - Pointer to the entry of the command or NULL if it does not exist
+dispatch_t *find_command(const char *name)
 {
-	// Open the file for writing
-	FILE *file = fopen(file_name, "wt");
+	pthread_once(&dispatch_once, build_dispatch_table);
 
-	// Check if the file is opened successfully
-	if (!file)
-		return;
+	unsigned int index = hash_command(name);
+	while (dispatch_table[index].name) {
+		if (!strcmp(dispatch_table[index].name, name))
+			return &dispatch_table[index];
+		index = (index + 1) & (DISPATCH_TABLE_SIZE - 1);
+	}
+
+	return NULL;
+}
 
-	// Write the P3 header information to the file
-	fprintf(file, "P3\n# %s\n%hd %hd\n%hd\n", file_name, image.width,
-			image.height, MAX_VALUE);
+// Function to execute a command on the current image of a session
+//
+// Parameters:
+//	 - session: Pointer to the session
+//	 - command: The command and its parameters
+//
+// Returns:
+//	 - false if the command was EXIT (the images are freed), true otherwise
+bool execute_command(session_t *session, command_t *command)
+{
+	if (!strcmp(command->name, "EXIT")) {
+		// Execute the EXIT command
+		if (!free_session(session))
+			fprintf(output(), "No image loaded\n");
 
-	// Write the pixel values to the file
-	short line, column;
-	for (line = 0; line < image.height; line++) {
-		for (column = 0; column < image.width; column++)
-			fprintf(file, "%3hd %3hd %3hd ",
-					image.picture[line][column].red,
-					image.picture[line][column].green,
-					image.picture[line][column].blue);
-		fprintf(file, "\n");
+		return false;
 	}
 
-	// Close the file
-	fclose(file);
+	// Look the command up and execute it, decoding the image first unless it
+	// decodes only the lines it needs
+	dispatch_t *entry = find_command(command->name);
+	if (entry && !entry->lazy &&
+	    !image_require(current_image(session),
+					   full_area(*current_image(session))))
+		fprintf(output(), "Not enough memory\n");
+	else if (entry)
+		entry->handle(session, command);
+	else
+		fprintf(output(), "Invalid command\n");
+
+	// Keep a history for the current image (which may have been loaded)
+	limit_history(current_image(session), session->history_limit);
 
-	printf("Saved %s\n", file_name);
+	return true;
 }
 
-// Function to save an image in P5 format
+// Function to read the lines of a file into an array of strings
 //
 // Parameters:
-//	 - image: Image structure containing the data to be saved
-//	 - file_name: String specifying the name of the file to save
-void save_P5(image_t image, char file_name[FILE_NAME_LENGTH])
+//	 - input: The stream to read from
+//	 - lines: Pointer to the array, grown as needed (freed by the caller)
+//	 - count: Pointer to the number of lines in the array, updated
+//	 - skip_empty: Whether to leave out the empty lines
+//
+// Returns:
+//	 - true if the lines were read, false if memory could not be allocated
+bool read_lines(FILE *input, char ***lines, unsigned int *count,
+				bool skip_empty)
 {
-	// Open the file for writing in binary mode
-	FILE *file = fopen(file_name, "wb");
-
-	// Check if the file is opened successfully
-	if (!file)
-		return;
-
-	// Write the P5 header information to the file
-	fprintf(file, "P5\n# %s\n%hd %hd\n%hd\n", file_name, image.width,
-			image.height, MAX_VALUE);
+	char input_line[MAX_INPUT_LINE_LENGTH];
+	while (fgets(input_line, MAX_INPUT_LINE_LENGTH, input)) {
+		// Remove the line terminator
+		input_line[strcspn(input_line, "\r\n")] = '\0';
+		if (skip_empty && !strlen(input_line))
+			continue;
+
+		char **grown = realloc(*lines, (*count + 1) * sizeof(char *));
+		if (!grown)
+			return false;
+		*lines = grown;
+
+		(*lines)[*count] = malloc(strlen(input_line) + 1);
+		if (!(*lines)[*count])
+			return false;
+		strcpy((*lines)[(*count)++], input_line);
+	}
 
-	// Write the pixel values to the file
-	short line, column;
-	for (line = 0; line < image.height; line++)
-		for (column = 0; column < image.width; column++)
-			fputc(image.picture[line][column].red, file);
+	return true;
+}
 
-	// Close the file
-	fclose(file);
+// Function to wait until an image fits in the memory budget of a batch
+//
+// An image bigger than the whole budget is let through when nothing else is
+// in flight, so that it is still processed (on its own)
+//
+// Parameters:
+//	 - batch: Pointer to the batch
+//	 - memory: The estimated memory of the image
+void reserve_memory(batch_t *batch, unsigned long long memory)
+{
+	pthread_mutex_lock(&batch->lock);
+	while (batch->memory && batch->memory + memory > batch->memory_limit)
+		pthread_cond_wait(&batch->released, &batch->lock);
+	batch->memory += memory;
+	pthread_mutex_unlock(&batch->lock);
+}
 
-	printf("Saved %s\n", file_name);
+// Function to give back memory reserved by reserve_memory()
+//
+// Parameters:
+//	 - batch: Pointer to the batch
+//	 - memory: The estimated memory of the image
+void release_memory(batch_t *batch, unsigned long long memory)
+{
+	pthread_mutex_lock(&batch->lock);
+	batch->memory -= memory;
+	pthread_cond_broadcast(&batch->released);
+	pthread_mutex_unlock(&batch->lock);
 }
 
-// Function to save an image in P6 format
+// Function to take the next file to be processed by a batch worker
+//
+// The worker takes the files of its own queue from the front. Once it is
+// empty, it steals the back half of the queue of another worker, so that the
+// workers given the biggest files do not end up working alone
 //
 // Parameters:
-//	 - image: Image structure containing the data to be saved
-//	 - file_name: String specifying the name of the file to save
-void save_P6(image_t image, char file_name[FILE_NAME_LENGTH])
+//	 - batch: Pointer to the batch
+//	 - index: The index of the queue of the worker
+//	 - file: Pointer to store the index of the file to be processed
+//
+// Returns:
+//	 - true if a file was taken, false if all the queues are empty
+bool take_file(batch_t *batch, unsigned short index, unsigned int *file)
 {
-	// Open the file for writing in binary mode
-	FILE *file = fopen(file_name, "wb");
+	queue_t *queue = &batch->queues[index];
+	unsigned short other;
+
+	// Take the next file of the queue of the worker
+	pthread_mutex_lock(&queue->lock);
+	if (queue->start < queue->end) {
+		*file = queue->start++;
+		pthread_mutex_unlock(&queue->lock);
+		return true;
+	}
+	pthread_mutex_unlock(&queue->lock);
+
+	// Steal from the other queues, starting with the next one
+	for (other = 1; other < batch->workers; other++) {
+		queue_t *victim = &batch->queues[(index + other) % batch->workers];
+		unsigned int start, end;
+
+		pthread_mutex_lock(&victim->lock);
+		start = victim->end - (victim->end - victim->start) / 2;
+		end = victim->end;
+		if (victim->start < victim->end && start == end)
+			start--;
+		victim->end = start;
+		pthread_mutex_unlock(&victim->lock);
+
+		if (start == end)
+			continue;
+
+		// Keep the first stolen file, the others go to the queue
+		pthread_mutex_lock(&queue->lock);
+		queue->start = start + 1;
+		queue->end = end;
+		pthread_mutex_unlock(&queue->lock);
+
+		*file = start;
+		return true;
+	}
 
-	// Check if the file is opened successfully
-	if (!file)
-		return;
+	return false;
+}
 
-	// Write the P6 header information to the file
-	fprintf(file, "P6\n# %s\n%hd %hd\n%hd\n", file_name, image.width,
-			image.height, MAX_VALUE);
+// Function to process one file of a batch: load it, run the script on it and
+// save the result to the output directory
+//
+// The messages of the commands are gathered and written to STDOUT in one
+// piece, so that the messages of different files are not interleaved
+//
+// Parameters:
+//	 - batch: Pointer to the batch
+//	 - file_name: The name of the file
+void process_file(batch_t *batch, char *file_name)
+{
+	char input_line[MAX_INPUT_LINE_LENGTH], path[2 * FILE_NAME_LENGTH + 1], *base_name, *messages = NULL;
+	size_t length = 0;
+	struct stat status;
+	unsigned int line;
+
+	// Estimate the memory of the image: at most one pixel for each byte of
+	// the file, and a working copy of the picture
+	unsigned long long memory = 0;
+	if (!stat(file_name, &status))
+		memory = 2 * sizeof(pixel_t) * (unsigned long long)status.st_size;
+	reserve_memory(batch, memory);
+
+	// Gather the messages of this file, falling back to STDOUT
+	context_t context = { open_memstream(&messages, &length), 1, NULL };
+	if (!context.output)
+		context.output = stdout;
+	set_context(&context);
+
+	// Build the name of the result, in the output directory
+	base_name = strrchr(file_name, '/') ? strrchr(file_name, '/') + 1
+										: file_name;
+	if (strlen(file_name) >= FILE_NAME_LENGTH ||
+	    snprintf(path, sizeof(path), "%s/%s", batch->directory, base_name) >=
+	    (int)sizeof(path)) {
+		fprintf(output(), "File name too long %s\n", file_name);
+	} else {
+		session_t session;
+		init_session(&session);
+		image_t *image = &session.slots[0].image;
+		load_command(image, &session.slots[0].selection, file_name, false);
+
+		// Run the script, unless the image could not be loaded
+		bool running = image->picture != NULL;
+		for (line = 0; running && line < batch->lines; line++) {
+			command_t command;
+			strcpy(input_line, batch->script[line]);
+			parse_command(input_line, &command);
+			running = execute_command(&session, &command);
+		}
 
-	// Write the RGB pixel values to the file
-	short line, column;
-	for (line = 0; line < image.height; line++) {
-		for (column = 0; column < image.width; column++) {
-			fputc(image.picture[line][column].red, file);
-			fputc(image.picture[line][column].green, file);
-			fputc(image.picture[line][column].blue, file);
+		// Save the current image (in binary format) and free the images
+		if (running) {
+			image = &session.slots[session.current].image;
+			if (!image_require(image, full_area(*image)))
+				fprintf(output(), "Not enough memory\n");
+			else if (image->picture)
+				save_image(*image, path, image->color ? 6 : 5);
+			free_session(&session);
 		}
 	}
 
-	// Close the file
-	fclose(file);
+	set_context(NULL);
+	release_memory(batch, memory);
+
+	// Write the messages of the file
+	if (context.output != stdout) {
+		fclose(context.output);
+		pthread_mutex_lock(&batch->lock);
+		fwrite(messages, 1, length, stdout);
+		fflush(stdout);
+		pthread_mutex_unlock(&batch->lock);
+		free(messages);
+	}
+}
+
+// Function to process files until there is none left (thread entry point)
+//
+// Parameters:
+//	 - argument: Pointer to the worker_t structure describing the worker
+//
+// Returns:
+//	 - NULL
+void *run_worker(void *argument)
+{
+	worker_t *worker = argument;
+	unsigned int file;
+
+	while (take_file(worker->batch, worker->index, &file))
+		process_file(worker->batch, worker->batch->files[file]);
 
-	printf("Saved %s\n", file_name);
+	return NULL;
 }
 
-// Function to save an image based on the required format (P2, P3, P5, P6)
+// Function to run a script on many files in parallel (batch mode)
+//
+// The files are split evenly between the queues of the workers. The parallel
+// commands themselves use a single thread, since the workers already keep the
+// processors busy. The memory of the images in flight is bounded by the
+// IMAGE_EDITOR_BATCH_MEMORY environment variable (in MiB)
 //
 // Parameters:
-//   - image: Image structure containing the data to be saved
-//   - file_name: String specifying the name of the file to save
-//   - parameter_2: String specifying the format ("ascii" for ASCII,
-//					otherwise binary)
-void save_command(image_t image, char file_name[FILE_NAME_LENGTH],
-				  char parameter_2[MAX_NUMBER_SIZE + 1])
+//	 - argc: Number of arguments, the script, the output directory and the
+//	   input files ("-" to read their names from STDIN)
+//	 - argv: The arguments
+//
+// Returns:
+//	 - The exit status of the program
+int batch_command(int argc, char **argv)
 {
-	// Print an error message if no image is loaded
-	if (!image.picture) {
-		printf("No image loaded\n");
-		return;
+	batch_t batch;
+	worker_t workers[MAX_THREADS];
+	pthread_t ids[MAX_THREADS];
+	bool started[MAX_THREADS];
+	unsigned int count = 0, index;
+	bool success = true;
+
+	if (argc < 3) {
+		fprintf(stderr, "Usage: image_editor --batch <script> <directory> "
+				"<file>...\n");
+		return 1;
 	}
 
-	// Check the color type and call the appropriate save function
-	if (!strncmp(parameter_2, "ascii", strlen("ascii"))) {
-		if (!image.color) {
-			// Save grayscale image in ASCII format (P2)
-			save_P2(image, file_name);
+	// Read the script and the names of the files
+	FILE *script = fopen(argv[0], "re");
+	if (!script) {
+		fprintf(stderr, "Failed to load %s\n", argv[0]);
+		return 1;
+	}
+	batch.script = NULL;
+	batch.lines = 0;
+	success = read_lines(script, &batch.script, &batch.lines, true);
+	fclose(script);
+
+	batch.files = NULL;
+	for (index = 2; success && index < (unsigned int)argc; index++) {
+		if (!strcmp(argv[index], "-")) {
+			success = read_lines(stdin, &batch.files, &count, true);
 		} else {
-			// Save color image in ASCII format (P3)
-			save_P3(image, file_name);
+			char **grown = realloc(batch.files, (count + 1) * sizeof(char *));
+			success = grown != NULL;
+			if (success) {
+				batch.files = grown;
+				batch.files[count] = malloc(strlen(argv[index]) + 1);
+				success = batch.files[count] != NULL;
+				if (success)
+					strcpy(batch.files[count++], argv[index]);
+			}
 		}
-	} else {
-		if (!image.color) {
-			// Save grayscale image in binary format (P5)
-			save_P5(image, file_name);
-		} else {
-			// Save color image in binary format (P6)
-			save_P6(image, file_name);
+	}
+
+	if (success) {
+		batch.directory = argv[1];
+		batch.memory = 0;
+		batch.memory_limit = (unsigned long long)BATCH_MEMORY_LIMIT << 20;
+		char *variable = getenv("IMAGE_EDITOR_BATCH_MEMORY");
+		if (variable && atoi(variable) > 0)
+			batch.memory_limit = (unsigned long long)atoi(variable) << 20;
+		pthread_mutex_init(&batch.lock, NULL);
+		pthread_cond_init(&batch.released, NULL);
+
+		// Split the files evenly between the workers
+		batch.workers = number_of_threads();
+		if (batch.workers > count)
+			batch.workers = count ? count : 1;
+		for (index = 0; index < batch.workers; index++) {
+			pthread_mutex_init(&batch.queues[index].lock, NULL);
+			batch.queues[index].start =
+				(unsigned long long)count * index / batch.workers;
+			batch.queues[index].end =
+				(unsigned long long)count * (index + 1) / batch.workers;
+			workers[index].batch = &batch;
+			workers[index].index = index;
 		}
+
+		// Start a thread for each worker but the first one, which is the
+		// calling thread
+		for (index = 1; index < batch.workers; index++)
+			started[index] = !pthread_create(&ids[index], NULL, run_worker,
+											 &workers[index]);
+		run_worker(&workers[0]);
+
+		// The files of workers that could not be started are stolen by the
+		// others, so only wait for the ones that were
+		for (index = 1; index < batch.workers; index++)
+			if (started[index])
+				pthread_join(ids[index], NULL);
+
+		for (index = 0; index < batch.workers; index++)
+			pthread_mutex_destroy(&batch.queues[index].lock);
+		pthread_cond_destroy(&batch.released);
+		pthread_mutex_destroy(&batch.lock);
+	} else {
+		fprintf(stderr, "Failed to allocate memory\n");
 	}
+
+	// Free the script and the names of the files
+	for (index = 0; index < batch.lines; index++)
+		free(batch.script[index]);
+	free(batch.script);
+	for (index = 0; index < count; index++)
+		free(batch.files[index]);
+	free(batch.files);
+
+	return success ? 0 : 1;
 }
 
-// Function to get command and parameters from user input
+// Function to serve the commands of one client of the daemon (thread entry
+// point)
+//
+// The client has its own session, and the messages of its commands are sent
+// back to it after each command
 //
 // Parameters:
-//	 - command: String to store the command entered by the user
-//	 - parameter_1: String to store the first parameter entered by the user
-//	 - parameter_2: String to store the second parameter entered by the user
-//	 - parameter_3: String to store the third parameter entered by the user
-//	 - parameter_4: String to store the fourth parameter entered by the user
-//	 - parameter_5: String to store the fifth parameter entered by the user
-void get_command(char command[MAX_COMMAND_LENGTH],
-				 char parameter_1[MAX_INPUT_LINE_LENGTH],
-				 char parameter_2[MAX_NUMBER_SIZE + 1],
-				 char parameter_3[MAX_NUMBER_SIZE + 1],
-				 char parameter_4[MAX_NUMBER_SIZE + 1], char parameter_5[1])
+//	 - argument: Pointer to the client_t structure describing the client
+//
+// Returns:
+//	 - NULL
+void *run_client(void *argument)
 {
-	// Read input line from user
-	char input_line[MAX_INPUT_LINE_LENGTH], *input_parameter;
-	fgets(input_line, MAX_INPUT_LINE_LENGTH, stdin);
-
-	// Extract command from input line
-	strcpy(command, strtok(input_line, "\n "));
-
-	// Extract first parameter from input line
-	input_parameter = strtok(NULL, "\n ");
-	if (input_parameter) {
-		strcpy(parameter_1, input_parameter);
-	} else {
-		parameter_1[0] = '\0';
-		parameter_2[0] = '\0';
-		parameter_3[0] = '\0';
-		parameter_4[0] = '\n';
-		parameter_5[0] = '\0';
-		return;
+	client_t *client = argument;
+	command_t command;
+	reader_t reader;
+
+	// Write the messages through a stream on a copy of the socket
+	int output_socket = fcntl(client->socket, F_DUPFD_CLOEXEC, 0);
+	FILE *output_stream = output_socket < 0 ? NULL
+											: fdopen(output_socket, "w");
+	if (!output_stream) {
+		if (output_socket >= 0)
+			close(output_socket);
+		close(client->socket);
+		free(client);
+		return NULL;
 	}
 
-	// Extract second parameter from input line
-	input_parameter = strtok(NULL, "\n ");
-	if (input_parameter) {
-		strcpy(parameter_2, input_parameter);
-	} else {
-		parameter_2[0] = '\0';
-		parameter_3[0] = '\0';
-		parameter_4[0] = '\n';
-		parameter_5[0] = '\0';
-		return;
-	}
+	context_t context = { output_stream, 0, client->cache };
+	set_context(&context);
 
-	// Extract third parameter from input line
-	input_parameter = strtok(NULL, "\n ");
-	if (input_parameter) {
-		strcpy(parameter_3, input_parameter);
-	} else {
-		parameter_3[0] = '\0';
-		parameter_4[0] = '\n';
-		parameter_5[0] = '\0';
-		return;
-	}
+	session_t session;
+	init_session(&session);
 
-	// Extract fourth parameter from input line
-	input_parameter = strtok(NULL, "\n ");
-	if (input_parameter) {
-		strcpy(parameter_4, input_parameter);
-	} else {
-		parameter_4[0] = '\n';
-		parameter_5[0] = '\0';
-		return;
+	// Serve the commands until EXIT or the end of the connection
+	init_reader(&reader, client->socket);
+	while (get_command(&reader, &command)) {
+		bool running = execute_command(&session, &command);
+		fflush(output_stream);
+		if (!running)
+			break;
 	}
 
-	// Extract fifth parameter from input line
-	input_parameter = strtok(NULL, "\n ");
-	if (input_parameter)
-		strcpy(parameter_5, input_parameter);
-	else
-		parameter_5[0] = '\0';
+	free_session(&session);
+	set_context(NULL);
+	fclose(output_stream);
+	close(client->socket);
+	free(client);
+	return NULL;
 }
 
-// Main function to execute the image processing program
-int main(void)
+// Function to run the program as a daemon, serving the commands of many
+// clients over a Unix domain socket (daemon mode)
+//
+// Each client is served by its own thread, with its own session. The loaded
+// images are kept in a cache shared by all the clients, so a file is only
+// read again once it has been modified
+//
+// Parameters:
+//	 - socket_path: The path of the socket to listen on
+//
+// Returns:
+//	 - The exit status of the program (only returns on failure)
+int daemon_command(char *socket_path)
 {
-	// Declare variables to store user commands and parameters
-	char command[MAX_COMMAND_LENGTH], parameter_1[MAX_INPUT_LINE_LENGTH],
-	    parameter_2[MAX_NUMBER_SIZE + 1], parameter_3[MAX_NUMBER_SIZE + 1],
-	    parameter_4[MAX_NUMBER_SIZE + 1], parameter_5[1];
+	struct sockaddr_un address;
+	unsigned short index;
 
-	// Declare a selection area structure
-	area_t selection;
+	if (strlen(socket_path) >= sizeof(address.sun_path)) {
+		fprintf(stderr, "Socket path too long %s\n", socket_path);
+		return 1;
+	}
 
-	// Declare an image structure and initialize the picture pointer to NULL
-	image_t image;
-	image.picture = NULL;
+	// Create the socket, replacing a previous socket (but no other file)
+	struct stat status;
+	bool taken = !lstat(socket_path, &status) && !S_ISSOCK(status.st_mode);
+	int server = taken ? -1 : socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, socket_path);
+	if (!taken)
+		unlink(socket_path);
+	if (server < 0 ||
+	    bind(server, (struct sockaddr *)&address, sizeof(address)) ||
+	    listen(server, SOMAXCONN)) {
+		fprintf(stderr, "Failed to listen on %s\n", socket_path);
+		if (server >= 0)
+			close(server);
+		return 1;
+	}
+
+	// A client closing its connection must not stop the daemon
+	signal(SIGPIPE, SIG_IGN);
 
-	// Main program loop
+	cache_t cache;
+	pthread_rwlock_init(&cache.lock, NULL);
+	cache.count = 0;
+	cache.next = 0;
+	for (index = 0; index < MAX_CACHED_IMAGES; index++)
+		cache.entries[index].image.picture = NULL;
+
+	// Serve each client on its own thread
 	while (true) {
-		// Get user command and parameters
-		get_command(command, parameter_1, parameter_2, parameter_3,
-					parameter_4, parameter_5);
-
-		if (!strcmp(command, "EXIT")) {
-			// Execute the EXIT command
-			if (!image.picture)
-				printf("No image loaded\n");
-			else
-				free_picture(&image.picture, image.height);
-
-			// Exit the program
-			return 0;
+		int connection = accept4(server, NULL, NULL, SOCK_CLOEXEC);
+		if (connection < 0)
+			continue;
+
+		client_t *client = malloc(sizeof(client_t));
+		pthread_t id;
+		if (!client) {
+			close(connection);
+			continue;
 		}
 
-		// Check and execute the appropriate command
-		if (!strcmp(command, "LOAD") && strlen(parameter_1) &&
-		    !strlen(parameter_2)) {
-			// Execute the LOAD command
-			load_command(&image, &selection, parameter_1);
-
-			/* print_image(image); */
-		} else if (!strcmp(command, "SELECT")) {
-			// Execute the SELECT command
-			select_command(image, &selection, parameter_1,
-						   parameter_2, parameter_3, parameter_4,
-						   parameter_5);
-		} else if (!strcmp(command, "HISTOGRAM")) {
-			// Execute the HISTOGRAM command
-			histogram_command(image, parameter_1, parameter_2,
-							  parameter_3);
-		} else if (!strcmp(command, "EQUALIZE") &&
-			   !strlen(parameter_1)) {
-			// Execute the EQUALIZE command
-			if (!image.picture)
-				printf("No image loaded\n");
-			else if (image.color)
-				printf("Black and white image needed\n");
-			else
-				equalize(&image);
-		} else if (!strcmp(command, "ROTATE")) {
-			// Execute the ROTATE command
-			rotate_command(&image, selection, parameter_1);
-		} else if (!strcmp(command, "CROP") && !strlen(parameter_1)) {
-			// Execute the CROP command
-			if (!image.picture) {
-				printf("No image loaded\n");
-			} else {
-				if (selection.all)
-					printf("Image cropped\n");
-				else
-					crop(&image, &selection);
-			}
-		} else if (!strcmp(command, "APPLY")) {
-			// Execute the APPLY command
-			apply_command(&image, selection, parameter_1,
-						  parameter_2);
-		} else if (!strcmp(command, "SAVE") && strlen(parameter_1)) {
-			// Execute the SAVE command
-			save_command(image, parameter_1, parameter_2);
-		} else {
-			// Print an error message for an invalid command
-			printf("Invalid command\n");
+		client->socket = connection;
+		client->cache = &cache;
+		if (pthread_create(&id, NULL, run_client, client)) {
+			close(connection);
+			free(client);
+			continue;
 		}
+		pthread_detach(id);
 	}
 }
+
+// Main function to execute the image processing program
+int main(int argc, char **argv)
+{
+	// A compressor exiting early must not stop the program (see
+	// create_compressed_file())
+	signal(SIGPIPE, SIG_IGN);
+
+	// Run the batch mode if asked to
+	if (argc > 1 && !strcmp(argv[1], "--batch"))
+		return batch_command(argc - 2, argv + 2);
+
+	// Run the daemon mode if asked to
+	if (argc == 3 && !strcmp(argv[1], "--daemon"))
+		return daemon_command(argv[2]);
+
+	// Declare the user command and the reader of STDIN
+	command_t command;
+	reader_t reader;
+	init_reader(&reader, STDIN_FILENO);
+
+	// Declare the session, holding the images and their selections
+	session_t session;
+	init_session(&session);
+
+	// Main program loop, running until EXIT or the end of the input
+	while (get_command(&reader, &command))
+		if (!execute_command(&session, &command))
+			return 0;
+
+	free_session(&session);
+	return 0;
+}
@@ -0,0 +1,79 @@
+#!/bin/bash
+# Runs scripts of commands with the editor and checks what they save
+#
+# Usage: test_commands.sh <editor>
+
+editor=$(realpath "$1")
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+cd "$work"
+
+# The image the scripts start from, in binary (a.pgm), with pseudo-random
+# values (its header names another file, so saving it as a.pgm moves its
+# pixels)
+awk 'BEGIN {
+	seed = 1
+	printf "P2\n64 48\n255\n"
+	for (i = 0; i < 64 * 48; i++) {
+		seed = (seed * 1103515245 + 12345) % 2147483648
+		printf "%d\n", seed % 256
+	}
+}' > image.pgm
+printf "LOAD image.pgm\nSAVE start.pgm\nEXIT\n" | "$editor" > /dev/null
+mv start.pgm a.pgm
+
+failed=0
+
+# Checks that a script leaves the pixels of a.pgm in a file: <name>
+# <commands> <file> (the commands run next to a copy of a.pgm, which is also
+# saved to the file untouched to compare them)
+same_pixels() {
+	rm -rf expected actual
+	mkdir expected actual
+	cp a.pgm expected
+	cp a.pgm actual
+	printf "LOAD a.pgm\nSAVE $3\nEXIT\n" | (cd expected && "$editor" > /dev/null)
+	printf "$2\nEXIT\n" | (cd actual && "$editor" > /dev/null)
+	if ! cmp -s expected/$3 actual/$3; then
+		echo "$1: $3 differs"
+		failed=1
+	fi
+}
+
+# Saving over the file of a picture kept in the history or loaded in
+# another slot, whose lines are still read from it
+same_pixels "SAVE over the file of an undone CROP" \
+	"LOAD a.pgm\nSELECT 0 0 10 10\nCROP\nSAVE a.pgm\nUNDO\nSAVE b.pgm" b.pgm
+same_pixels "SAVE over the file of another slot" \
+	"LOAD x a.pgm\nLOAD y a.pgm\nUSE x\nSAVE a.pgm\nUSE y\nSAVE c.pgm" c.pgm
+
+# Checks what a script prints: <name> <commands> <output>
+same_output() {
+	rm -rf actual
+	mkdir actual
+	cp a.pgm actual
+	printf "$2\nEXIT\n" | (cd actual && "$editor" > stdout)
+	if [ "$(cat actual/stdout)" != "$(printf "$3")" ]; then
+		echo "$1: the output differs"
+		failed=1
+	fi
+}
+
+# Angles that are not numbers
+same_output "ROTATE angles" \
+	"LOAD a.pgm\nROTATE nan\nROTATE inf\nROTATE 45x\nROTATE x\nROTATE 1e1" \
+	"Loaded a.pgm\nUnsupported rotation angle\nUnsupported rotation angle\nInvalid command\nInvalid command\nRotated 10"
+
+# Sizes that are not whole numbers from 1 to 65535
+same_output "RESIZE sizes" \
+	"LOAD a.pgm\nRESIZE 100x 50\nRESIZE 100 50.5\nRESIZE 0 5\nRESIZE 70000 5\nRESIZE 20 30" \
+	"Loaded a.pgm\nInvalid command\nInvalid command\nInvalid command\nInvalid command\nResized 20 30"
+
+# The SAVE commands in the background print how they ended once they are
+# waited for
+same_output "SAVE in the background" \
+	"LOAD a.pgm\nSAVE b.pgm BACKGROUND\nSAVE /dev/full BACKGROUND\nLOAD b.pgm" \
+	"Loaded a.pgm\nSaved b.pgm\nFailed to save /dev/full\nLoaded b.pgm"
+
+[ $failed = 0 ] && echo "commands: all passed"
+exit $failed
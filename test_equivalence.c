@@ -0,0 +1,110 @@
+// Checks that the integer rounding of the editor gives the results of the
+// double rounding it replaced: scale_value() against
+// clamp(round_double(value * MAX_VALUE * 1. / max_value)) and divide_sum()
+// against round_double(1. * sum / divisor)
+//
+// Build and run with make check
+
+#define main image_editor_main
+#include "image_editor.c"
+#undef main
+
+// Function to check scale_value() for every value up to the maximum value,
+// for every maximum value of a file
+//
+// Returns:
+//	 - The number of mismatches
+unsigned long check_scale_value(void)
+{
+	unsigned long mismatches = 0;
+	unsigned long max_value, value;
+
+	for (max_value = 1; max_value <= USHRT_MAX; max_value++)
+		for (value = 0; value <= max_value; value++)
+			if (scale_value(value, max_value) !=
+			    clamp(round_double(value * MAX_VALUE * 1. / max_value))) {
+				if (!mismatches)
+					fprintf(stderr, "scale_value(%lu, %lu)\n", value,
+							max_value);
+				mismatches++;
+			}
+
+	return mismatches;
+}
+
+// Function to check divide_sum() by a divisor for the sums at the edges of
+// every quotient (both roundings grow with the sum, so they then agree on
+// every sum up to 255 times the divisor)
+//
+// Parameters:
+//	 - divisor: The sum of the weights
+//	 - mismatches: The number of mismatches found before (only the first one
+//	   is printed)
+//
+// Returns:
+//	 - The number of mismatches, with the new ones
+unsigned long check_divisor(unsigned long long divisor,
+							unsigned long mismatches)
+{
+	divider_t divider = make_divider(divisor);
+	unsigned long long last = MAX_VALUE * divisor, sum;
+	unsigned short quotient;
+	signed short offset;
+
+	for (quotient = 0; quotient <= MAX_VALUE; quotient++) {
+		// The first sum rounded up to the quotient is (2q - 1) d / 2
+		unsigned long long edge = quotient ?
+								  ((2ULL * quotient - 1) * divisor + 1) / 2 : 0;
+		for (offset = -2; offset <= 2; offset++) {
+			if ((offset < 0 && edge < (unsigned long long)-offset) ||
+			    edge + offset > last)
+				continue;
+
+			sum = edge + offset;
+			if (divide_sum(sum, divider) !=
+			    (unsigned short)round_double(1. * sum / divisor)) {
+				if (!mismatches)
+					fprintf(stderr, "divide_sum(%llu, %llu)\n", sum,
+							divisor);
+				mismatches++;
+			}
+		}
+	}
+
+	return mismatches;
+}
+
+// Function to check divide_sum() for the divisors of the filters: the
+// resampling (every source size and the fixed point of the weights) and the
+// blurs of every radius
+//
+// Returns:
+//	 - The number of mismatches
+unsigned long check_divide_sum(void)
+{
+	unsigned long mismatches = check_divisor(1 << WEIGHT_BITS, 0);
+	unsigned long long divisor, radius;
+
+	for (divisor = 1; divisor <= USHRT_MAX; divisor++)
+		mismatches = check_divisor(divisor, mismatches);
+
+	for (radius = 1; radius <= MAX_BLUR_RADIUS; radius++) {
+		mismatches = check_divisor((2 * radius + 1) * (2 * radius + 1),
+								   mismatches);
+		mismatches = check_divisor((radius + 1) * (radius + 1) *
+								   (radius + 1) * (radius + 1), mismatches);
+	}
+
+	return mismatches;
+}
+
+int main(void)
+{
+	unsigned long scale_mismatches = check_scale_value();
+	unsigned long divide_mismatches = check_divide_sum();
+
+	printf("scale_value: %lu mismatches\n", scale_mismatches);
+	printf("divide_sum: %lu mismatches\n", divide_mismatches);
+
+	return scale_mismatches || divide_mismatches;
+}
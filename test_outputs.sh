@@ -0,0 +1,64 @@
+#!/bin/bash
+# Runs the same commands with the editor and with the editor of a baseline
+# commit (the first one by default) and compares what they print and save
+#
+# Usage: test_outputs.sh <editor> [<baseline commit>]
+
+repository=$(dirname "$(realpath "$0")")
+editor=$(realpath "$1")
+baseline=${2:-$(git -C "$repository" rev-list --max-parents=0 HEAD)}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+git -C "$repository" show "$baseline:image_editor.c" > "$work/baseline.c" &&
+	gcc -O2 -std=c99 "$work/baseline.c" -o "$work/baseline" -lm -pthread ||
+	exit 1
+
+# Images with pseudo-random values: <magic> <width> <height> <max value>
+make_image() {
+	awk -v magic=$1 -v width=$2 -v height=$3 -v max=$4 'BEGIN {
+		channels = magic == "P3" ? 3 : 1
+		seed = width * height + max
+		printf "%s\n# test\n%d %d\n%d\n", magic, width, height, max
+		for (i = 0; i < width * height * channels; i++) {
+			seed = (seed * 1103515245 + 12345) % 2147483648
+			printf "%d\n", seed % (max + 1)
+		}
+	}'
+}
+
+cd "$work"
+make_image P2 37 23 255 > g2.pgm
+make_image P3 41 29 255 > c3.ppm
+make_image P2 20 17 1000 > g2m.pgm
+make_image P2 500 400 255 > g5.pgm
+make_image P3 400 300 255 > c6.ppm
+# The binary images are written by the baseline editor
+printf "LOAD g5.pgm\nSAVE g5.pgm\nLOAD c6.ppm\nSAVE c6.ppm\nEXIT\n" |
+	./baseline > /dev/null
+
+scripts=(
+	"SELECT ALL\nHISTOGRAM 20 8\nHISTOGRAM 10 256\nEQUALIZE\nSAVE a ascii\nSAVE b"
+	"SELECT 3 2 15 14\nROTATE 90\nROTATE -270\nROTATE 180\nSAVE a\nSELECT ALL\nROTATE 90\nROTATE 450\nROTATE -90\nROTATE 270\nSAVE b ascii"
+	"SELECT 1 1 10 10\nAPPLY EDGE\nAPPLY SHARPEN\nSELECT ALL\nAPPLY BLUR\nAPPLY GAUSSIAN_BLUR\nAPPLY FOO\nAPPLY\nSAVE a\nSAVE b ascii"
+	"SELECT 0 0 5 7\nCROP\nSAVE a\nSELECT 9 9 2 2\nSELECT -1 2 3 4\nSELECT a b c d\nSELECT 1 1 2 2 2\nCROP\nSELECT ALL\nCROP\nSAVE b ascii"
+	"SELECT 2 3 20 18\nAPPLY GAUSSIAN_BLUR\nAPPLY BLUR\nAPPLY SHARPEN\nAPPLY EDGE\nSAVE a ascii\nEQUALIZE\nHISTOGRAM 5 4"
+)
+
+failed=0
+for image in g2.pgm c3.ppm g2m.pgm g5.pgm c6.ppm; do
+	for index in "${!scripts[@]}"; do
+		commands="HISTOGRAM 1 2\nLOAD missing\nSAVE x\nLOAD ../$image\n${scripts[$index]}\nEXIT\n"
+		rm -rf before after
+		mkdir before after
+		printf "$commands" | (cd before && ../baseline > stdout 2>&1)
+		printf "$commands" | (cd after && "$editor" > stdout 2>&1)
+		if ! diff -r before after > /dev/null; then
+			echo "$image, script $((index + 1)): outputs differ"
+			failed=1
+		fi
+	done
+done
+
+[ $failed = 0 ] && echo "outputs: same as $baseline"
+exit $failed